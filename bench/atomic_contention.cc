@@ -0,0 +1,159 @@
+// contention of RDMA atomics on one remote word : raw fetch-and-add and a compare-and-swap
+// spin lock protecting a READ-modify-WRITE, over one loopback connection per thread.
+// usage : atomic_contention [gid_idx] [threads] [iters]
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "bench_util.h"
+#include "client.h"
+#include "remote_lock.h"
+#include "server.h"
+
+#define BASE_PORT 23340
+#define SHARED_SIZE 4096
+#define LOCK_OFFSET 0
+#define COUNTER_OFFSET 8
+#define DATA_OFFSET 16
+
+struct Result {
+  double seconds;
+  uint64_t retries;
+};
+
+static std::atomic<int> g_arrived(0);
+
+// all clients start a phase together
+static void Barrier(int threads, int phase) {
+  g_arrived++;
+  while (g_arrived.load() < threads * phase) {
+  }
+}
+
+static void RunClient(int idx, uint32_t gid_idx, int threads, int iters, Histogram *fadd_hist,
+                      Histogram *lock_hist, Result *fadd, Result *lock) {
+  Client client(1, gid_idx);
+  client.Connect("127.0.0.1", std::to_string(BASE_PORT + idx));
+  RemoteRegion shared;
+  client.Recv(client.BufMR(), 0, sizeof(shared));
+  memcpy(&shared, client.Buf(), sizeof(shared));
+
+  MemoryRegion *scratch = client.BufMR();
+  RemoteCounter counter(&client, scratch, 0, COUNTER_OFFSET, &shared);
+  RemoteLock remote_lock(&client, scratch, 0, LOCK_OFFSET, idx + 1, &shared);
+
+  Barrier(threads, 1);
+  uint64_t start = NowNs();
+  for (int i = 0; i < iters; i++) {
+    uint64_t op_start = NowNs();
+    uint64_t ticket;
+    counter.Next(&ticket);
+    fadd_hist->Add(NowNs() - op_start);
+  }
+  fadd->seconds = (NowNs() - start) / 1e9;
+
+  Barrier(threads, 2);
+  WorkRequest read = {.op = RDMA_READ,
+                      .mr = scratch,
+                      .offset = 8,
+                      .length = 8,
+                      .remote_offset = DATA_OFFSET,
+                      .signaled = true,
+                      .remote = &shared};
+  WorkRequest write = read;
+  write.op = RDMA_WRITE;
+  start = NowNs();
+  for (int i = 0; i < iters; i++) {
+    uint64_t op_start = NowNs();
+    remote_lock.Lock();
+    lock_hist->Add(NowNs() - op_start);
+    // a non-atomic increment which is only correct under the lock
+    uint64_t token;
+    client.PostSend(&read, 1, &token);
+    client.Wait(token);
+    (*(uint64_t *)(scratch->addr + 8))++;
+    client.PostSend(&write, 1, &token);
+    client.Wait(token);
+    remote_lock.Unlock();
+  }
+  lock->seconds = (NowNs() - start) / 1e9;
+  lock->retries = remote_lock.Retries();
+  client.Sync();
+}
+
+static void Report(const char *name, int threads, int iters, std::vector<Histogram> &hists,
+                   const std::vector<Result> &results) {
+  Histogram all(threads * iters);
+  double seconds = 0;
+  uint64_t retries = 0;
+  for (int i = 0; i < threads; i++) {
+    seconds = std::max(seconds, results[i].seconds);
+    retries += results[i].retries;
+  }
+  for (auto &hist : hists) {
+    all.Merge(hist);
+  }
+  printf("%-10s %-8d %10.3f %10.2f %10.2f %10lu\n", name, threads,
+         threads * iters / seconds / 1e6, all.Percentile(50), all.Percentile(99), retries);
+}
+
+int main(int argc, char **argv) {
+  uint32_t gid_idx = argc > 1 ? atoi(argv[1]) : 0;
+  int threads = argc > 2 ? atoi(argv[2]) : 4;
+  int iters = argc > 3 ? atoi(argv[3]) : 10000;
+
+  void *shared_buf;
+  int rc = posix_memalign(&shared_buf, SHARED_SIZE, SHARED_SIZE);
+  assert(rc == 0);
+  memset(shared_buf, 0, SHARED_SIZE);
+
+  // listen before any client connects
+  std::vector<std::unique_ptr<Server>> servers;
+  for (int i = 0; i < threads; i++) {
+    servers.emplace_back(new Server(std::to_string(BASE_PORT + i), 1, gid_idx));
+  }
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    Server *server = servers[i].get();
+    workers.emplace_back([=]() {
+      server->Connect();
+      // every QP lives in its own PD, so each one registers the shared words for itself
+      MemoryRegion *mr = server->RegisterMemory(shared_buf, SHARED_SIZE);
+      RemoteRegion shared = mr->Remote();
+      memcpy(server->Buf(), &shared, sizeof(shared));
+      server->Send(server->BufMR(), 0, sizeof(shared));
+      server->Sync();
+    });
+  }
+
+  std::vector<Histogram> fadd_hists(threads, Histogram(iters));
+  std::vector<Histogram> lock_hists(threads, Histogram(iters));
+  std::vector<Result> fadd(threads), lock(threads);
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back(RunClient, i, gid_idx, threads, iters, &fadd_hists[i], &lock_hists[i],
+                         &fadd[i], &lock[i]);
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  printf("%-10s %-8s %10s %10s %10s %10s\n", "op", "threads", "Mops/s", "p50(us)", "p99(us)",
+         "retries");
+  Report("fetch_add", threads, iters, fadd_hists, fadd);
+  Report("lock", threads, iters, lock_hists, lock);
+
+  uint64_t *words = (uint64_t *)shared_buf;
+  uint64_t expect = (uint64_t)threads * iters;
+  uint64_t counter = words[COUNTER_OFFSET / 8];
+  uint64_t data = words[DATA_OFFSET / 8];
+  printf("counter %lu / %lu, locked data %lu / %lu\n", counter, expect, data, expect);
+  servers.clear();
+  free(shared_buf);
+  return counter == expect && data == expect ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+inline uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class Histogram {
+ public:
+  explicit Histogram(size_t capacity) { samples_.reserve(capacity); }
+
+  void Add(uint64_t ns) { samples_.push_back(ns); }
+  void Merge(const Histogram &other) {
+    samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+  }
+  void Clear() { samples_.clear(); }
+  size_t Count() const { return samples_.size(); }
+
+  // p in [0, 100], sorts the samples on first use after Add
+  double Percentile(double p) {
+    if (samples_.empty()) {
+      return 0;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    size_t idx = std::min(samples_.size() - 1, (size_t)(p / 100 * samples_.size()));
+    return samples_[idx] / 1000.0;
+  }
+
+ private:
+  std::vector<uint64_t> samples_;
+};
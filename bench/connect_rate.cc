@@ -0,0 +1,72 @@
+// QP bring up rate of the bulk connect API over a loopback connection, for a growing number
+// of setup threads.
+// usage : connect_rate [gid_idx] [qps]
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include "bench_util.h"
+#include "bulk_connect.h"
+
+#define BASE_PORT 23360
+
+struct Timing {
+  uint64_t create_ns;
+  uint64_t connect_ns;
+};
+
+static bool BringUp(TCPConnector *tcp, std::shared_ptr<Device> device, uint32_t gid_idx, int qps,
+                    int threads, Timing *timing) {
+  RDMAConfig config;
+  config.buf_size = 64;
+  config.max_send_wr = 16;
+  config.max_recv_wr = 16;
+  std::vector<std::unique_ptr<RDMA>> rdmas;
+  // start both sides together so that the connect phase does not include the peer setup
+  tcp->Sync();
+  uint64_t start = NowNs();
+  bool ok = CreateQPs(device, 1, gid_idx, config, qps, &rdmas, threads);
+  uint64_t created = NowNs();
+  ok = ConnectQPs(tcp, rdmas, threads) && ok;
+  timing->create_ns = created - start;
+  timing->connect_ns = NowNs() - created;
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  uint32_t gid_idx = argc > 1 ? atoi(argv[1]) : 0;
+  int qps = argc > 2 ? atoi(argv[2]) : 1024;
+  // both sides share the device and keep it open across runs like a long running process
+  std::shared_ptr<Device> device = Device::Open();
+  if (device == nullptr) {
+    return 1;
+  }
+
+  printf("%-8s %-8s %12s %12s %12s\n", "threads", "qps", "create(ms)", "connect(ms)", "conn/s");
+  int run = 0;
+  for (int threads = 1; threads <= 16; threads *= 2, run++) {
+    std::string port = std::to_string(BASE_PORT + run);
+    TCPConnector listener(port);
+    Timing server_timing;
+    bool server_ok = false;
+    std::thread server_thread([&]() {
+      std::unique_ptr<TCPConnector> tcp = listener.Accept();
+      server_ok = tcp != nullptr &&
+                  BringUp(tcp.get(), device, gid_idx, qps, threads, &server_timing);
+    });
+
+    TCPConnector client;
+    Timing timing;
+    bool ok = client.Connect("127.0.0.1", port) &&
+              BringUp(&client, device, gid_idx, qps, threads, &timing);
+    server_thread.join();
+    if (!ok || !server_ok) {
+      fprintf(stderr, "fail to connect %d QPs with %d threads\n", qps, threads);
+      return 1;
+    }
+    double total_s = (timing.create_ns + timing.connect_ns) / 1e9;
+    printf("%-8d %-8d %12.2f %12.2f %12.0f\n", threads, qps, timing.create_ns / 1e6,
+           timing.connect_ns / 1e6, qps / total_s);
+  }
+  return 0;
+}
@@ -0,0 +1,141 @@
+// bandwidth and message rate of SEND, WRITE, READ and atomics over message sizes and queue
+// depths, printed as JSON. The active side keeps up to qd requests in flight and signals
+// one of every qd / 2 of them.
+// usage : perf_bw [--op=send,write,read,fetch_add,cmp_swap] [--qd=1,16,128]
+//                 [--min_size=2] [--max_size=8388608] [--iters=10000] [--gid_idx=0]
+//                 [--port=23370] [--huge_page] [--dev=soft] [--soft_latency_ns=0]
+//                 [--soft_gbps=0] [--shm]
+#include "bench_util.h"
+#include "perf_util.h"
+
+#define BW_ITERS 10000
+
+// post iters requests with up to qd of them in flight, return the elapsed time
+static uint64_t Stream(PerfPeer *peer, Opcode op, uint32_t size, uint32_t qd, int iters) {
+  RDMA *rdma = peer->rdma;
+  WorkRequest req = {};
+  req.op = op;
+  req.mr = peer->mr;
+  req.length = size;
+  req.remote = &peer->remote;
+  req.compare_add = 1;
+  uint32_t signal = std::max(qd / 2, 1u);
+  std::vector<uint64_t> tokens(qd);
+  int posted = 0;
+  int done = 0;
+  uint64_t start = NowNs();
+  while (done < iters) {
+    while (posted < iters && posted - done < (int)qd) {
+      req.signaled = (posted + 1) % signal == 0 || posted + 1 == iters;
+      if (rdma->PostSend(&req, 1, &tokens[posted % qd]) != 1) {
+        break;
+      }
+      posted++;
+    }
+    rdma->PollCQ();
+    while (done < posted && rdma->IsDone(tokens[done % qd])) {
+      done++;
+    }
+  }
+  return NowNs() - start;
+}
+
+// receives of one SEND case, the ring is as deep as the receive queue
+struct RecvRing {
+  std::vector<uint64_t> tokens;
+  int posted = 0;
+  int done = 0;
+};
+
+// fill the receive queue with up to iters receives in total
+static void Replenish(PerfPeer *peer, uint32_t size, int iters, RecvRing *ring) {
+  RDMA *rdma = peer->rdma;
+  uint32_t depth = ring->tokens.size();
+  while (ring->posted < iters && ring->posted - ring->done < (int)depth) {
+    uint64_t token = rdma->PostRecv(peer->mr, 0, size);
+    if (token == INVALID_TOKEN) {
+      break;
+    }
+    ring->tokens[ring->posted++ % depth] = token;
+  }
+}
+
+// reap receives and repost them at once until iters messages arrived, the queue is at
+// least qd deep, so the sender never hits an RNR NAK while the sink keeps up
+static void Sink(PerfPeer *peer, uint32_t size, int iters, RecvRing *ring) {
+  RDMA *rdma = peer->rdma;
+  uint32_t depth = ring->tokens.size();
+  while (ring->done < iters) {
+    rdma->PollCQ();
+    while (ring->done < ring->posted && rdma->IsDone(ring->tokens[ring->done % depth])) {
+      ring->done++;
+    }
+    Replenish(peer, size, iters, ring);
+  }
+}
+
+int main(int argc, char **argv) {
+  PerfOptions opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    return 1;
+  }
+  if (opts.qds.empty()) {
+    opts.qds = {1, 16, 128};
+  }
+  uint32_t max_qd = *std::max_element(opts.qds.begin(), opts.qds.end());
+  RDMAConfig config;
+  config.buf_size = 64;
+  config.max_send_wr = max_qd;
+  config.max_recv_wr = std::max<uint32_t>(max_qd, RECV_QUEUE_DEPTH);
+  // Stream picks the signaled requests itself
+  config.signal_interval = 0;
+
+  JSONWriter json;
+  fprintf(stderr, "%-10s %-8s %-6s %8s %10s %10s\n", "op", "bytes", "qd", "iters", "Gb/s",
+          "Mpps");
+  bool ok = RunLoopback(opts, config, opts.max_size, [&](PerfPeer *peer, bool active) {
+    for (Opcode op : opts.ops) {
+      for (uint32_t size : Sizes(opts, op)) {
+        for (uint32_t qd : opts.qds) {
+          int iters = ItersFor(opts, size, BW_ITERS);
+          uint64_t ns = 0;
+          // the first SENDs find the whole receive queue posted, as in perftest
+          RecvRing ring;
+          if (!active && op == RDMA_SEND) {
+            ring.tokens.resize(peer->rdma->Config().max_recv_wr);
+            Replenish(peer, size, iters, &ring);
+          }
+          peer->sync();
+          if (active) {
+            ns = Stream(peer, op, size, qd, iters);
+          } else if (op == RDMA_SEND) {
+            Sink(peer, size, iters, &ring);
+          }
+          peer->sync();
+          if (!active) {
+            continue;
+          }
+          double gbps = (double)size * iters * 8 / ns;
+          double mpps = (double)iters * 1000 / ns;
+          fprintf(stderr, "%-10s %-8u %-6u %8d %10.2f %10.3f\n", OpName(op), size, qd, iters,
+                  gbps, mpps);
+          json.Begin();
+          json.Add("test", "bw");
+          json.Add("op", OpName(op));
+          json.Add("bytes", (uint64_t)size);
+          json.Add("qd", (uint64_t)qd);
+          json.Add("iters", (uint64_t)iters);
+          json.Add("gbps", gbps);
+          json.Add("mpps", mpps);
+          json.End();
+        }
+      }
+    }
+  });
+  if (!ok) {
+    fprintf(stderr, "fail to connect the loopback pair\n");
+    return 1;
+  }
+  json.Print();
+  return 0;
+}
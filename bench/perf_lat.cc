@@ -0,0 +1,141 @@
+// latency of SEND, WRITE, READ and atomics over message sizes, printed as JSON. SEND and
+// WRITE are ping-pongs and report half of the round trip, READ and atomics report the round
+// trip of one signaled request, like perftest.
+// usage : perf_lat [--op=send,write,read,fetch_add,cmp_swap] [--min_size=2]
+//                  [--max_size=8388608] [--iters=1000] [--gid_idx=0] [--port=23370]
+//                  [--huge_page] [--dev=soft] [--soft_latency_ns=0] [--soft_gbps=0]
+//                  [--shm]
+#include "bench_util.h"
+#include "perf_util.h"
+
+#define LAT_ITERS 1000
+
+// the buffer receives in its front half and sends from its back half, receives take the
+// whole front half so the one left outstanding in *recv carries over to the next size
+static void SendLat(PerfPeer *peer, bool active, uint32_t size, size_t half, int iters,
+                    uint64_t *recv, Histogram *hist) {
+  RDMA *rdma = peer->rdma;
+  for (int i = 0; i < iters; i++) {
+    uint64_t start = NowNs();
+    if (!active) {
+      rdma->Wait(*recv);
+      *recv = rdma->PostRecv(peer->mr, 0, half);
+    }
+    uint64_t send = rdma->PostSend(RDMA_SEND, peer->mr, half, size, 0, true);
+    if (active) {
+      rdma->Wait(*recv);
+      *recv = rdma->PostRecv(peer->mr, 0, half);
+    }
+    rdma->Wait(send);
+    if (active) {
+      hist->Add((NowNs() - start) / 2);
+    }
+  }
+}
+
+// each side spins on the last byte of the message the peer writes into its front half
+static void WriteLat(PerfPeer *peer, bool active, uint32_t size, size_t half, int iters,
+                     Histogram *hist) {
+  RDMA *rdma = peer->rdma;
+  volatile char *recv_flag = peer->mr->addr + size - 1;
+  char *send_flag = peer->mr->addr + half + size - 1;
+  WorkRequest req = {};
+  req.op = RDMA_WRITE;
+  req.mr = peer->mr;
+  req.offset = half;
+  req.length = size;
+  req.signaled = true;
+  req.remote = &peer->remote;
+  for (int i = 0; i < iters; i++) {
+    char seq = i % 255 + 1;
+    uint64_t start = NowNs();
+    if (!active) {
+      while (*recv_flag != seq) {
+      }
+    }
+    *send_flag = seq;
+    uint64_t token;
+    rdma->PostSend(&req, 1, &token);
+    if (active) {
+      while (*recv_flag != seq) {
+      }
+    }
+    rdma->Wait(token);
+    if (active) {
+      hist->Add((NowNs() - start) / 2);
+    }
+  }
+}
+
+static void OneSidedLat(PerfPeer *peer, Opcode op, uint32_t size, size_t half, int iters,
+                        Histogram *hist) {
+  RDMA *rdma = peer->rdma;
+  WorkRequest req = {};
+  req.op = op;
+  req.mr = peer->mr;
+  req.offset = half;
+  req.length = size;
+  req.signaled = true;
+  req.remote = &peer->remote;
+  req.compare_add = 1;
+  for (int i = 0; i < iters; i++) {
+    uint64_t start = NowNs();
+    uint64_t token;
+    rdma->PostSend(&req, 1, &token);
+    rdma->Wait(token);
+    hist->Add(NowNs() - start);
+  }
+}
+
+int main(int argc, char **argv) {
+  PerfOptions opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    return 1;
+  }
+  RDMAConfig config;
+  config.buf_size = 64;
+  size_t half = opts.max_size;
+
+  JSONWriter json;
+  fprintf(stderr, "%-10s %-8s %8s %10s %10s %10s\n", "op", "bytes", "iters", "p50(us)",
+          "p99(us)", "p99.9(us)");
+  bool ok = RunLoopback(opts, config, 2 * half, [&](PerfPeer *peer, bool active) {
+    // posted before the first sync, so the first SEND of the peer always finds it
+    uint64_t recv = peer->rdma->PostRecv(peer->mr, 0, half);
+    for (Opcode op : opts.ops) {
+      for (uint32_t size : Sizes(opts, op)) {
+        int iters = ItersFor(opts, size, LAT_ITERS);
+        Histogram hist(iters);
+        peer->sync();
+        if (op == RDMA_SEND) {
+          SendLat(peer, active, size, half, iters, &recv, &hist);
+        } else if (op == RDMA_WRITE) {
+          WriteLat(peer, active, size, half, iters, &hist);
+        } else if (active) {
+          OneSidedLat(peer, op, size, half, iters, &hist);
+        }
+        peer->sync();
+        if (!active) {
+          continue;
+        }
+        fprintf(stderr, "%-10s %-8u %8d %10.2f %10.2f %10.2f\n", OpName(op), size, iters,
+                hist.Percentile(50), hist.Percentile(99), hist.Percentile(99.9));
+        json.Begin();
+        json.Add("test", "lat");
+        json.Add("op", OpName(op));
+        json.Add("bytes", (uint64_t)size);
+        json.Add("iters", (uint64_t)iters);
+        json.Add("p50_us", hist.Percentile(50));
+        json.Add("p99_us", hist.Percentile(99));
+        json.Add("p999_us", hist.Percentile(99.9));
+        json.End();
+      }
+    }
+  });
+  if (!ok) {
+    fprintf(stderr, "fail to connect the loopback pair\n");
+    return 1;
+  }
+  json.Print();
+  return 0;
+}
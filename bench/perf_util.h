@@ -0,0 +1,251 @@
+#pragma once
+// shared parts of the perf_lat and perf_bw suites : options, the loopback connection and
+// JSON output. Both run the active side and the passive side of every case in one process,
+// so a single box with Soft-RoCE is enough :
+//   rdma link add rxe0 type rxe netdev eth0
+//   perf_lat --gid_idx=1 > lat.json
+// or with no device at all, on the in-process software device with a modelled wire :
+//   perf_lat --dev=soft --soft_latency_ns=1000 --soft_gbps=100
+// Both sides share the host, so --shm measures the shared memory path instead of the NIC.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include "client.h"
+#include "server.h"
+#include "soft_transport.h"
+
+#define PERF_PORT "23370"
+#define PERF_MIN_SIZE 2
+#define PERF_MAX_SIZE (8 * 1024 * 1024)
+
+struct PerfOptions {
+  std::vector<Opcode> ops;
+  std::vector<uint32_t> qds;
+  uint32_t min_size = PERF_MIN_SIZE;
+  uint32_t max_size = PERF_MAX_SIZE;
+  int iters = 0;
+  uint32_t gid_idx = 0;
+  std::string port = PERF_PORT;
+  bool huge_page = false;
+  std::string dev_name;
+  uint64_t soft_latency_ns = 0;
+  double soft_gbps = 0;
+  bool shm = false;
+};
+
+#define PERF_BYTES_PER_CASE (1ULL << 30)
+#define PERF_MIN_ITERS 16
+
+struct PerfPeer {
+  RDMA *rdma;
+  MemoryRegion *mr;
+  RemoteRegion remote;
+  std::function<bool()> sync;
+};
+
+inline const char *OpName(Opcode op) {
+  switch (op) {
+    case RDMA_SEND:
+      return "send";
+    case RDMA_WRITE:
+      return "write";
+    case RDMA_READ:
+      return "read";
+    case RDMA_FETCH_ADD:
+      return "fetch_add";
+    case RDMA_CMP_SWAP:
+      return "cmp_swap";
+    default:
+      return "unknown";
+  }
+}
+
+inline bool IsAtomic(Opcode op) { return op == RDMA_FETCH_ADD || op == RDMA_CMP_SWAP; }
+
+inline std::vector<std::string> SplitList(const char *list) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char *c = list;; c++) {
+    if (*c == ',' || *c == '\0') {
+      if (!item.empty()) {
+        items.push_back(item);
+      }
+      item.clear();
+      if (*c == '\0') {
+        break;
+      }
+    } else {
+      item += *c;
+    }
+  }
+  return items;
+}
+
+// --op=send,write,read,fetch_add,cmp_swap --min_size=2 --max_size=8388608 --iters=n
+// --qd=1,16,128 --gid_idx=0 --port=23370 --huge_page --dev=name --soft_latency_ns=n
+// --soft_gbps=n --shm
+inline bool ParseOptions(int argc, char **argv, PerfOptions *opts) {
+  const Opcode all_ops[] = {RDMA_SEND, RDMA_WRITE, RDMA_READ, RDMA_FETCH_ADD, RDMA_CMP_SWAP};
+  opts->ops.assign(std::begin(all_ops), std::end(all_ops));
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = strchr(arg, '=');
+    value = value != nullptr ? value + 1 : "";
+    if (strncmp(arg, "--op=", 5) == 0) {
+      opts->ops.clear();
+      for (const std::string &name : SplitList(value)) {
+        bool found = false;
+        for (Opcode op : all_ops) {
+          if (name == OpName(op)) {
+            opts->ops.push_back(op);
+            found = true;
+          }
+        }
+        if (!found) {
+          fprintf(stderr, "unknown op : %s\n", name.c_str());
+          return false;
+        }
+      }
+    } else if (strncmp(arg, "--qd=", 5) == 0) {
+      opts->qds.clear();
+      for (const std::string &qd : SplitList(value)) {
+        opts->qds.push_back(std::max(atoi(qd.c_str()), 1));
+      }
+    } else if (strncmp(arg, "--min_size=", 11) == 0) {
+      opts->min_size = std::max(atoi(value), 1);
+    } else if (strncmp(arg, "--max_size=", 11) == 0) {
+      opts->max_size = std::max(atoi(value), 1);
+    } else if (strncmp(arg, "--iters=", 8) == 0) {
+      opts->iters = std::max(atoi(value), 1);
+    } else if (strncmp(arg, "--gid_idx=", 10) == 0) {
+      opts->gid_idx = atoi(value);
+    } else if (strncmp(arg, "--port=", 7) == 0) {
+      opts->port = value;
+    } else if (strcmp(arg, "--huge_page") == 0) {
+      opts->huge_page = true;
+    } else if (strncmp(arg, "--dev=", 6) == 0) {
+      opts->dev_name = value;
+    } else if (strncmp(arg, "--soft_latency_ns=", 18) == 0) {
+      opts->soft_latency_ns = strtoull(value, nullptr, 10);
+    } else if (strncmp(arg, "--soft_gbps=", 12) == 0) {
+      opts->soft_gbps = atof(value);
+    } else if (strcmp(arg, "--shm") == 0) {
+      opts->shm = true;
+    } else {
+      fprintf(stderr, "unknown option : %s\n", arg);
+      return false;
+    }
+  }
+  return !opts->ops.empty() && opts->min_size <= opts->max_size;
+}
+
+// message sizes of an op, atomics always move 8 bytes
+inline std::vector<uint32_t> Sizes(const PerfOptions &opts, Opcode op) {
+  if (IsAtomic(op)) {
+    return {ATOMIC_SIZE};
+  }
+  std::vector<uint32_t> sizes;
+  for (uint64_t size = opts.min_size; size <= opts.max_size; size *= 2) {
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+// iterations of a case, large messages run fewer of them to bound the time of a sweep
+inline int ItersFor(const PerfOptions &opts, uint32_t size, int default_iters) {
+  int iters = opts.iters > 0 ? opts.iters : default_iters;
+  uint64_t capped = std::max<uint64_t>(PERF_MIN_ITERS, PERF_BYTES_PER_CASE / size);
+  return std::min<uint64_t>(iters, capped);
+}
+
+// register the buffer of one side and swap its region with the peer
+template <typename Side>
+bool SetupPeer(Side *side, size_t mr_size, bool huge_page, PerfPeer *peer) {
+  peer->rdma = side;
+  peer->sync = [side]() { return side->Sync(); };
+  peer->mr = side->AllocMemory(mr_size, huge_page);
+  if (peer->mr == nullptr) {
+    return false;
+  }
+  RemoteRegion local = peer->mr->Remote();
+  int recv = side->ExchangeData((char *)&local, sizeof(local), (char *)&peer->remote,
+                                sizeof(peer->remote));
+  return recv == sizeof(peer->remote);
+}
+
+// connect a server and a client over loopback, register a buffer of mr_size bytes on each
+// side and run fn on both, the client is the active side
+inline bool RunLoopback(const PerfOptions &opts, RDMAConfig config, size_t mr_size,
+                        const std::function<void(PerfPeer *, bool)> &fn) {
+  config.dev_name = opts.dev_name;
+  config.shm = opts.shm;
+  // both sides share the device, which keeps the wire model until they are done
+  std::shared_ptr<Device> device = Device::Open(opts.dev_name);
+  if (device == nullptr) {
+    return false;
+  }
+  if (device->IsSoft()) {
+    device->SetSoftLink(opts.soft_latency_ns, opts.soft_gbps);
+  }
+  Server server(opts.port, 1, opts.gid_idx, config);
+  bool server_ok = false;
+  std::thread server_thread([&]() {
+    PerfPeer peer;
+    server_ok = server.Connect() && SetupPeer(&server, mr_size, opts.huge_page, &peer);
+    if (server_ok) {
+      fn(&peer, false);
+    }
+  });
+
+  Client client(1, opts.gid_idx, config);
+  PerfPeer peer;
+  bool ok = client.Connect("127.0.0.1", opts.port) &&
+            SetupPeer(&client, mr_size, opts.huge_page, &peer);
+  if (ok) {
+    fn(&peer, true);
+  }
+  server_thread.join();
+  return ok && server_ok;
+}
+
+// collect one JSON object per case and print them as an array on stdout, the table for
+// humans goes to stderr
+class JSONWriter {
+ public:
+  void Begin() { fields_.clear(); }
+  void Add(const char *key, const char *value) {
+    fields_.push_back(std::string("\"") + key + "\": \"" + value + "\"");
+  }
+  void Add(const char *key, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    fields_.push_back(std::string("\"") + key + "\": " + buf);
+  }
+  void Add(const char *key, uint64_t value) {
+    fields_.push_back(std::string("\"") + key + "\": " + std::to_string(value));
+  }
+  void End() {
+    std::string object = "{";
+    for (size_t i = 0; i < fields_.size(); i++) {
+      object += (i > 0 ? ", " : "") + fields_[i];
+    }
+    objects_.push_back(object + "}");
+  }
+  void Print() const {
+    printf("[\n");
+    for (size_t i = 0; i < objects_.size(); i++) {
+      printf("  %s%s\n", objects_[i].c_str(), i + 1 < objects_.size() ? "," : "");
+    }
+    printf("]\n");
+  }
+
+ private:
+  std::vector<std::string> fields_;
+  std::vector<std::string> objects_;
+};
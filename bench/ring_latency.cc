@@ -0,0 +1,96 @@
+// ping-pong latency of the RDMA WRITE ring against the SEND/RECV message channel over a
+// loopback connection.
+// usage : ring_latency [gid_idx] [iters]
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "bench_util.h"
+#include "channel.h"
+#include "client.h"
+#include "ring_channel.h"
+#include "server.h"
+
+#define MAX_MSG_SIZE 4096
+#define RING_SLOTS 64
+#define CHANNEL_DEPTH 32
+
+template <class Channel>
+static void PingPong(Channel *channel, MemoryRegion *mr, bool initiator, uint32_t size,
+                     int iters, Histogram *hist) {
+  Message msg;
+  for (int i = 0; i < iters; i++) {
+    uint64_t start = NowNs();
+    if (!initiator) {
+      channel->Recv(&msg);
+      channel->Release(msg);
+    }
+    channel->Send(mr, 0, size);
+    if (initiator) {
+      channel->Recv(&msg);
+      channel->Release(msg);
+      hist->Add(NowNs() - start);
+    }
+  }
+}
+
+template <class Channel>
+static void Run(const char *name, const char *port, uint32_t gid_idx, int iters,
+                Channel *(*server_setup)(Server *), Channel *(*client_setup)(Client *)) {
+  Server server(port, 1, gid_idx);
+  std::thread server_thread([&]() {
+    server.Connect();
+    MemoryRegion *mr = server.AllocMemory(MAX_MSG_SIZE);
+    Channel *channel = server_setup(&server);
+    for (uint32_t size = 8; size <= MAX_MSG_SIZE; size *= 2) {
+      PingPong(channel, mr, false, size, iters, nullptr);
+      server.Sync();
+    }
+    delete channel;
+  });
+
+  Client client(1, gid_idx);
+  client.Connect("127.0.0.1", port);
+  MemoryRegion *mr = client.AllocMemory(MAX_MSG_SIZE);
+  Channel *channel = client_setup(&client);
+  Histogram hist(iters);
+  for (uint32_t size = 8; size <= MAX_MSG_SIZE; size *= 2) {
+    hist.Clear();
+    PingPong(channel, mr, true, size, iters, &hist);
+    client.Sync();
+    printf("%-10s %-8u %10.2f %10.2f %10.2f\n", name, size, hist.Percentile(50) / 2,
+           hist.Percentile(99) / 2, hist.Percentile(99.9) / 2);
+  }
+  delete channel;
+  server_thread.join();
+}
+
+template <class Peer>
+static RingChannel *SetupRing(Peer *peer) {
+  RingChannel *ring = new RingChannel(peer, RING_SLOTS, MAX_MSG_SIZE + sizeof(RingTrailer));
+  ring->Init();
+  RingDescriptor local = ring->LocalDescriptor();
+  RingDescriptor remote;
+  peer->ExchangeData((char *)&local, sizeof(local), (char *)&remote, sizeof(remote));
+  ring->SetRemoteDescriptor(remote);
+  return ring;
+}
+
+template <class Peer>
+static MessageChannel *SetupChannel(Peer *peer) {
+  MessageChannel *channel = new MessageChannel(peer, CHANNEL_DEPTH, MAX_MSG_SIZE);
+  channel->Init();
+  // both rings are posted before either side sends
+  peer->Sync();
+  return channel;
+}
+
+int main(int argc, char **argv) {
+  uint32_t gid_idx = argc > 1 ? atoi(argv[1]) : 0;
+  int iters = argc > 2 ? atoi(argv[2]) : 10000;
+  printf("%-10s %-8s %10s %10s %10s\n", "transport", "bytes", "p50(us)", "p99(us)", "p99.9(us)");
+  Run<RingChannel>("ring", "23350", gid_idx, iters, SetupRing<Server>, SetupRing<Client>);
+  Run<MessageChannel>("send_recv", "23351", gid_idx, iters, SetupChannel<Server>,
+                      SetupChannel<Client>);
+  return 0;
+}
@@ -0,0 +1,75 @@
+// SEND/RECV ping-pong latency with and without inline sends over a loopback connection.
+// usage : send_latency [gid_idx] [iters]
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "bench_util.h"
+#include "client.h"
+#include "server.h"
+
+#define MAX_MSG_SIZE 4096
+
+// receive into the front half of the buffer and send from the back half, receives take
+// any size so the one left outstanding carries over to the next size, return its token
+static uint64_t PingPong(RDMA *rdma, bool initiator, uint32_t size, int iters, uint64_t recv,
+                         Histogram *hist) {
+  MemoryRegion *mr = rdma->BufMR();
+  for (int i = 0; i < iters; i++) {
+    uint64_t start = NowNs();
+    if (!initiator) {
+      rdma->Wait(recv);
+      recv = rdma->PostRecv(mr, 0, MAX_MSG_SIZE);
+    }
+    uint64_t send = rdma->PostSend(RDMA_SEND, mr, MAX_MSG_SIZE, size, 0, true);
+    if (initiator) {
+      rdma->Wait(recv);
+      recv = rdma->PostRecv(mr, 0, MAX_MSG_SIZE);
+    }
+    rdma->Wait(send);
+    if (initiator) {
+      hist->Add(NowNs() - start);
+    }
+  }
+  return recv;
+}
+
+static void Run(const char *port, uint32_t gid_idx, int iters, uint32_t inline_size) {
+  RDMAConfig config;
+  config.buf_size = 2 * MAX_MSG_SIZE;
+  config.max_inline_data = inline_size;
+
+  Server server(port, 1, gid_idx, config);
+  std::thread server_thread([&]() {
+    server.Connect();
+    uint64_t recv = server.PostRecv(server.BufMR(), 0, MAX_MSG_SIZE);
+    server.Sync();
+    for (uint32_t size = 2; size <= MAX_MSG_SIZE; size *= 2) {
+      recv = PingPong(&server, false, size, iters, recv, nullptr);
+      server.Sync();
+    }
+  });
+
+  Client client(1, gid_idx, config);
+  client.Connect("127.0.0.1", port);
+  uint64_t recv = client.PostRecv(client.BufMR(), 0, MAX_MSG_SIZE);
+  client.Sync();
+  Histogram hist(iters);
+  printf("%-10s %-8s %10s %10s %10s\n", "inline", "bytes", "p50(us)", "p99(us)", "p99.9(us)");
+  for (uint32_t size = 2; size <= MAX_MSG_SIZE; size *= 2) {
+    hist.Clear();
+    recv = PingPong(&client, true, size, iters, recv, &hist);
+    client.Sync();
+    // half of the round trip is the one way latency
+    printf("%-10u %-8u %10.2f %10.2f %10.2f\n", client.Config().max_inline_data, size,
+           hist.Percentile(50) / 2, hist.Percentile(99) / 2, hist.Percentile(99.9) / 2);
+  }
+  server_thread.join();
+}
+
+int main(int argc, char **argv) {
+  uint32_t gid_idx = argc > 1 ? atoi(argv[1]) : 0;
+  int iters = argc > 2 ? atoi(argv[2]) : 10000;
+  Run("23334", gid_idx, iters, 0);
+  Run("23335", gid_idx, iters, INLINE_THRESHOLD);
+  return 0;
+}
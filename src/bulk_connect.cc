@@ -0,0 +1,73 @@
+#include "bulk_connect.h"
+#include <glog/logging.h>
+#include <atomic>
+#include <thread>
+
+bool ParallelFor(int num, int threads, const std::function<bool(int)> &fn) {
+  threads = std::max(1, std::min(threads, num));
+  // hand out indexes one at a time, so a slow call only holds back its own thread
+  std::atomic<int> next(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    for (int i = next++; i < num; i = next++) {
+      if (!fn(i)) {
+        ok = false;
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &t : workers) {
+    t.join();
+  }
+  return ok;
+}
+
+bool CreateQPs(std::shared_ptr<Device> device, uint32_t ib_port, uint32_t gid_idx,
+               const RDMAConfig &config, int num, std::vector<std::unique_ptr<RDMA>> *qps,
+               int threads) {
+  size_t first = qps->size();
+  qps->resize(first + num);
+  return ParallelFor(num, threads, [&](int i) {
+    std::unique_ptr<RDMA> &qp = (*qps)[first + i];
+    qp.reset(new RDMA(ib_port, gid_idx, config));
+    return qp->Init(device);
+  });
+}
+
+bool ConnectQPs(TCPConnector *tcp, const std::vector<std::unique_ptr<RDMA>> &qps, int threads) {
+  uint32_t num = qps.size();
+  uint32_t remote_num = 0;
+  int recv = tcp->ExchangeData((char *)&num, sizeof(num), (char *)&remote_num, sizeof(remote_num));
+  if (recv != sizeof(remote_num) || remote_num != num) {
+    LOG(ERROR) << "bulk connect : " << num << " local QPs but " << remote_num << " remote QPs";
+    return false;
+  }
+
+  std::vector<Connection> linfo(num);
+  std::vector<Connection> rinfo(num);
+  for (uint32_t i = 0; i < num; i++) {
+    linfo[i] = qps[i]->LocalInfo();
+  }
+  int size = num * sizeof(Connection);
+  recv = tcp->ExchangeData((char *)linfo.data(), size, (char *)rinfo.data(), size);
+  if (recv != size) {
+    LOG(ERROR) << "bulk connect : fail to exchange connection info";
+    return false;
+  }
+
+  bool ok = ParallelFor(num, threads, [&](int i) {
+    RDMA *qp = qps[i].get();
+    qp->SetRemoteInfo(rinfo[i]);
+    if (!qp->ModifyQP(INIT) || !qp->ModifyQP(RTR) || !qp->ModifyQP(RTS)) {
+      LOG(ERROR) << "bulk connect : fail to bring QP " << linfo[i].qp_num << " up";
+      return false;
+    }
+    return true;
+  });
+  // neither side may post before the peer QPs are ready to receive
+  return tcp->Sync() && ok;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+#include "rdma.h"
+#include "tcp_connection.h"
+
+#define SETUP_THREADS 8
+
+// run fn(0) .. fn(num - 1) on up to threads threads, return false if any call failed
+bool ParallelFor(int num, int threads, const std::function<bool(int)> &fn);
+
+// create num QPs on a shared device in parallel and append them to qps
+bool CreateQPs(std::shared_ptr<Device> device, uint32_t ib_port, uint32_t gid_idx,
+               const RDMAConfig &config, int num, std::vector<std::unique_ptr<RDMA>> *qps,
+               int threads = SETUP_THREADS);
+
+// exchange the Connection records of all QPs with the peer in one message and bring every QP
+// to RTS in parallel. The peer passes the same number of QPs, the i-th QP of each side is
+// connected to the i-th QP of the other.
+bool ConnectQPs(TCPConnector *tcp, const std::vector<std::unique_ptr<RDMA>> &qps,
+                int threads = SETUP_THREADS);
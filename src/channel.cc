@@ -0,0 +1,154 @@
+#include "channel.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cassert>
+
+MessageChannel::MessageChannel(RDMA *rdma, uint32_t depth, uint32_t msg_size)
+    : rdma_(rdma), depth_(depth), msg_size_(msg_size), send_credits_(depth) {
+  assert(depth > 0);
+  credit_threshold_ = std::max(depth / 2, 1u);
+  // a sender blocked on credits returns its own early, so a credit update may carry a single
+  // credit, and at most depth_ credits are outstanding, which bounds the credit updates the
+  // peer has not processed yet
+  ctrl_slots_ = depth_;
+}
+
+MessageChannel::~MessageChannel() {
+  if (ring_ != nullptr) {
+    rdma_->DeregisterMemory(ring_);
+    ring_ = nullptr;
+  }
+}
+
+bool MessageChannel::Init() {
+  uint32_t slots = depth_ + ctrl_slots_;
+  if (rdma_->RecvQueueFree() < slots) {
+    LOG(ERROR) << "receive queue too small for channel of " << slots << " buffers";
+    return false;
+  }
+  ring_ = rdma_->AllocMemory((size_t)slots * msg_size_);
+  if (ring_ == nullptr) {
+    return false;
+  }
+  posted_.resize(slots);
+  ready_.resize(depth_);
+  for (uint32_t slot = 0; slot < slots; slot++) {
+    if (!PostSlot(slot)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MessageChannel::PostSlot(uint32_t slot) {
+  uint64_t token = rdma_->PostRecv(ring_, (size_t)slot * msg_size_, msg_size_);
+  if (token == INVALID_TOKEN) {
+    LOG(ERROR) << "fail to post receive buffer " << slot;
+    return false;
+  }
+  posted_[posted_tail_++ % posted_.size()] = {.token = token, .slot = slot};
+  return true;
+}
+
+bool MessageChannel::Poll() {
+  rdma_->PollCQ();
+  while (posted_head_ < posted_tail_) {
+    const Posted &posted = posted_[posted_head_ % posted_.size()];
+    if (!rdma_->IsDone(posted.token)) {
+      break;
+    }
+    Completion comp;
+    if (!rdma_->Wait(posted.token, &comp) || !comp.has_imm) {
+      LOG(ERROR) << "fail to receive message " << posted.token;
+      return false;
+    }
+    uint32_t slot = posted.slot;
+    posted_head_++;
+    send_credits_ += comp.imm_data & ~CREDIT_ONLY_BIT;
+    if (comp.imm_data & CREDIT_ONLY_BIT) {
+      if (!PostSlot(slot)) {
+        return false;
+      }
+      continue;
+    }
+    assert(ready_tail_ - ready_head_ < ready_.size());
+    ready_[ready_tail_++ % ready_.size()] = {
+        .data = ring_->addr + (size_t)slot * msg_size_, .length = comp.byte_len, .slot = slot};
+  }
+  return true;
+}
+
+uint64_t MessageChannel::Send(const MemoryRegion *mr, size_t offset, uint32_t length) {
+  assert(length <= msg_size_);
+  while (send_credits_ == 0 || rdma_->SendQueueFree() == 0) {
+    // the peer may be blocked the same way, waiting for the credits held back here
+    if (send_credits_ == 0 && pending_credits_ > 0 && !SendCredit()) {
+      return INVALID_TOKEN;
+    }
+    if (!Poll()) {
+      return INVALID_TOKEN;
+    }
+  }
+  WorkRequest req = {.op = RDMA_SEND_IMM,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = length,
+                     .imm_data = pending_credits_};
+  uint64_t token;
+  if (rdma_->PostSend(&req, 1, &token) != 1) {
+    return INVALID_TOKEN;
+  }
+  send_credits_--;
+  pending_credits_ = 0;
+  return token;
+}
+
+bool MessageChannel::SendCredit() {
+  while (rdma_->SendQueueFree() == 0) {
+    if (!Poll()) {
+      return false;
+    }
+  }
+  WorkRequest req = {.op = RDMA_SEND_IMM,
+                     .mr = ring_,
+                     .offset = 0,
+                     .length = 0,
+                     .imm_data = CREDIT_ONLY_BIT | pending_credits_};
+  if (rdma_->PostSend(&req, 1) != 1) {
+    return false;
+  }
+  pending_credits_ = 0;
+  return true;
+}
+
+bool MessageChannel::TryRecv(Message *msg) {
+  if (ready_head_ == ready_tail_ && !Poll()) {
+    return false;
+  }
+  if (ready_head_ == ready_tail_) {
+    return false;
+  }
+  *msg = ready_[ready_head_++ % ready_.size()];
+  return true;
+}
+
+bool MessageChannel::Recv(Message *msg) {
+  while (ready_head_ == ready_tail_) {
+    if (!Poll()) {
+      return false;
+    }
+  }
+  *msg = ready_[ready_head_++ % ready_.size()];
+  return true;
+}
+
+bool MessageChannel::Release(const Message &msg) {
+  if (!PostSlot(msg.slot)) {
+    return false;
+  }
+  // piggyback on the next message unless the peer may soon run out of credits
+  if (++pending_credits_ >= credit_threshold_) {
+    return SendCredit();
+  }
+  return true;
+}
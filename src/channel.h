@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include "rdma.h"
+
+#define CREDIT_ONLY_BIT (1U << 31)
+
+// Flow-controlled messaging over RC SEND/RECV. Each side keeps a ring of pre-posted receive
+// buffers and a sender only sends while it holds credits for free buffers on the peer, so it
+// never hits an RNR NAK. Released buffers are reposted and their credits go back in the
+// immediate of the next message, or in a zero length credit update once half of the ring
+// is waiting to be returned or when the sender itself is blocked on credits. Both sides must
+// use the same depth and call Init before either of them sends.
+class MessageChannel {
+ public:
+  MessageChannel(RDMA *rdma, uint32_t depth, uint32_t msg_size);
+  ~MessageChannel();
+
+  MessageChannel(const MessageChannel &) = delete;
+  MessageChannel &operator=(const MessageChannel &) = delete;
+
+  // allocate the receive ring and pre-post all of it
+  bool Init();
+  // post a message of at most msg_size bytes, block while there are no credits, return the
+  // token of the send or INVALID_TOKEN on failure
+  uint64_t Send(const MemoryRegion *mr, size_t offset, uint32_t length);
+  // block until a message arrives
+  bool Recv(Message *msg);
+  bool TryRecv(Message *msg);
+  // hand the buffer of a received message back to the ring
+  bool Release(const Message &msg);
+  // reap completions and process arrived messages and credits, return false on failure
+  bool Poll();
+
+  uint32_t SendCredits() const { return send_credits_; }
+
+ private:
+  bool PostSlot(uint32_t slot);
+  bool SendCredit();
+
+  RDMA *rdma_;
+  uint32_t depth_;
+  uint32_t msg_size_;
+  // extra receive buffers for credit updates, which do not take credits themselves
+  uint32_t ctrl_slots_;
+  uint32_t credit_threshold_;
+  MemoryRegion *ring_ = nullptr;
+
+  uint32_t send_credits_;
+  uint32_t pending_credits_ = 0;
+
+  // receives complete in posting order, so posted slots form a FIFO
+  struct Posted {
+    uint64_t token;
+    uint32_t slot;
+  };
+  std::vector<Posted> posted_;
+  uint64_t posted_head_ = 0;
+  uint64_t posted_tail_ = 0;
+  std::vector<Message> ready_;
+  uint64_t ready_head_ = 0;
+  uint64_t ready_tail_ = 0;
+};
@@ -2,27 +2,38 @@
 #include <glog/logging.h>
 #include <cassert>
 
-Client::Client(uint32_t ib_port, uint32_t gid_idx) : RDMA(ib_port, gid_idx) {
+Client::Client(uint32_t ib_port, uint32_t gid_idx, const RDMAConfig &config)
+    : RDMA(ib_port, gid_idx, config) {
   conn_ = new TCPConnector();
 }
 
 bool Client::Connect(std::string ip_addr, std::string ip_port) {
-  bool rt = conn_->Connect(ip_addr, ip_port);
-  assert(rt);
-  rt = Init();
-  assert(rt);
+  if (!conn_->Connect(ip_addr, ip_port)) {
+    LOG(ERROR) << "client : fail to connect TCP";
+    return false;
+  }
+  if (!Init()) {
+    return false;
+  }
   Connection linfo = LocalInfo();
   Connection rinfo;
   int recv = conn_->ExchangeData((char *)&linfo, sizeof(linfo), (char *)&rinfo, sizeof(rinfo));
+  if (recv != sizeof(rinfo)) {
+    LOG(ERROR) << "client : fail to exchange connection info";
+    return false;
+  }
   SetRemoteInfo(rinfo);
-  rt = ModifyQP(INIT);
-  assert(rt);
+  if (!ModifyQP(INIT)) {
+    return false;
+  }
   LOG(INFO) << "client : modify to INIT ";
-  rt = ModifyQP(RTR);
-  assert(rt);
+  if (!ModifyQP(RTR)) {
+    return false;
+  }
   LOG(INFO) << "client : modify to RTR ";
-  rt = ModifyQP(RTS);
-  assert(rt);
+  if (!ModifyQP(RTS)) {
+    return false;
+  }
   LOG(INFO) << "client : modify to RTS ";
-  return rt;
+  return ConnectSharedMemory(conn_);
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "completion_queue.h"
+#include <glog/logging.h>
+#include <cassert>
+#include <algorithm>
+#include "rdma.h"
+#include "stats.h"
+
+CompletionQueue::CompletionQueue(std::shared_ptr<Device> device, uint32_t cqe_num,
+                                 uint32_t poll_batch)
+    : device_(device), cqe_num_(cqe_num), wcs_(std::max<uint32_t>(poll_batch, 1)) {}
+
+CompletionQueue::~CompletionQueue() {
+  // attached QPs must be destroyed before the queue
+  assert(qps_.empty());
+  if (cq_ != nullptr) {
+    int rc = ibv_destroy_cq(cq_);
+    assert(rc == 0);
+    cq_ = nullptr;
+  }
+}
+
+bool CompletionQueue::Init() {
+  if (device_->IsSoft()) {
+    soft_cq_.reset(new SoftCQ(cqe_num_));
+    return true;
+  }
+  cq_ = ibv_create_cq(device_->Context(), cqe_num_, nullptr, nullptr, 0);
+  if (cq_ == nullptr) {
+    LOG(ERROR) << "fail to create CQ of " << cqe_num_ << " entries";
+    return false;
+  }
+  return true;
+}
+
+int CompletionQueue::Poll() { return Poll(wcs_.data(), wcs_.size()); }
+
+int CompletionQueue::Poll(ibv_wc *wcs, int num) {
+  int rc = soft_cq_ != nullptr ? soft_cq_->Poll(num, wcs) : ibv_poll_cq(cq_, num, wcs);
+  LOG_ASSERT(rc >= 0) << " return wc " << rc;
+  for (int i = 0; i < rc; i++) {
+    auto it = qps_.find(wcs[i].qp_num);
+    if (it == qps_.end()) {
+      LOG(WARNING) << "completion of unknown QP " << wcs[i].qp_num;
+      continue;
+    }
+    it->second->HandleWC(wcs[i]);
+  }
+  for (RDMA *rdma : stats_qps_) {
+    rdma->stats_->AddPoll(rc, num);
+  }
+  return rc;
+}
+
+void CompletionQueue::Attach(uint32_t qp_num, RDMA *rdma) {
+  qps_[qp_num] = rdma;
+  if (rdma->stats_ != nullptr) {
+    stats_qps_.push_back(rdma);
+  }
+}
+
+void CompletionQueue::Detach(uint32_t qp_num) {
+  auto it = qps_.find(qp_num);
+  if (it == qps_.end()) {
+    return;
+  }
+  stats_qps_.erase(std::remove(stats_qps_.begin(), stats_qps_.end(), it->second),
+                   stats_qps_.end());
+  qps_.erase(it);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "device.h"
+#include "soft_transport.h"
+
+class RDMA;
+
+// A CQ shared by several QPs through RDMAConfig::cq, so that one thread drives all of its
+// connections with a single poll. Completions are handed to the QP they belong to by qp_num.
+// Like the QPs attached to it, the queue must only be polled by one thread at a time, and
+// QPs must not be created or destroyed while another thread polls it. Attached QPs with
+// RDMAConfig::stats count every poll of the queue.
+class CompletionQueue {
+ public:
+  CompletionQueue(std::shared_ptr<Device> device, uint32_t cqe_num, uint32_t poll_batch = 16);
+  ~CompletionQueue();
+
+  CompletionQueue(const CompletionQueue &) = delete;
+  CompletionQueue &operator=(const CompletionQueue &) = delete;
+
+  bool Init();
+  // poll a batch and dispatch it to the attached QPs, return the number of completions
+  int Poll();
+  int Poll(ibv_wc *wcs, int num);
+
+  ibv_cq *CQ() const { return cq_; }
+  // the queue of the software device, nullptr on other devices
+  SoftCQ *Soft() const { return soft_cq_.get(); }
+  uint32_t Size() const { return cqe_num_; }
+
+ private:
+  friend class RDMA;
+  void Attach(uint32_t qp_num, RDMA *rdma);
+  void Detach(uint32_t qp_num);
+
+  std::shared_ptr<Device> device_;
+  uint32_t cqe_num_;
+  ibv_cq *cq_ = nullptr;
+  std::unique_ptr<SoftCQ> soft_cq_;
+  std::vector<ibv_wc> wcs_;
+  std::unordered_map<uint32_t, RDMA *> qps_;
+  // attached QPs which keep stats
+  std::vector<RDMA *> stats_qps_;
+};
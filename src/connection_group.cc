@@ -0,0 +1,189 @@
+#include "connection_group.h"
+#include <glog/logging.h>
+#include <pthread.h>
+#include <cassert>
+
+static inline void CPURelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+ConnectionGroup::ConnectionGroup(std::shared_ptr<Device> device, int workers, uint32_t cqe_num,
+                                 uint32_t queue_depth)
+    : device_(device), cqe_num_(cqe_num), queue_depth_(queue_depth) {
+  assert(workers > 0);
+  workers_.resize(workers);
+}
+
+ConnectionGroup::~ConnectionGroup() {
+  Stop();
+  // QPs go before the CQs they are attached to
+  conns_.clear();
+  workers_.clear();
+}
+
+bool ConnectionGroup::Init() {
+  for (std::unique_ptr<Worker> &worker : workers_) {
+    worker.reset(new Worker());
+    worker->cq.reset(new CompletionQueue(device_, cqe_num_));
+    if (!worker->cq->Init()) {
+      return false;
+    }
+    worker->queue.reset(new MPSCQueue<Operation>(queue_depth_));
+  }
+  return true;
+}
+
+RDMAConfig ConnectionGroup::WorkerConfig(int worker, const RDMAConfig &config) const {
+  RDMAConfig worker_config = config;
+  worker_config.cq = workers_[worker]->cq.get();
+  worker_config.use_event = false;
+  return worker_config;
+}
+
+bool ConnectionGroup::Add(int worker, std::unique_ptr<RDMA> rdma, uint32_t *id) {
+  assert(!running_);
+  Worker *w = workers_[worker].get();
+  if (rdma->Config().cq != w->cq.get()) {
+    LOG(ERROR) << "QP is not created with the config of worker " << worker;
+    return false;
+  }
+  // every QP of the worker may fill both of its queues before the CQ is polled
+  uint32_t cqes = rdma->Config().max_send_wr + rdma->Config().max_recv_wr;
+  for (ConnState *conn : w->conns) {
+    cqes += conn->rdma->Config().max_send_wr + conn->rdma->Config().max_recv_wr;
+  }
+  if (cqes > w->cq->Size()) {
+    LOG(ERROR) << "CQ of worker " << worker << " is too small for " << cqes << " entries";
+    return false;
+  }
+
+  std::unique_ptr<ConnState> conn(new ConnState());
+  conn->sends.waiting.resize(rdma->Config().max_send_wr);
+  conn->sends.pending.resize(rdma->Config().max_send_wr);
+  conn->recvs.waiting.resize(rdma->Config().max_recv_wr);
+  conn->recvs.pending.resize(rdma->Config().max_recv_wr);
+  conn->rdma = std::move(rdma);
+  conn->worker = worker;
+  w->conns.push_back(conn.get());
+  *id = conns_.size();
+  conns_.push_back(std::move(conn));
+  return true;
+}
+
+bool ConnectionGroup::Start(bool pin) {
+  assert(!running_);
+  running_ = true;
+  unsigned int cores = std::max(std::thread::hardware_concurrency(), 1u);
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker *worker = workers_[i].get();
+    worker->thread = std::thread(&ConnectionGroup::Run, this, worker);
+    if (pin) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(i % cores, &cpus);
+      if (pthread_setaffinity_np(worker->thread.native_handle(), sizeof(cpus), &cpus) != 0) {
+        LOG(WARNING) << "fail to pin worker " << i << " to core " << i % cores;
+      }
+    }
+  }
+  return true;
+}
+
+void ConnectionGroup::Stop() {
+  running_ = false;
+  for (std::unique_ptr<Worker> &worker : workers_) {
+    if (worker != nullptr && worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+bool ConnectionGroup::Submit(const Operation &op) {
+  assert(op.conn < conns_.size());
+  return workers_[conns_[op.conn]->worker]->queue->Push(op);
+}
+
+void ConnectionGroup::Run(Worker *worker) {
+  while (running_.load(std::memory_order_relaxed)) {
+    int submitted = 0;
+    Operation op;
+    while (submitted < SUBMIT_BATCH && worker->parked < queue_depth_ &&
+           worker->queue->Pop(&op)) {
+      ConnState *conn = conns_[op.conn].get();
+      OpQueue *ops = op.recv ? &conn->recvs : &conn->sends;
+      if (ops->parked.empty() && ops->waiting_tail - ops->waiting_head < ops->waiting.size()) {
+        ops->waiting[ops->waiting_tail++ % ops->waiting.size()] = op;
+      } else {
+        // a full connection does not hold up the others of the worker
+        ops->parked.push_back(op);
+        worker->parked++;
+      }
+      submitted++;
+    }
+    for (ConnState *conn : worker->conns) {
+      Flush(worker, conn, false);
+      Flush(worker, conn, true);
+    }
+    int polled = worker->cq->Poll();
+    if (polled > 0) {
+      for (ConnState *conn : worker->conns) {
+        Reap(conn, &conn->sends);
+        Reap(conn, &conn->recvs);
+      }
+    }
+    if (submitted == 0 && polled == 0) {
+      CPURelax();
+    }
+  }
+}
+
+void ConnectionGroup::Flush(Worker *worker, ConnState *conn, bool recv) {
+  OpQueue *ops = recv ? &conn->recvs : &conn->sends;
+  while (!ops->parked.empty() && ops->waiting_tail - ops->waiting_head < ops->waiting.size()) {
+    ops->waiting[ops->waiting_tail++ % ops->waiting.size()] = ops->parked.front();
+    ops->parked.pop_front();
+    worker->parked--;
+  }
+  RDMA *rdma = conn->rdma.get();
+  size_t num = std::min<size_t>(ops->waiting_tail - ops->waiting_head,
+                                recv ? rdma->RecvQueueFree() : rdma->SendQueueFree());
+  if (num == 0) {
+    return;
+  }
+  std::vector<WorkRequest> &reqs = worker->reqs;
+  std::vector<uint64_t> &tokens = worker->tokens;
+  reqs.resize(num);
+  tokens.resize(num);
+  for (size_t i = 0; i < num; i++) {
+    reqs[i] = ops->waiting[(ops->waiting_head + i) % ops->waiting.size()].req;
+  }
+  // one CQE completes the whole batch
+  reqs[num - 1].signaled = true;
+  int posted = recv ? rdma->PostRecv(reqs.data(), num, tokens.data())
+                    : rdma->PostSend(reqs.data(), num, tokens.data());
+  for (int i = 0; i < posted; i++) {
+    const Operation &op = ops->waiting[ops->waiting_head++ % ops->waiting.size()];
+    ops->pending[ops->pending_tail++ % ops->pending.size()] = {
+        .token = tokens[i], .done = op.done, .arg = op.arg};
+  }
+}
+
+void ConnectionGroup::Reap(ConnState *conn, OpQueue *ops) {
+  RDMA *rdma = conn->rdma.get();
+  while (ops->pending_head < ops->pending_tail) {
+    const Pending &pending = ops->pending[ops->pending_head % ops->pending.size()];
+    if (!rdma->IsDone(pending.token)) {
+      break;
+    }
+    Completion comp;
+    rdma->Wait(pending.token, &comp);
+    if (pending.done != nullptr) {
+      pending.done(pending.arg, comp);
+    }
+    ops->pending_head++;
+  }
+}
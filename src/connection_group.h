@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "completion_queue.h"
+#include "mpsc_queue.h"
+#include "rdma.h"
+
+#define GROUP_CQE_NUM 4096
+#define SUBMIT_QUEUE_DEPTH 4096
+#define SUBMIT_BATCH 32
+
+typedef void (*CompletionCallback)(void *arg, const Completion &comp);
+
+struct Operation {
+  /* a work request handed to the worker which owns the connection */
+  uint32_t conn;           /* connection id returned by Add */
+  bool recv;               /* post a receive instead of a send */
+  WorkRequest req;         /* memory must be registered on the device of the group, it and
+                              the sg_list and remote it points to are read when the worker
+                              posts the op, so they must stay unchanged until done */
+  CompletionCallback done; /* called on the worker thread once the request completes */
+  void *arg;               /* passed to done */
+};
+
+// Connections sharded over worker threads. Each worker owns its QPs and a CQ shared by all
+// of them, and is the only thread which touches them, so the data path takes no locks. Any
+// thread submits operations to the owning worker through a lock-free queue, and the worker
+// posts them in batches, polls its CQ and runs the callbacks of completed operations.
+// Operations of a connection whose QP is full wait in a ring of the queue depth, beyond
+// that they are parked aside so that the other connections of the worker keep going. Once
+// a worker parks a queue depth of operations it leaves further ones in its submission
+// queue, and Submit fails when that is full too. QPs are created with WorkerConfig of their worker on the device of the group, connected
+// and added before Start.
+class ConnectionGroup {
+ public:
+  ConnectionGroup(std::shared_ptr<Device> device, int workers, uint32_t cqe_num = GROUP_CQE_NUM,
+                  uint32_t queue_depth = SUBMIT_QUEUE_DEPTH);
+  ~ConnectionGroup();
+
+  ConnectionGroup(const ConnectionGroup &) = delete;
+  ConnectionGroup &operator=(const ConnectionGroup &) = delete;
+
+  // create the CQ and the submission queue of every worker
+  bool Init();
+  // config for a QP owned by worker
+  RDMAConfig WorkerConfig(int worker, const RDMAConfig &config = RDMAConfig()) const;
+  // hand a connected QP created with WorkerConfig(worker) to its worker, only before Start
+  bool Add(int worker, std::unique_ptr<RDMA> rdma, uint32_t *id);
+  // start one thread per worker, pinned to a core each if pin is set
+  bool Start(bool pin = true);
+  // stop the workers, operations which have not completed are dropped
+  void Stop();
+
+  // lock free and safe from any thread, return false if the queue of the worker is full
+  bool Submit(const Operation &op);
+
+  int Workers() const { return workers_.size(); }
+  size_t Size() const { return conns_.size(); }
+  // the QP belongs to the worker thread once started
+  RDMA *Conn(uint32_t id) { return conns_[id]->rdma.get(); }
+
+ private:
+  struct Pending {
+    uint64_t token;
+    CompletionCallback done;
+    void *arg;
+  };
+  // operations of one queue of a connection, waiting to be posted and posted ones in order,
+  // both rings have the depth of the queue of the QP, parked ones come after waiting ones
+  struct OpQueue {
+    std::vector<Operation> waiting;
+    uint64_t waiting_head = 0;
+    uint64_t waiting_tail = 0;
+    std::deque<Operation> parked;
+    std::vector<Pending> pending;
+    uint64_t pending_head = 0;
+    uint64_t pending_tail = 0;
+  };
+  struct ConnState {
+    std::unique_ptr<RDMA> rdma;
+    int worker;
+    OpQueue sends;
+    OpQueue recvs;
+  };
+  struct Worker {
+    std::unique_ptr<CompletionQueue> cq;
+    std::unique_ptr<MPSCQueue<Operation>> queue;
+    std::vector<ConnState *> conns;
+    std::thread thread;
+    // operations parked by all connections of the worker
+    uint32_t parked = 0;
+    // reused by Flush so that posting does not allocate
+    std::vector<WorkRequest> reqs;
+    std::vector<uint64_t> tokens;
+  };
+
+  void Run(Worker *worker);
+  void Flush(Worker *worker, ConnState *conn, bool recv);
+  void Reap(ConnState *conn, OpQueue *ops);
+
+  std::shared_ptr<Device> device_;
+  uint32_t cqe_num_;
+  uint32_t queue_depth_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::unique_ptr<ConnState>> conns_;
+  std::atomic<bool> running_{false};
+};
@@ -0,0 +1,364 @@
+#include "device.h"
+#include "shm_transport.h"
+#include "soft_transport.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+std::mutex Device::open_mutex_;
+std::map<std::string, std::weak_ptr<Device>> Device::open_;
+
+std::shared_ptr<Device> Device::Open(std::string dev_name) {
+  std::lock_guard<std::mutex> lock(open_mutex_);
+  auto it = open_.find(dev_name);
+  if (it != open_.end()) {
+    std::shared_ptr<Device> device = it->second.lock();
+    if (device != nullptr) {
+      return device;
+    }
+  }
+
+  if (dev_name == SOFT_DEVICE) {
+    std::shared_ptr<Device> device(new Device());
+    device->InitSoft();
+    open_[dev_name] = device;
+    return device;
+  }
+
+  int dev_num;
+  auto dev_list = ibv_get_device_list(&dev_num);
+  if (dev_num <= 0) {
+    LOG(ERROR) << "none IB device";
+    return nullptr;
+  }
+
+  ibv_device *dev = nullptr;
+  if (dev_name.size() == 0) {
+    dev = dev_list[0];
+  } else {
+    for (int i = 0; i < dev_num; i++) {
+      if (strcmp(dev_name.c_str(), ibv_get_device_name(dev_list[i])) == 0) {
+        dev = dev_list[i];
+        break;
+      }
+    }
+  }
+  if (dev == nullptr) {
+    LOG(ERROR) << "cannot find device : " << dev_name;
+    ibv_free_device_list(dev_list);
+    return nullptr;
+  }
+
+  // the default device may already be open under its name
+  std::string name = ibv_get_device_name(dev);
+  std::shared_ptr<Device> device = open_[name].lock();
+  if (device == nullptr) {
+    device.reset(new Device());
+    if (!device->Init(dev)) {
+      device = nullptr;
+    }
+  }
+  ibv_free_device_list(dev_list);
+  if (device != nullptr) {
+    open_[name] = device;
+    open_[dev_name] = device;
+  }
+  return device;
+}
+
+bool Device::Init(ibv_device *dev) {
+  name_ = ibv_get_device_name(dev);
+  ctx_ = ibv_open_device(dev);
+  if (ctx_ == nullptr) {
+    LOG(ERROR) << "fail to open device : " << name_;
+    return false;
+  }
+  LOG(INFO) << "node state : " << ibv_node_type_str(dev->node_type);
+  // drained by HandleAsyncEvents, which must not block the caller
+  int flags = fcntl(ctx_->async_fd, F_GETFL);
+  if (fcntl(ctx_->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    LOG(ERROR) << "fail to set async event fd non-blocking";
+    return false;
+  }
+
+  int rc = ibv_query_device(ctx_, &attr_);
+  assert(rc == 0);
+  LOG(INFO) << "max rd atomic : " << attr_.max_qp_init_rd_atom << " / " << attr_.max_qp_rd_atom;
+  LOG(INFO) << "max sge : " << attr_.max_sge;
+
+  pd_ = ibv_alloc_pd(ctx_);
+  if (pd_ == nullptr) {
+    LOG(ERROR) << "fail to allocate PD on device : " << name_;
+    return false;
+  }
+  return true;
+}
+
+void Device::InitSoft() {
+  name_ = SOFT_DEVICE;
+  soft_ = true;
+  attr_.phys_port_cnt = 1;
+  attr_.max_qp_wr = SOFT_MAX_WR;
+  attr_.max_sge = SOFT_MAX_SGE;
+  attr_.max_cqe = SOFT_MAX_CQE;
+  attr_.max_qp_rd_atom = SOFT_MAX_RD_ATOMIC;
+  attr_.max_qp_init_rd_atom = SOFT_MAX_RD_ATOMIC;
+  attr_.atomic_cap = IBV_ATOMIC_HCA;
+  LOG(INFO) << "software device, QPs run in the process";
+}
+
+Device::~Device() {
+  int rc;
+
+  while (!mrs_.empty()) {
+    if (!DeregisterMemory(mrs_.back().get())) {
+      mrs_.pop_back();
+    }
+  }
+
+  if (pd_ != nullptr) {
+    rc = ibv_dealloc_pd(pd_);
+    assert(rc == 0);
+    pd_ = nullptr;
+  }
+
+  if (ctx_ != nullptr) {
+    rc = ibv_close_device(ctx_);
+    assert(rc == 0);
+    ctx_ = nullptr;
+  }
+}
+
+bool Device::QueryPort(uint32_t ib_port, uint32_t gid_idx, PortInfo *info) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const PortInfo &port : ports_) {
+    if (port.ib_port == ib_port && port.gid_idx == gid_idx) {
+      *info = port;
+      return true;
+    }
+  }
+
+  if (ib_port > attr_.phys_port_cnt) {
+    LOG(ERROR) << "invalid IB port for device : " << name_ << " with "
+               << (int)attr_.phys_port_cnt << " port";
+    return false;
+  }
+
+  if (soft_) {
+    // there is no fabric address, peers find each other by QP number
+    PortInfo port = {
+        .ib_port = ib_port, .gid_idx = gid_idx, .lid = 0, .active_mtu = IBV_MTU_4096, .gid = {}};
+    ports_.push_back(port);
+    *info = port;
+    return true;
+  }
+
+  // query port lid and state
+  ibv_port_attr port_attr;
+  memset(&port_attr, 0, sizeof(port_attr));
+  int rc = ibv_query_port(ctx_, ib_port, &port_attr);
+  assert(rc == 0);
+  LOG(INFO) << "port state : " << ibv_port_state_str(port_attr.state);
+  LOG(INFO) << "port lid : " << port_attr.lid;
+  LOG(INFO) << "port active MTU : " << MTUBytes(port_attr.active_mtu);
+
+  PortInfo port = {
+      .ib_port = ib_port,
+      .gid_idx = gid_idx,
+      .lid = port_attr.lid,
+      .active_mtu = port_attr.active_mtu,
+  };
+  // query gid
+  rc = ibv_query_gid(ctx_, ib_port, gid_idx, &port.gid);
+  assert(rc == 0);
+  ports_.push_back(port);
+  *info = port;
+  return true;
+}
+
+MemoryRegion *Device::RegisterMemory(void *addr, size_t length, int access) {
+  std::unique_ptr<MemoryRegion> region(new MemoryRegion());
+  if (soft_) {
+    region->lkey = region->rkey = SoftRegister(addr, length, access);
+    region->mr = nullptr;
+  } else {
+    assert(pd_ != nullptr);
+    ibv_mr *mr = ibv_reg_mr(pd_, addr, length, access);
+    if (mr == nullptr) {
+      LOG(ERROR) << "fail to register memory " << addr << " with length " << length;
+      return nullptr;
+    }
+    region->lkey = mr->lkey;
+    region->rkey = mr->rkey;
+    region->mr = mr;
+  }
+  region->addr = (char *)addr;
+  region->length = length;
+  region->access = access;
+  region->owned = false;
+  region->huge_page = false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (shm_keys_ != nullptr && !shm_keys_->Add(region->rkey, (uint64_t)addr, length, access)) {
+    LOG(WARNING) << "key table is full, peers on this host cannot reach " << addr;
+  }
+  mrs_.push_back(std::move(region));
+  return mrs_.back().get();
+}
+
+MemoryRegion *Device::AllocMemory(size_t length, bool huge_page, int access) {
+  void *addr = nullptr;
+  size_t alloc_len = length;
+  if (huge_page) {
+    alloc_len = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    addr = mmap(nullptr, alloc_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr == MAP_FAILED) {
+      LOG(WARNING) << "fail to map " << alloc_len << " bytes of huge pages, use normal pages";
+      addr = nullptr;
+      huge_page = false;
+      alloc_len = length;
+    }
+  }
+  if (addr == nullptr) {
+    if (posix_memalign(&addr, sysconf(_SC_PAGESIZE), alloc_len) != 0) {
+      LOG(ERROR) << "fail to allocate " << alloc_len << " bytes";
+      return nullptr;
+    }
+  }
+  memset(addr, 0, alloc_len);
+
+  MemoryRegion *region = RegisterMemory(addr, alloc_len, access);
+  if (region == nullptr) {
+    if (huge_page) {
+      munmap(addr, alloc_len);
+    } else {
+      free(addr);
+    }
+    return nullptr;
+  }
+  region->owned = true;
+  region->huge_page = huge_page;
+  return region;
+}
+
+ShmKeyTable *Device::SharedKeys() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (shm_keys_ == nullptr) {
+    std::unique_ptr<ShmKeyTable> keys = ShmKeyTable::Create();
+    if (keys == nullptr) {
+      return nullptr;
+    }
+    for (const std::unique_ptr<MemoryRegion> &region : mrs_) {
+      if (!keys->Add(region->rkey, (uint64_t)region->addr, region->length, region->access)) {
+        LOG(ERROR) << "key table is too small for the regions of device " << name_;
+        return nullptr;
+      }
+    }
+    shm_keys_ = std::move(keys);
+  }
+  return shm_keys_.get();
+}
+
+bool Device::DeregisterMemory(MemoryRegion *mr) {
+  std::unique_ptr<MemoryRegion> region;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = mrs_.begin(); it != mrs_.end(); it++) {
+      if (it->get() == mr) {
+        region = std::move(*it);
+        mrs_.erase(it);
+        // peers stop copying into the region before it goes away
+        if (shm_keys_ != nullptr) {
+          shm_keys_->Remove(mr->rkey);
+        }
+        break;
+      }
+    }
+  }
+  if (region == nullptr) {
+    LOG(ERROR) << "memory region is not registered on device " << name_;
+    return false;
+  }
+
+  int rc = 0;
+  if (soft_) {
+    SoftDeregister(mr->lkey);
+  } else {
+    rc = ibv_dereg_mr(mr->mr);
+  }
+  if (rc != 0) {
+    LOG(ERROR) << "fail to deregister memory " << (void *)mr->addr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shm_keys_ != nullptr) {
+      shm_keys_->Add(mr->rkey, (uint64_t)mr->addr, mr->length, mr->access);
+    }
+    mrs_.push_back(std::move(region));
+    return false;
+  }
+  if (mr->owned) {
+    if (mr->huge_page) {
+      munmap(mr->addr, mr->length);
+    } else {
+      free(mr->addr);
+    }
+  }
+  return true;
+}
+
+// the QP or SRQ an async event belongs to, nullptr for events of the device and its ports
+static const void *AsyncElement(const ibv_async_event &event) {
+  switch (event.event_type) {
+    case IBV_EVENT_QP_FATAL:
+    case IBV_EVENT_QP_REQ_ERR:
+    case IBV_EVENT_QP_ACCESS_ERR:
+    case IBV_EVENT_COMM_EST:
+    case IBV_EVENT_SQ_DRAINED:
+    case IBV_EVENT_PATH_MIG:
+    case IBV_EVENT_PATH_MIG_ERR:
+    case IBV_EVENT_QP_LAST_WQE_REACHED:
+      return event.element.qp;
+    case IBV_EVENT_SRQ_ERR:
+    case IBV_EVENT_SRQ_LIMIT_REACHED:
+      return event.element.srq;
+    case IBV_EVENT_CQ_ERR:
+      return event.element.cq;
+    default:
+      return nullptr;
+  }
+}
+
+bool Device::HandleAsyncEvents() {
+  if (ctx_ == nullptr) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  bool ok = true;
+  ibv_async_event event;
+  while (ibv_get_async_event(ctx_, &event) == 0) {
+    const void *element = AsyncElement(event);
+    auto it = element != nullptr ? async_handlers_.find(element) : async_handlers_.end();
+    if (it != async_handlers_.end()) {
+      ok = it->second.handler(it->second.arg, event) && ok;
+    } else if (element == nullptr) {
+      LOG(WARNING) << "async event of device " << name_ << " : "
+                   << ibv_event_type_str(event.event_type);
+    } else {
+      LOG(WARNING) << "async event without handler : " << ibv_event_type_str(event.event_type);
+    }
+    ibv_ack_async_event(&event);
+  }
+  return ok;
+}
+
+void Device::AddAsyncHandler(const void *element, AsyncEventHandler handler, void *arg) {
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  async_handlers_[element] = {.handler = handler, .arg = arg};
+}
+
+void Device::RemoveAsyncHandler(const void *element) {
+  std::lock_guard<std::mutex> lock(async_mutex_);
+  async_handlers_.erase(element);
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <glog/logging.h>
+#include <infiniband/verbs.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BUF_ACCESS                                                                  \
+  (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | \
+   IBV_ACCESS_REMOTE_ATOMIC)
+
+// IBV_MTU_256 is 1 and every following value doubles the size
+inline int MTUBytes(ibv_mtu mtu) { return 128 << mtu; }
+
+struct RemoteRegion {
+  /* remote memory which one-sided operations target */
+  uint64_t addr;   /* start of the buffer */
+  uint64_t length; /* length of the buffer in bytes */
+  uint32_t rkey;   /* remote key */
+};
+
+struct MemoryRegion {
+  /* registered memory which can be the local or remote buffer of a work request */
+  char *addr;     /* start of the buffer */
+  size_t length;  /* length of the buffer in bytes */
+  uint32_t lkey;  /* local key */
+  uint32_t rkey;  /* remote key */
+  int access;     /* ibv_access_flags it was registered with */
+  ibv_mr *mr;     /* verbs handle, null on the software device */
+  bool owned;     /* buffer allocated by the device and freed on deregister */
+  bool huge_page; /* buffer mapped from huge pages */
+  // describe the region for a peer
+  RemoteRegion Remote() const { return {.addr = (uint64_t)addr, .length = length, .rkey = rkey}; }
+};
+
+class ShmKeyTable;
+
+// handle an async event of the QP or SRQ it was added for, return false on failure
+typedef bool (*AsyncEventHandler)(void *arg, const ibv_async_event &event);
+
+struct PortInfo {
+  /* attributes of a port and gid index, queried once per device */
+  uint32_t ib_port;
+  uint32_t gid_idx;
+  uint16_t lid;
+  ibv_mtu active_mtu;
+  ibv_gid gid;
+};
+
+struct SoftLink {
+  /* wire model of the software device, one link carries both directions */
+  uint64_t latency_ns; /* one way latency of every request */
+  double gbps;         /* bandwidth in Gb/s, 0 : unlimited */
+  uint64_t free_ns;    /* time the link is done with the data already sent */
+};
+
+// An opened device and its protection domain, shared by every RDMA instance created on it.
+// Instances keep the device alive through a shared_ptr and Open returns the instance already
+// open for the same name, so only the first connection pays for opening the device and
+// allocating the PD. Memory registered here can be used by all QPs of the device and lives
+// until it is deregistered or the device is closed. All methods are thread safe.
+// Opening SOFT_DEVICE gives a device without hardware whose QPs run in the process, see
+// soft_transport.h.
+class Device {
+ public:
+  // open the named device, or the first one if the name is empty, or share it if it is open
+  static std::shared_ptr<Device> Open(std::string dev_name = "");
+  ~Device();
+
+  Device(const Device &) = delete;
+  Device &operator=(const Device &) = delete;
+
+  // query the port once and return the cached attributes afterwards
+  bool QueryPort(uint32_t ib_port, uint32_t gid_idx, PortInfo *info);
+
+  // register a caller-owned buffer, the buffer must outlive the returned region
+  MemoryRegion *RegisterMemory(void *addr, size_t length, int access = BUF_ACCESS);
+  // allocate and register a buffer, huge page backed buffers fall back to normal pages
+  MemoryRegion *AllocMemory(size_t length, bool huge_page = false, int access = BUF_ACCESS);
+  bool DeregisterMemory(MemoryRegion *mr);
+  // the remote keys of the device published for peers on this host, created on first use,
+  // nullptr if it cannot be created
+  ShmKeyTable *SharedKeys();
+
+  // async events of every QP and SRQ of the device arrive on one non-blocking fd, -1 on the
+  // software device. HandleAsyncEvents drains it and hands each event to the handler added
+  // for its QP or SRQ, events of the ports and of elements without a handler are logged.
+  // Return false if a handler failed
+  int AsyncFD() const { return ctx_ != nullptr ? ctx_->async_fd : -1; }
+  bool HandleAsyncEvents();
+  // element is the ibv_qp or ibv_srq, a handler is not running once it is removed
+  void AddAsyncHandler(const void *element, AsyncEventHandler handler, void *arg);
+  void RemoveAsyncHandler(const void *element);
+
+  const std::string &Name() const { return name_; }
+  ibv_context *Context() const { return ctx_; }
+  ibv_pd *PD() const { return pd_; }
+  const ibv_device_attr &Attr() const { return attr_; }
+  bool IsSoft() const { return soft_; }
+
+  // model the wire of the software device, set it before the QPs are created
+  void SetSoftLink(uint64_t latency_ns, double gbps) { soft_link_ = {latency_ns, gbps, 0}; }
+  SoftLink *Link() { return &soft_link_; }
+
+ private:
+  Device() = default;
+  bool Init(ibv_device *dev);
+  void InitSoft();
+
+  std::string name_;
+  ibv_context *ctx_ = nullptr;
+  ibv_pd *pd_ = nullptr;
+  ibv_device_attr attr_ = {};
+  bool soft_ = false;
+  SoftLink soft_link_ = {};
+
+  std::mutex mutex_;
+  std::vector<PortInfo> ports_;
+  std::vector<std::unique_ptr<MemoryRegion>> mrs_;
+  std::unique_ptr<ShmKeyTable> shm_keys_;
+
+  struct AsyncHandler {
+    AsyncEventHandler handler;
+    void *arg;
+  };
+  // held while events are dispatched, apart from mutex_ which the handlers may take
+  std::mutex async_mutex_;
+  std::map<const void *, AsyncHandler> async_handlers_;
+
+  // open devices by name, an empty name stands for the default device
+  static std::mutex open_mutex_;
+  static std::map<std::string, std::weak_ptr<Device>> open_;
+};
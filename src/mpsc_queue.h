@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// Bounded lock-free queue for many producers and one consumer. Every cell carries a
+// sequence number which tells producers whether it is free for the position they claimed
+// and tells the consumer whether the item of its position has been published, so neither
+// side ever waits on a lock.
+template <typename T>
+class MPSCQueue {
+ public:
+  // capacity is rounded up to a power of two
+  explicit MPSCQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MPSCQueue(const MPSCQueue &) = delete;
+  MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+  // thread safe, return false if the queue is full
+  bool Push(const T &item) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // the consumer has not taken the item of the previous lap yet
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->item = item;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // only for the consumer thread, return false if the queue is empty
+  bool Pop(T *item) {
+    Cell *cell = &cells_[head_ & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != head_ + 1) {
+      return false;
+    }
+    *item = cell->item;
+    // free the cell for the producer of the next lap
+    cell->seq.store(head_ + mask_ + 1, std::memory_order_release);
+    head_++;
+    return true;
+  }
+
+  // only for the consumer thread, the oldest item or nullptr if the queue is empty, the item
+  // stays in the queue until Pop
+  const T *Front() const {
+    const Cell *cell = &cells_[head_ & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != head_ + 1) {
+      return nullptr;
+    }
+    return &cell->item;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  // padding keeps the producers and the consumer on different cache lines, C++11 new does
+  // not honor alignas beyond the default alignment
+  char pad0_[CACHE_LINE_SIZE];
+  std::atomic<size_t> tail_{0};
+  char pad1_[CACHE_LINE_SIZE];
+  size_t head_ = 0;
+};
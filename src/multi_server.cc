@@ -0,0 +1,49 @@
+#include "multi_server.h"
+#include <glog/logging.h>
+#include <cassert>
+
+MultiServer::MultiServer(std::string ip_port, uint32_t ib_port, uint32_t gid_idx,
+                         const RDMAConfig &config, int backlog)
+    : listener_(ip_port, backlog), ib_port_(ib_port), gid_idx_(gid_idx), config_(config) {}
+
+bool MultiServer::Init(std::string dev_name) {
+  device_ = Device::Open(dev_name);
+  return device_ != nullptr;
+}
+
+bool MultiServer::Accept(int num, int threads) {
+  assert(device_ != nullptr);
+  size_t first = peers_.size();
+  peers_.resize(first + num);
+
+  // a thread accepts its next client as soon as the previous handshake is done
+  bool ok = ParallelFor(num, threads, [&](int i) {
+    Peer *peer = &peers_[first + i];
+    peer->tcp = listener_.Accept();
+    return peer->tcp != nullptr && Setup(peer);
+  });
+  LOG(INFO) << "server : " << peers_.size() << " clients connected";
+  return ok;
+}
+
+bool MultiServer::Setup(Peer *peer) {
+  peer->rdma.reset(new RDMA(ib_port_, gid_idx_, config_));
+  RDMA *rdma = peer->rdma.get();
+  if (!rdma->Init(device_)) {
+    LOG(ERROR) << "server : fail to create QP";
+    return false;
+  }
+  Connection linfo = rdma->LocalInfo();
+  Connection rinfo;
+  int recv = peer->tcp->ExchangeData((char *)&linfo, sizeof(linfo), (char *)&rinfo, sizeof(rinfo));
+  if (recv != sizeof(rinfo)) {
+    LOG(ERROR) << "server : fail to exchange connection info";
+    return false;
+  }
+  rdma->SetRemoteInfo(rinfo);
+  if (!rdma->ModifyQP(INIT) || !rdma->ModifyQP(RTR) || !rdma->ModifyQP(RTS)) {
+    LOG(ERROR) << "server : fail to bring QP " << linfo.qp_num << " up";
+    return false;
+  }
+  return rdma->ConnectSharedMemory(peer->tcp.get());
+}
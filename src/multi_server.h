@@ -0,0 +1,42 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include "bulk_connect.h"
+
+// A server that keeps listening and connects a QP for every accepted client. All QPs are
+// created on one shared Device, so memory registered with it, or a SharedReceiveQueue on
+// it, can be used on any connection. Clients connect with the
+// usual Client.
+class MultiServer {
+ public:
+  MultiServer(std::string ip_port, uint32_t ib_port, uint32_t gid_idx,
+              const RDMAConfig &config = RDMAConfig(), int backlog = TCP_BACKLOG);
+
+  MultiServer(const MultiServer &) = delete;
+  MultiServer &operator=(const MultiServer &) = delete;
+
+  // open the device shared by every connection
+  bool Init(std::string dev_name = "");
+  // accept num more clients, bringing up to threads of them up at once, return false if any
+  // of them failed
+  bool Accept(int num, int threads = SETUP_THREADS);
+
+  size_t Size() const { return peers_.size(); }
+  const std::shared_ptr<Device> &SharedDevice() const { return device_; }
+  RDMA *Conn(size_t i) { return peers_[i].rdma.get(); }
+  TCPConnector *TCP(size_t i) { return peers_[i].tcp.get(); }
+
+ private:
+  struct Peer {
+    std::unique_ptr<TCPConnector> tcp;
+    std::unique_ptr<RDMA> rdma;
+  };
+  bool Setup(Peer *peer);
+
+  TCPConnector listener_;
+  uint32_t ib_port_;
+  uint32_t gid_idx_;
+  RDMAConfig config_;
+  std::shared_ptr<Device> device_;
+  std::vector<Peer> peers_;
+};
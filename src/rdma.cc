@@ -1,194 +1,303 @@
 #include "rdma.h"
+#include "soft_transport.h"
+#include "srq.h"
+#include "stats.h"
+#include "tcp_connection.h"
+#include "trace.h"
 #include <glog/logging.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
 
 RDMA::~RDMA() {
   int rc;
 
+  if (transport_ != nullptr && config_.cq != nullptr) {
+    config_.cq->Detach(transport_->QPNum());
+  }
+  transport_ = nullptr;
   if (qp_ != nullptr) {
+    device_->RemoveAsyncHandler(qp_);
     rc = ibv_destroy_qp(qp_);
     assert(rc == 0);
     qp_ = nullptr;
   }
 
-  if (mr_ != nullptr) {
-    rc = ibv_dereg_mr(mr_);
-    assert(rc == 0);
-    mr_ = nullptr;
+  while (!mrs_.empty()) {
+    if (!DeregisterMemory(mrs_.back())) {
+      mrs_.pop_back();
+    }
   }
+  buf_ = nullptr;
 
-  if (cq_ != nullptr) {
+  if (cq_ != nullptr && config_.cq == nullptr) {
+    ibv_ack_cq_events(cq_, unacked_events_);
     rc = ibv_destroy_cq(cq_);
     assert(rc == 0);
     cq_ = nullptr;
   }
 
-  if (pd_ != nullptr) {
-    rc = ibv_dealloc_pd(pd_);
+  if (channel_ != nullptr) {
+    rc = ibv_destroy_comp_channel(channel_);
     assert(rc == 0);
-    pd_ = nullptr;
+    channel_ = nullptr;
   }
 
-  if (dev_ctx_ != nullptr) {
-    rc = ibv_close_device(dev_ctx_);
-    assert(rc == 0);
-    dev_ctx_ = nullptr;
+  if (stats_ != nullptr) {
+    delete stats_;
+    stats_ = nullptr;
   }
+
+  // the device is closed with its last instance
+  pd_ = nullptr;
+  dev_ctx_ = nullptr;
+  device_ = nullptr;
 }
 
 bool RDMA::Init(std::string dev_name) {
-  bool first_dev = false;
-  int rc;
-
-  if (dev_name.size() == 0) {
-    first_dev = true;
+  std::shared_ptr<Device> device = Device::Open(dev_name.empty() ? config_.dev_name : dev_name);
+  if (device == nullptr) {
+    return false;
   }
-  int dev_num;
-  auto dev_list = ibv_get_device_list(&dev_num);
-  if (dev_num <= 0) {
-    LOG(ERROR) << "none IB device";
+  return Init(device);
+}
+
+bool RDMA::Init(std::shared_ptr<Device> device) {
+  int rc;
+  PortInfo port;
+  if (!device->QueryPort(ib_port_, gid_idx_, &port)) {
     return false;
   }
+  device_ = device;
+  dev_ctx_ = device->Context();
+  pd_ = device->PD();
+  lid_ = port.lid;
+  active_mtu_ = port.active_mtu;
+  gid_ = port.gid;
+
+  const ibv_device_attr &dev_attr = device->Attr();
+  config_.max_send_sge = std::max(1u, std::min<uint32_t>(config_.max_send_sge, dev_attr.max_sge));
+  config_.max_recv_sge = std::max(1u, std::min<uint32_t>(config_.max_recv_sge, dev_attr.max_sge));
+  // clamp the requested READ/atomic depth to what the device allows for each role
+  uint32_t rd_atomic = config_.max_rd_atomic != 0 ? config_.max_rd_atomic : UINT8_MAX;
+  max_init_rd_atomic_ = std::min<uint32_t>(rd_atomic, dev_attr.max_qp_init_rd_atom);
+  max_dest_rd_atomic_ = std::min<uint32_t>(rd_atomic, dev_attr.max_qp_rd_atom);
+
+  if (device->IsSoft() && config_.use_event) {
+    LOG(WARNING) << "software device has no completion channel, poll instead";
+    config_.use_event = false;
+  }
 
-  ibv_device *dev = nullptr;
-  if (first_dev) {
-    dev = dev_list[0];
-    dev_name = dev->dev_name;
+  if (config_.stats) {
+    stats_ = new Stats();
+  }
+  buf_ = AllocMemory(config_.buf_size);
+  assert(buf_ != nullptr);
+  lkey_ = buf_->lkey;
+  rkey_ = buf_->rkey;
+  if (config_.signal_interval == 0 || config_.signal_interval > config_.max_send_wr) {
+    config_.signal_interval = config_.max_send_wr;
+  }
+  if (config_.cqe_num == 0) {
+    // with a shared queue max_recv_wr is the share of this QP, not the size of the pool
+    config_.cqe_num = config_.max_send_wr + config_.max_recv_wr;
+  }
+  if (config_.cq != nullptr) {
+    // a shared CQ is polled by its owner thread, there is no completion channel
+    assert(!config_.use_event);
+    config_.cqe_num = config_.cq->Size();
+  } else if (config_.use_event) {
+    channel_ = ibv_create_comp_channel(dev_ctx_);
+    assert(channel_ != nullptr);
+    // non-blocking so the fd can be driven by epoll
+    int flags = fcntl(channel_->fd, F_GETFL);
+    rc = fcntl(channel_->fd, F_SETFL, flags | O_NONBLOCK);
+    assert(rc == 0);
+  }
+  ibv_qp_cap cap = {
+      .max_send_wr = config_.max_send_wr,
+      .max_recv_wr = config_.max_recv_wr,
+      .max_send_sge = config_.max_send_sge,
+      .max_recv_sge = config_.max_recv_sge,
+      .max_inline_data = config_.max_inline_data,
+  };
+  if (device->IsSoft()) {
+    if (config_.srq != nullptr) {
+      LOG(ERROR) << "software device has no shared receive queue";
+      return false;
+    }
+    SoftCQ *cq = config_.cq != nullptr ? config_.cq->Soft() : nullptr;
+    transport_.reset(new SoftTransport(cq, config_.cqe_num, cap, device->Link()));
   } else {
-    for (int i = 0; i < dev_num; i++) {
-      auto name = ibv_get_device_name(dev_list[i]);
-      if (strcmp(dev_name.c_str(), name) == 0) {
-        dev = dev_list[i];
-        break;
-      }
+    cq_ = config_.cq != nullptr ? config_.cq->CQ()
+                                : ibv_create_cq(dev_ctx_, config_.cqe_num, nullptr, channel_, 0);
+    assert(cq_ != nullptr);
+    if (channel_ != nullptr) {
+      rc = ibv_req_notify_cq(cq_, 0);
+      assert(rc == 0);
     }
-  }
 
-  if (dev == nullptr) {
-    LOG(ERROR) << "cannot find device : " << dev_name;
-    ibv_free_device_list(dev_list);
-    return false;
+    ibv_qp_init_attr qp_init_attr = {
+        .send_cq = cq_,
+        .recv_cq = cq_,
+        .srq = config_.srq != nullptr ? config_.srq->SRQ() : nullptr,
+        .cap = cap,
+        .qp_type = IBV_QPT_RC,
+        .sq_sig_all = 0,
+    };
+    qp_ = ibv_create_qp(pd_, &qp_init_attr);
+    if (qp_ == nullptr && qp_init_attr.cap.max_inline_data > 0) {
+      LOG(WARNING) << "device rejects " << config_.max_inline_data
+                   << " bytes inline, disable inline";
+      qp_init_attr.cap.max_inline_data = 0;
+      qp_ = ibv_create_qp(pd_, &qp_init_attr);
+    }
+    assert(qp_ != nullptr);
+    device->AddAsyncHandler(qp_, &RDMA::OnAsyncEvent, this);
+    // the provider reports the inline size it actually supports
+    config_.max_inline_data = qp_init_attr.cap.max_inline_data;
+    transport_.reset(new VerbsTransport(qp_, cq_));
   }
-
-  // open device
-  dev_ctx_ = ibv_open_device(dev);
-  assert(dev_ctx_ != nullptr);
-  LOG(INFO) << "node state : " << ibv_node_type_str(dev->node_type);
-
-  // query port num
-  ibv_device_attr dev_attr;
-  memset(&dev_attr, 0, sizeof(dev_attr));
-  rc = ibv_query_device(dev_ctx_, &dev_attr);
-  assert(rc == 0);
-  if (ib_port_ > dev_attr.phys_port_cnt) {
-    LOG(ERROR) << "invalid IB port for device : " << dev_name << " with " << dev_attr.phys_port_cnt
-               << " port";
-    ibv_free_device_list(dev_list);
-    return false;
+  if (config_.cq != nullptr) {
+    config_.cq->Attach(transport_->QPNum(), this);
+  }
+  send_slots_.assign(config_.max_send_wr, Completion());
+  recv_slots_.assign(config_.max_recv_wr, Completion());
+  send_wrs_.resize(config_.max_send_wr);
+  send_sges_.resize(config_.max_send_wr * config_.max_send_sge);
+  recv_wrs_.resize(config_.max_recv_wr);
+  recv_sges_.resize(config_.max_recv_wr * config_.max_recv_sge);
+  recv_ring_reqs_.resize(config_.max_recv_wr);
+  wcs_.resize(std::max<uint32_t>(config_.poll_batch, 1));
+  if (config_.srq != nullptr) {
+    srq_ready_.resize(config_.max_recv_wr);
   }
-
-  // query port lid and state
-  ibv_port_attr port_attr;
-  memset(&port_attr, 0, sizeof(port_attr));
-  rc = ibv_query_port(dev_ctx_, ib_port_, &port_attr);
-  assert(rc == 0);
-  LOG(INFO) << "port state : " << ibv_port_state_str(port_attr.state);
-  LOG(INFO) << "port lid : " << port_attr.lid;
-  lid_ = port_attr.lid;
-
-  // query gid
-  rc = ibv_query_gid(dev_ctx_, ib_port_, gid_idx_, &gid_);
-  assert(rc == 0);
-
-  ibv_free_device_list(dev_list);
-
-  pd_ = ibv_alloc_pd(dev_ctx_);
-  assert(pd_ != nullptr);
-
-  memset(buf_, 0, BUF_SIZE);
-  mr_ = ibv_reg_mr(pd_, buf_, BUF_SIZE, BUF_ACCESS);
-  assert(mr_ != nullptr);
-  lkey_ = mr_->lkey;
-  rkey_ = mr_->rkey;
-  cq_ = ibv_create_cq(dev_ctx_, CQE_NUM, nullptr, nullptr, 0);
-  assert(cq_ != nullptr);
-
-  ibv_qp_init_attr qp_init_attr = {
-      .send_cq = cq_,
-      .recv_cq = cq_,
-      .srq = nullptr,
-      .cap =
-          {
-              .max_send_wr = 1,
-              .max_recv_wr = 1,
-              .max_send_sge = 1,
-              .max_recv_sge = 1,
-              .max_inline_data = 0,
-          },
-      .qp_type = IBV_QPT_RC,
-      .sq_sig_all = 1,
-  };
-  qp_ = ibv_create_qp(pd_, &qp_init_attr);
-  assert(qp_ != nullptr);
 
   // set local_info
   memcpy(local_info_.gid, gid_.raw, 16);
-  local_info_.addr = (uint64_t)buf_;
+  local_info_.addr = (uint64_t)buf_->addr;
+  local_info_.length = buf_->length;
   local_info_.lid = lid_;
-  local_info_.qp_num = qp_->qp_num;
+  local_info_.qp_num = transport_->QPNum();
+  local_info_.mtu = active_mtu_;
+  local_info_.rd_atomic = max_dest_rd_atomic_;
   local_info_.rkey = rkey_;
-  char tmp[64];
-  sprintf(tmp, "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-          local_info_.gid[0], local_info_.gid[1], local_info_.gid[2], local_info_.gid[3],
-          local_info_.gid[4], local_info_.gid[5], local_info_.gid[6], local_info_.gid[7],
-          local_info_.gid[8], local_info_.gid[9], local_info_.gid[10], local_info_.gid[11],
-          local_info_.gid[12], local_info_.gid[13], local_info_.gid[14], local_info_.gid[15]);
-  LOG(INFO) << "LOCAL gid : " << tmp;
-  LOG(INFO) << "LOCAL addr : " << local_info_.addr;
-  LOG(INFO) << "LOCAL rkey : " << local_info_.rkey;
-  LOG(INFO) << "LOCAL lid : " << local_info_.lid;
-  LOG(INFO) << "LOCAL qp num : " << local_info_.qp_num;
+  HostID(local_info_.host_id);
+  local_info_.pid = getpid();
+  // one connection writes these, bulk connects of thousands of QPs keep them quiet
+  if (VLOG_IS_ON(1)) {
+    char tmp[64];
+    sprintf(tmp,
+            "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+            local_info_.gid[0], local_info_.gid[1], local_info_.gid[2], local_info_.gid[3],
+            local_info_.gid[4], local_info_.gid[5], local_info_.gid[6], local_info_.gid[7],
+            local_info_.gid[8], local_info_.gid[9], local_info_.gid[10], local_info_.gid[11],
+            local_info_.gid[12], local_info_.gid[13], local_info_.gid[14], local_info_.gid[15]);
+    VLOG(1) << "LOCAL gid : " << tmp;
+    VLOG(1) << "LOCAL addr : " << local_info_.addr;
+    VLOG(1) << "LOCAL length : " << local_info_.length;
+    VLOG(1) << "LOCAL rkey : " << local_info_.rkey;
+    VLOG(1) << "LOCAL lid : " << local_info_.lid;
+    VLOG(1) << "LOCAL qp num : " << local_info_.qp_num;
+    VLOG(1) << "LOCAL queue depth : " << config_.max_send_wr << " / " << config_.max_recv_wr;
+    VLOG(1) << "LOCAL signal interval : " << config_.signal_interval;
+    VLOG(1) << "LOCAL max inline data : " << config_.max_inline_data;
+  }
   return true;
 }
 
 void RDMA::SetRemoteInfo(const Connection &remote_info) {
   remote_info_ = remote_info;
-  char tmp[128];
-  sprintf(tmp, "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x",
-          remote_info_.gid[0], remote_info_.gid[1], remote_info_.gid[2], remote_info_.gid[3],
-          remote_info_.gid[4], remote_info_.gid[5], remote_info_.gid[6], remote_info_.gid[7],
-          remote_info_.gid[8], remote_info_.gid[9], remote_info_.gid[10], remote_info_.gid[11],
-          remote_info_.gid[12], remote_info_.gid[13], remote_info_.gid[14], remote_info_.gid[15]);
-  LOG(INFO) << "REMOTE gid : " << tmp;
-  LOG(INFO) << "REMOTE addr : " << remote_info_.addr;
-  LOG(INFO) << "REMOTE rkey : " << remote_info_.rkey;
-  LOG(INFO) << "REMOTE lid : " << remote_info_.lid;
-  LOG(INFO) << "REMOTE qp num : " << remote_info_.qp_num;
+  if (VLOG_IS_ON(1)) {
+    char tmp[128];
+    sprintf(tmp,
+            "%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x",
+            remote_info_.gid[0], remote_info_.gid[1], remote_info_.gid[2], remote_info_.gid[3],
+            remote_info_.gid[4], remote_info_.gid[5], remote_info_.gid[6], remote_info_.gid[7],
+            remote_info_.gid[8], remote_info_.gid[9], remote_info_.gid[10], remote_info_.gid[11],
+            remote_info_.gid[12], remote_info_.gid[13], remote_info_.gid[14], remote_info_.gid[15]);
+    VLOG(1) << "REMOTE gid : " << tmp;
+    VLOG(1) << "REMOTE addr : " << remote_info_.addr;
+    VLOG(1) << "REMOTE length : " << remote_info_.length;
+    VLOG(1) << "REMOTE rkey : " << remote_info_.rkey;
+    VLOG(1) << "REMOTE lid : " << remote_info_.lid;
+    VLOG(1) << "REMOTE qp num : " << remote_info_.qp_num;
+    VLOG(1) << "REMOTE rd atomic : " << (int)remote_info_.rd_atomic;
+    VLOG(1) << "REMOTE active MTU : " << MTUBytes((ibv_mtu)remote_info_.mtu);
+  }
+
+  if (config_.path_mtu != 0) {
+    path_mtu_ = (ibv_mtu)config_.path_mtu;
+  } else {
+    // ibv_mtu grows with the MTU size, so the smaller enum is the smaller MTU
+    path_mtu_ = std::min(active_mtu_, (ibv_mtu)remote_info_.mtu);
+  }
+  VLOG(1) << "path MTU : " << MTUBytes(path_mtu_);
+
+  // never issue more READ/atomic requests than the peer can hold as responder
+  max_rd_atomic_ = std::min(max_init_rd_atomic_, remote_info_.rd_atomic);
+  VLOG(1) << "max rd atomic : " << (int)max_rd_atomic_ << " / " << (int)max_dest_rd_atomic_;
 };
 
+MemoryRegion *RDMA::RegisterMemory(void *addr, size_t length, int access) {
+  assert(device_ != nullptr);
+  MemoryRegion *region = device_->RegisterMemory(addr, length, access);
+  if (region != nullptr) {
+    mrs_.push_back(region);
+  }
+  return region;
+}
+
+MemoryRegion *RDMA::AllocMemory(size_t length, bool huge_page, int access) {
+  assert(device_ != nullptr);
+  MemoryRegion *region = device_->AllocMemory(length, huge_page, access);
+  if (region != nullptr) {
+    mrs_.push_back(region);
+  }
+  return region;
+}
+
+bool RDMA::DeregisterMemory(MemoryRegion *mr) {
+  auto it = std::find(mrs_.begin(), mrs_.end(), mr);
+  if (it == mrs_.end()) {
+    LOG(ERROR) << "memory region is not registered by this RDMA";
+    return false;
+  }
+  if (!device_->DeregisterMemory(mr)) {
+    return false;
+  }
+  mrs_.erase(it);
+  return true;
+}
+
 bool RDMA::ModifyQP(QPState state) {
   ibv_qp_attr attr;
   memset(&attr, 0, sizeof(attr));
   int flags;
-  int rc;
+  const char *name;
   switch (state) {
     case INIT:
+      name = "INIT";
       attr.qp_state = IBV_QPS_INIT;
       attr.port_num = ib_port_;
       attr.pkey_index = 0;
       attr.qp_access_flags = BUF_ACCESS;
       flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
-      rc = ibv_modify_qp(qp_, &attr, flags);
-      assert(rc == 0);
       break;
     case RTR:
+      name = "RTR";
       attr.qp_state = IBV_QPS_RTR;
-      attr.path_mtu = IBV_MTU_256;
+      attr.path_mtu = path_mtu_;
       attr.dest_qp_num = remote_info_.qp_num;
       attr.rq_psn = 0;
-      attr.max_dest_rd_atomic = 1;
+      attr.max_dest_rd_atomic = max_dest_rd_atomic_;
       attr.min_rnr_timer = 0x12;
 
       attr.ah_attr.dlid = remote_info_.lid;
@@ -204,143 +313,707 @@ bool RDMA::ModifyQP(QPState state) {
 
       flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
               IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
-      rc = ibv_modify_qp(qp_, &attr, flags);
-      assert(rc == 0);
       break;
     case RTS:
+      name = "RTS";
       attr.qp_state = IBV_QPS_RTS;
       attr.timeout = 14;
       attr.retry_cnt = 7;
       attr.rnr_retry = 7;
       attr.sq_psn = 0;
-      attr.max_rd_atomic = 1;
+      attr.max_rd_atomic = max_rd_atomic_;
       flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
               IBV_QP_MAX_QP_RD_ATOMIC;
-      rc = ibv_modify_qp(qp_, &attr, flags);
-      assert(rc == 0);
       break;
     default:
-      assert(0);
-      break;
+      LOG(ERROR) << "invalid QP state " << state;
+      return false;
+  }
+  // a provider returns the errno value
+  int rc = transport_->ModifyQP(&attr, flags);
+  if (rc != 0) {
+    LOG(ERROR) << "fail to modify QP " << transport_->QPNum() << " to " << name << " : "
+               << strerror(rc);
+    return false;
   }
   return true;
 }
 
-void RDMA::PostRecv() {
-  ibv_sge sge = {
-      .addr = (uintptr_t)buf_,
-      .length = BUF_SIZE,
-      .lkey = lkey_,
-  };
+bool RDMA::ConnectSharedMemory(TCPConnector *tcp) {
+  struct {
+    int32_t fd;
+    int32_t keys_fd;
+    uint64_t key;
+    uint64_t keys_key;
+  } local_ring = {-1, -1, 0, 0}, peer_ring = {-1, -1, 0, 0};
+  // the rings are only created for a peer on this host, the shared memory path polls its
+  // ring so a shared CQ or a completion channel would not see it
+  static const uint8_t unknown_host[16] = {};
+  std::unique_ptr<ShmRing> recv_ring;
+  if (config_.shm && config_.cq == nullptr && config_.srq == nullptr && !config_.use_event &&
+      memcmp(local_info_.host_id, unknown_host, 16) != 0 &&
+      memcmp(local_info_.host_id, remote_info_.host_id, 16) == 0) {
+    // the peer checks its remote keys against the regions of this device
+    ShmKeyTable *keys = device_->SharedKeys();
+    if (keys != nullptr) {
+      recv_ring = ShmRing::Create();
+    }
+    if (recv_ring != nullptr) {
+      local_ring = {recv_ring->FD(), keys->FD(), recv_ring->Key(), keys->Key()};
+    }
+  }
+  int recv = tcp->ExchangeData((char *)&local_ring, sizeof(local_ring), (char *)&peer_ring,
+                               sizeof(peer_ring));
+  if (recv != sizeof(peer_ring)) {
+    LOG(ERROR) << "fail to exchange shared memory ring";
+    return false;
+  }
+
+  std::unique_ptr<ShmRing> send_ring;
+  std::unique_ptr<ShmKeyTable> peer_keys;
+  if (recv_ring != nullptr && peer_ring.fd >= 0) {
+    send_ring = ShmRing::Open(remote_info_.pid, peer_ring.fd, peer_ring.key);
+    peer_keys = ShmKeyTable::Open(remote_info_.pid, peer_ring.keys_fd, peer_ring.keys_key);
+  }
+  if (peer_keys == nullptr) {
+    send_ring = nullptr;
+  }
+  if (send_ring != nullptr && !ShmTransport::CanAccess(remote_info_.pid, remote_info_.addr)) {
+    LOG(WARNING) << "cannot access the memory of process " << remote_info_.pid
+                 << ", keep the NIC";
+    send_ring = nullptr;
+  }
+  // the peer keeps its ring open until this side is done with opening it
+  char ready = send_ring != nullptr;
+  char peer_ready = 0;
+  if (tcp->ExchangeData(&ready, 1, &peer_ready, 1) != 1) {
+    LOG(ERROR) << "fail to exchange shared memory state";
+    return false;
+  }
+  if (!ready || !peer_ready) {
+    return true;
+  }
 
-  ibv_recv_wr wr = {
-      .wr_id = request_id_++,
-      .next = nullptr,
-      .sg_list = &sge,
-      .num_sge = 1,
+  assert(send_seq_ == 0 && recv_seq_ == 0);
+  ibv_qp_cap cap = {
+      .max_send_wr = config_.max_send_wr,
+      .max_recv_wr = config_.max_recv_wr,
+      .max_send_sge = config_.max_send_sge,
+      .max_recv_sge = config_.max_recv_sge,
+      .max_inline_data = config_.max_inline_data,
   };
-  ibv_recv_wr *bad_wr;
-  int rc = ibv_post_recv(qp_, &wr, &bad_wr);
-  assert(rc == 0);
+  // the QP of the device stays below for atomics
+  std::unique_ptr<Transport> nic = std::move(transport_);
+  transport_.reset(new ShmTransport(std::move(nic), std::move(recv_ring), std::move(send_ring),
+                                    std::move(peer_keys), remote_info_.pid, cap));
+  shm_ = true;
+  LOG(INFO) << "peer process " << remote_info_.pid << " on the same host, use shared memory";
+  return true;
 }
 
-void RDMA::PostSend(Opcode op) {
-  ibv_sge sge = {
-      .addr = (uintptr_t)buf_,
-      .length = BUF_SIZE,
-      .lkey = lkey_,
-  };
-  ibv_wr_opcode opcode;
-  switch (op) {
-    case RDMA_WRITE:
-      opcode = IBV_WR_RDMA_WRITE;
-      break;
-    case RDMA_READ:
-      opcode = IBV_WR_RDMA_READ;
-      break;
-    case RDMA_SEND:
-      opcode = IBV_WR_SEND;
-      break;
+// fill the SGEs of a work request, return the number of SGEs and set the total length
+static int FillSGE(const WorkRequest &req, uint32_t max_sge, ibv_sge *sges, uint32_t *length) {
+  if (req.num_sge == 0) {
+    assert(req.offset + req.length <= req.mr->length);
+    sges[0] = {
+        .addr = (uintptr_t)req.mr->addr + req.offset,
+        .length = req.length,
+        .lkey = req.mr->lkey,
+    };
+    *length = req.length;
+    return 1;
+  }
+  assert((uint32_t)req.num_sge <= max_sge);
+  *length = 0;
+  for (int i = 0; i < req.num_sge; i++) {
+    const SGE &sge = req.sg_list[i];
+    assert(sge.offset + sge.length <= sge.mr->length);
+    sges[i] = {
+        .addr = (uintptr_t)sge.mr->addr + sge.offset,
+        .length = sge.length,
+        .lkey = sge.mr->lkey,
+    };
+    *length += sge.length;
+  }
+  return req.num_sge;
+}
+
+uint64_t RDMA::PostRecv() { return PostRecv(buf_, 0, buf_->length); }
+
+uint64_t RDMA::PostRecv(const MemoryRegion *mr, size_t offset, uint32_t length) {
+  WorkRequest req = {.op = RDMA_SEND, .mr = mr, .offset = offset, .length = length};
+  uint64_t token;
+  return PostRecv(&req, 1, &token) == 1 ? token : INVALID_TOKEN;
+}
+
+uint64_t RDMA::PostRecv(const SGE *sges, int num_sge) {
+  WorkRequest req = {.op = RDMA_SEND, .sg_list = sges, .num_sge = num_sge};
+  uint64_t token;
+  return PostRecv(&req, 1, &token) == 1 ? token : INVALID_TOKEN;
+}
+
+int RDMA::PostRecv(const WorkRequest *reqs, int num, uint64_t *tokens) {
+  // receive buffers of a QP on a shared receive queue are posted to the queue
+  assert(config_.srq == nullptr);
+  num = std::min<int>(num, RecvQueueFree());
+  if (num <= 0) {
+    return 0;
+  }
+  for (int i = 0; i < num; i++) {
+    ibv_sge *sges = &recv_sges_[i * config_.max_recv_sge];
+    uint32_t length;
+    recv_wrs_[i] = {
+        .wr_id = (recv_seq_ + i) | RECV_TOKEN_BIT,
+        .next = i + 1 < num ? &recv_wrs_[i + 1] : nullptr,
+        .sg_list = sges,
+        .num_sge = FillSGE(reqs[i], config_.max_recv_sge, sges, &length),
+    };
+  }
+
+  // chain the whole batch so it costs one doorbell
+  ibv_recv_wr *bad_wr = nullptr;
+  int rc = transport_->PostRecv(recv_wrs_.data(), &bad_wr);
+  if (rc != 0) {
+    LOG(ERROR) << "fail to post recv : " << strerror(rc);
+    num = bad_wr != nullptr ? bad_wr - recv_wrs_.data() : 0;
+  }
+  uint64_t now = stats_ != nullptr ? StatsNowNs() : 0;
+  for (int i = 0; i < num; i++) {
+    uint64_t token = recv_seq_ | RECV_TOKEN_BIT;
+    recv_slots_[recv_seq_ % recv_slots_.size()] = {
+        .token = token, .done = false, .op = STATS_RECV, .post_ns = now};
+    RDMA_TRACE(TRACE_OP, TRACE_POST_RECV, STATS_RECV, transport_->QPNum(), token, 0, 0);
+    if (stats_ != nullptr) {
+      stats_->AddPost(STATS_RECV, 0);
+    }
+    recv_seq_++;
+    if (tokens != nullptr) {
+      tokens[i] = token;
+    }
+  }
+  return num;
+}
+
+int RDMA::PostRecvRing(const MemoryRegion *mr, size_t offset, uint32_t slot_size, int num,
+                       uint64_t *tokens) {
+  assert(offset + (size_t)slot_size * num <= mr->length);
+  num = std::min<int>(num, RecvQueueFree());
+  for (int i = 0; i < num; i++) {
+    recv_ring_reqs_[i] = {
+        .op = RDMA_SEND, .mr = mr, .offset = offset + (size_t)slot_size * i, .length = slot_size};
+  }
+  return PostRecv(recv_ring_reqs_.data(), num, tokens);
+}
+
+uint64_t RDMA::PostSend(Opcode op) { return PostSend(op, buf_, 0, buf_->length); }
+
+uint64_t RDMA::PostSend(Opcode op, const MemoryRegion *mr, size_t offset, uint32_t length,
+                        uint64_t remote_offset, bool signaled) {
+  WorkRequest req = {.op = op,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = length,
+                     .remote_offset = remote_offset,
+                     .signaled = signaled};
+  uint64_t token;
+  return PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN;
+}
+
+uint64_t RDMA::PostSend(Opcode op, const SGE *sges, int num_sge, uint64_t remote_offset,
+                        bool signaled) {
+  WorkRequest req = {.op = op,
+                     .remote_offset = remote_offset,
+                     .signaled = signaled,
+                     .sg_list = sges,
+                     .num_sge = num_sge};
+  uint64_t token;
+  return PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN;
+}
+
+int RDMA::PostSend(const WorkRequest *reqs, int num, uint64_t *tokens) {
+  num = std::min<int>(num, SendQueueFree());
+  if (num <= 0) {
+    return 0;
+  }
+  for (int i = 0; i < num; i++) {
+    const WorkRequest &req = reqs[i];
+    ibv_wr_opcode opcode;
+    switch (req.op) {
+      case RDMA_WRITE:
+        opcode = IBV_WR_RDMA_WRITE;
+        break;
+      case RDMA_READ:
+        opcode = IBV_WR_RDMA_READ;
+        break;
+      case RDMA_SEND:
+        opcode = IBV_WR_SEND;
+        break;
+      case RDMA_FETCH_ADD:
+        opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+        break;
+      case RDMA_CMP_SWAP:
+        opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+        break;
+      case RDMA_WRITE_IMM:
+        opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+        break;
+      case RDMA_SEND_IMM:
+        opcode = IBV_WR_SEND_WITH_IMM;
+        break;
+      default:
+        assert(0);
+        break;
+    }
+    ibv_sge *sges = &send_sges_[i * config_.max_send_sge];
+    uint32_t length;
+    int num_sge = FillSGE(req, config_.max_send_sge, sges, &length);
+    // signal every signal_interval-th send, and the send taking the last free slot so the
+    // queue can always be drained
+    uint64_t seq = send_seq_ + i;
+    bool signaled = req.signaled || seq + 1 - send_signaled_ >= config_.signal_interval ||
+                    seq + 1 - send_done_ == config_.max_send_wr;
+    if (signaled) {
+      send_signaled_ = seq + 1;
+    }
+    unsigned int send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    // the CPU copies small payloads into the WQE, saving the NIC a DMA read of the buffer
+    bool can_inline = opcode == IBV_WR_SEND || opcode == IBV_WR_RDMA_WRITE ||
+                      opcode == IBV_WR_SEND_WITH_IMM || opcode == IBV_WR_RDMA_WRITE_WITH_IMM;
+    if (can_inline && length > 0 && length <= config_.max_inline_data) {
+      send_flags |= IBV_SEND_INLINE;
+    }
+    send_wrs_[i] = {
+        .wr_id = seq,
+        .next = i + 1 < num ? &send_wrs_[i + 1] : nullptr,
+        .sg_list = sges,
+        .num_sge = num_sge,
+        .opcode = opcode,
+        .send_flags = send_flags,
+    };
+    if (opcode == IBV_WR_SEND_WITH_IMM || opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+      send_wrs_[i].imm_data = htonl(req.imm_data);
+    }
+    if (opcode == IBV_WR_SEND || opcode == IBV_WR_SEND_WITH_IMM) {
+      continue;
+    }
+    uint64_t remote_addr = req.remote != nullptr ? req.remote->addr : remote_info_.addr;
+    uint64_t remote_length = req.remote != nullptr ? req.remote->length : remote_info_.length;
+    uint32_t rkey = req.remote != nullptr ? req.remote->rkey : remote_info_.rkey;
+    assert(req.remote_offset + length <= remote_length);
+    if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD || opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+      assert(length == ATOMIC_SIZE && (remote_addr + req.remote_offset) % ATOMIC_SIZE == 0);
+      send_wrs_[i].wr.atomic.remote_addr = remote_addr + req.remote_offset;
+      send_wrs_[i].wr.atomic.compare_add = req.compare_add;
+      send_wrs_[i].wr.atomic.swap = req.swap;
+      send_wrs_[i].wr.atomic.rkey = rkey;
+    } else {
+      send_wrs_[i].wr.rdma.remote_addr = remote_addr + req.remote_offset;
+      send_wrs_[i].wr.rdma.rkey = rkey;
+    }
+  }
+
+  // chain the whole batch so it costs one doorbell
+  ibv_send_wr *bad_wr = nullptr;
+  int rc = transport_->PostSend(send_wrs_.data(), &bad_wr);
+  if (rc != 0) {
+    LOG(ERROR) << "fail to post send : " << strerror(rc);
+    num = bad_wr != nullptr ? bad_wr - send_wrs_.data() : 0;
+  }
+  uint64_t now = stats_ != nullptr ? StatsNowNs() : 0;
+  for (int i = 0; i < num; i++) {
+    uint64_t token = send_seq_;
+    send_slots_[send_seq_ % send_slots_.size()] = {
+        .token = token, .done = false, .op = reqs[i].op, .post_ns = now};
+    uint32_t bytes = 0;
+    for (int j = 0; j < send_wrs_[i].num_sge; j++) {
+      bytes += send_wrs_[i].sg_list[j].length;
+    }
+    if (stats_ != nullptr) {
+      stats_->AddPost(reqs[i].op, bytes);
+    }
+    RDMA_TRACE(TRACE_OP, TRACE_POST_SEND, reqs[i].op, transport_->QPNum(), token, bytes, 0);
+    send_seq_++;
+    if (tokens != nullptr) {
+      tokens[i] = token;
+    }
+  }
+  return num;
+}
+
+int RDMA::PollCQ() { return PollCQ(wcs_.data(), wcs_.size()); }
+
+int RDMA::PollCQ(ibv_wc *wcs, int num) {
+  if (config_.cq != nullptr) {
+    // completions of the other QPs on the CQ go to their owners
+    return config_.cq->Poll(wcs, num);
+  }
+  int rc = transport_->PollCQ(num, wcs);
+  LOG_ASSERT(rc >= 0) << " return wc " << rc;
+  if (stats_ != nullptr) {
+    stats_->AddPoll(rc, num);
+  }
+  for (int i = 0; i < rc; i++) {
+    HandleWC(wcs[i]);
+  }
+  return rc;
+}
+
+void RDMA::HandleWC(const ibv_wc &wc) {
+  if (wc.wr_id & SRQ_TOKEN_BIT) {
+    HandleSRQWC(wc);
+    return;
+  }
+  // the opcode of a failed wc is undefined, so tell the queue apart by the token
+  bool is_recv = (wc.wr_id & RECV_TOKEN_BIT) != 0;
+  uint64_t seq = wc.wr_id & ~RECV_TOKEN_BIT;
+  uint64_t &done = is_recv ? recv_done_ : send_done_;
+  std::vector<Completion> &slots = is_recv ? recv_slots_ : send_slots_;
+  uint64_t now = stats_ != nullptr ? StatsNowNs() : 0;
+  for (; done <= seq; done++) {
+    Completion &slot = slots[done % slots.size()];
+    slot.done = true;
+    slot.status = IBV_WC_SUCCESS;
+    slot.byte_len = 0;
+    slot.has_imm = false;
+    if (stats_ != nullptr) {
+      stats_->AddCompletion(slot.op, now - slot.post_ns, done == seq && is_recv ? wc.byte_len : 0);
+    }
+  }
+  if (wc.status != IBV_WC_SUCCESS) {
+    RDMA_TRACE(TRACE_ERROR, TRACE_FAIL, slots[seq % slots.size()].op, wc.qp_num, wc.wr_id, 0,
+               wc.status);
+    if (stats_ != nullptr) {
+      stats_->AddError(wc.status);
+    }
+  } else {
+    RDMA_TRACE(TRACE_OP, TRACE_COMPLETE, slots[seq % slots.size()].op, wc.qp_num, wc.wr_id,
+               wc.byte_len, wc.status);
+  }
+  Completion &slot = slots[seq % slots.size()];
+  slot.status = wc.status;
+  slot.byte_len = wc.byte_len;
+  if (wc.status == IBV_WC_SUCCESS && (wc.wc_flags & IBV_WC_WITH_IMM)) {
+    slot.has_imm = true;
+    slot.imm_data = ntohl(wc.imm_data);
+  }
+}
+
+bool RDMA::OnAsyncEvent(void *arg, const ibv_async_event &event) {
+  RDMA *rdma = (RDMA *)arg;
+  switch (event.event_type) {
+    case IBV_EVENT_COMM_EST:
+    case IBV_EVENT_SQ_DRAINED:
+    case IBV_EVENT_PATH_MIG:
+    case IBV_EVENT_QP_LAST_WQE_REACHED:
+      VLOG(1) << "QP " << rdma->qp_->qp_num << " : " << ibv_event_type_str(event.event_type);
+      return true;
     default:
-      assert(0);
-      break;
+      // the QP moved to the error state, its outstanding requests complete with errors
+      LOG(ERROR) << "QP " << rdma->qp_->qp_num << " : " << ibv_event_type_str(event.event_type);
+      return false;
   }
-  ibv_send_wr wr = {
-      .wr_id = request_id_++,
-      .next = nullptr,
-      .sg_list = &sge,
-      .num_sge = 1,
-      .opcode = opcode,
-      .send_flags = IBV_SEND_SIGNALED,
-  };
+}
 
-  ibv_send_wr *bad_wr;
+void RDMA::HandleSRQWC(const ibv_wc &wc) {
+  SharedReceiveQueue *srq = config_.srq;
+  uint32_t slot = wc.wr_id & ~SRQ_TOKEN_BIT;
+  srq->Consume();
+  if (wc.status != IBV_WC_SUCCESS) {
+    RDMA_TRACE(TRACE_ERROR, TRACE_FAIL, STATS_RECV, wc.qp_num, wc.wr_id, 0, wc.status);
+    if (stats_ != nullptr) {
+      stats_->AddError(wc.status);
+    }
+    LOG(ERROR) << "fail RECV on shared queue " << slot;
+    LOG(ERROR) << "error :" << ibv_wc_status_str(wc.status);
+    // flushed buffers go back to the pool
+    srq->Release(slot);
+    return;
+  }
+  RDMA_TRACE(TRACE_OP, TRACE_COMPLETE, STATS_RECV, wc.qp_num, wc.wr_id, wc.byte_len, wc.status);
+  if (stats_ != nullptr) {
+    stats_->AddSharedRecv(wc.byte_len);
+  }
+  assert(srq_ready_tail_ - srq_ready_head_ < srq_ready_.size());
+  srq_ready_[srq_ready_tail_++ % srq_ready_.size()] = {
+      .data = srq->Buffer(slot), .length = wc.byte_len, .slot = slot};
+}
 
-  if (opcode != IBV_WR_SEND) {
-    wr.wr.rdma.remote_addr = remote_info_.addr;
-    wr.wr.rdma.rkey = remote_info_.rkey;
+bool RDMA::TryRecvShared(Message *msg) {
+  assert(config_.srq != nullptr);
+  if (srq_ready_head_ == srq_ready_tail_) {
+    PollCQ();
   }
-  int rc = ibv_post_send(qp_, &wr, &bad_wr);
-  assert(rc == 0);
+  if (srq_ready_head_ == srq_ready_tail_) {
+    return false;
+  }
+  *msg = srq_ready_[srq_ready_head_++ % srq_ready_.size()];
+  return true;
 }
 
-RDMA::WC RDMA::PollCQ() {
-  ibv_wc *wc = new ibv_wc();
-  int rc;
+bool RDMA::RecvShared(Message *msg) {
+  while (!TryRecvShared(msg)) {
+    WaitCQ();
+  }
+  return true;
+}
+
+const Completion *RDMA::Slot(uint64_t token) const {
+  const std::vector<Completion> &slots = (token & RECV_TOKEN_BIT) ? recv_slots_ : send_slots_;
+  const Completion &slot = slots[(token & ~RECV_TOKEN_BIT) % slots.size()];
+  // the slot has been reused, so the token completed long ago
+  return slot.token == token ? &slot : nullptr;
+}
+
+bool RDMA::IsDone(uint64_t token) const {
+  const Completion *slot = Slot(token);
+  return slot == nullptr || slot->done;
+}
+
+bool RDMA::Wait(uint64_t token, Completion *comp) {
+  assert(token != INVALID_TOKEN);
+  if ((token & RECV_TOKEN_BIT) == 0 && token >= send_signaled_ && !IsDone(token)) {
+    // no CQE will cover an unsignaled tail, so flush it with a signaled request
+    if (!PostSignal()) {
+      if (comp != nullptr) {
+        *comp = {.token = token, .status = IBV_WC_GENERAL_ERR};
+      }
+      return false;
+    }
+  }
+  while (!IsDone(token)) {
+    WaitCQ();
+  }
+  const Completion *slot = Slot(token);
+  if (slot == nullptr) {
+    // a newer token took the slot, the status of this one is lost
+    LOG(ERROR) << "completion of request " << token << " is overwritten";
+    if (comp != nullptr) {
+      *comp = {.token = token, .status = IBV_WC_GENERAL_ERR};
+    }
+    return false;
+  }
+  if (comp != nullptr) {
+    *comp = *slot;
+  }
+  return slot->status == IBV_WC_SUCCESS;
+}
+
+int RDMA::WaitCQ(int timeout_ms) {
+  using Clock = std::chrono::steady_clock;
+  auto start = Clock::now();
+  auto spin = std::chrono::microseconds(channel_ != nullptr ? config_.busy_poll_us : 0);
+  auto timeout = std::chrono::milliseconds(timeout_ms);
+  int num;
   do {
-    rc = ibv_poll_cq(cq_, 1, wc);
-  } while (rc == 0);
-  LOG_ASSERT(rc == 1) << " return wc " << rc;
-  return WC(wc);
+    num = PollCQ();
+    if (num > 0) {
+      return num;
+    }
+    if (channel_ == nullptr && timeout_ms >= 0 && Clock::now() - start >= timeout) {
+      return 0;
+    }
+  } while (channel_ == nullptr || Clock::now() - start < spin);
+
+  // arm before the last poll so a CQE which arrives in between still raises an event
+  int rc = ibv_req_notify_cq(cq_, 0);
+  assert(rc == 0);
+  num = PollCQ();
+  if (num > 0) {
+    return num;
+  }
+  pollfd pfd = {.fd = channel_->fd, .events = POLLIN, .revents = 0};
+  rc = poll(&pfd, 1, timeout_ms);
+  if (rc <= 0) {
+    return 0;
+  }
+  return HandleCQEvent();
 }
 
-std::string RDMA::Read() {
-  PostSend(RDMA_READ);
-  auto wc = PollCQ();
-  if (wc->status == IBV_WC_SUCCESS) {
-    LOG(INFO) << "finish READ request " << wc->wr_id;
-    return std::string(Buf());
-  }
-  LOG(ERROR) << "fail READ " << wc->wr_id;
-  LOG(ERROR) << "error :" << ibv_wc_status_str(wc->status);
-  return "";
-}
-
-bool RDMA::Write(std::string msg) {
-  strcpy(Buf(), msg.c_str());
-  PostSend(RDMA_WRITE);
-  auto wc = PollCQ();
-  if (wc->status == IBV_WC_SUCCESS) {
-    LOG(INFO) << "finish WRITE request " << wc->wr_id;
-    return true;
+int RDMA::HandleCQEvent() {
+  assert(channel_ != nullptr);
+  ibv_cq *ev_cq;
+  void *ev_ctx;
+  while (ibv_get_cq_event(channel_, &ev_cq, &ev_ctx) == 0) {
+    assert(ev_cq == cq_);
+    // acking takes a mutex inside libibverbs, so ack in batches
+    if (++unacked_events_ >= CQ_EVENT_ACK_BATCH) {
+      ibv_ack_cq_events(cq_, unacked_events_);
+      unacked_events_ = 0;
+    }
   }
-  LOG(ERROR) << "fail WRITE " << wc->wr_id;
-  LOG(ERROR) << "error :" << ibv_wc_status_str(wc->status);
-  return false;
+  int rc = ibv_req_notify_cq(cq_, 0);
+  assert(rc == 0);
+
+  // only CQEs added after arming raise an event, so drain everything
+  int total = 0;
+  int num;
+  while ((num = PollCQ()) > 0) {
+    total += num;
+  }
+  return total;
+}
+
+bool RDMA::PostSignal() {
+  // a zero length RDMA WRITE touches no memory on either side
+  WorkRequest req = {.op = RDMA_WRITE,
+                     .mr = buf_,
+                     .offset = 0,
+                     .length = 0,
+                     .remote_offset = 0,
+                     .signaled = true};
+  while (SendQueueFree() == 0) {
+    PollCQ();
+  }
+  if (PostSend(&req, 1) != 1) {
+    LOG(ERROR) << "fail to post signal request";
+    return false;
+  }
+  return true;
 }
 
-bool RDMA::Send(std::string msg) {
-  strcpy(Buf(), msg.c_str());
-  PostSend(RDMA_SEND);
-  auto wc = PollCQ();
-  if (wc->status == IBV_WC_SUCCESS) {
-    LOG(INFO) << "finish SEND request " << wc->wr_id;
+bool RDMA::WaitOp(const char *op, uint64_t token, Completion *comp) {
+  if (token == INVALID_TOKEN) {
+    LOG(ERROR) << "fail " << op << " : queue is full";
+    return false;
+  }
+  if (Wait(token, comp)) {
     return true;
   }
-  LOG(ERROR) << "fail SEND " << wc->wr_id;
-  LOG(ERROR) << "error :" << ibv_wc_status_str(wc->status);
+  LOG(ERROR) << "fail " << op << " " << token;
+  LOG(ERROR) << "error :" << ibv_wc_status_str(comp->status);
   return false;
 }
 
+std::string RDMA::Read() {
+  if (!Read(buf_, 0, buf_->length)) {
+    return "";
+  }
+  return std::string(Buf(), strnlen(Buf(), buf_->length));
+}
+
+bool RDMA::Write(const std::string &msg) {
+  assert(msg.size() < buf_->length);
+  memcpy(Buf(), msg.c_str(), msg.size() + 1);
+  return Write(buf_, 0, msg.size() + 1);
+}
+
+bool RDMA::Send(const std::string &msg) {
+  assert(msg.size() <= buf_->length);
+  memcpy(Buf(), msg.data(), msg.size());
+  return Send(buf_, 0, msg.size());
+}
+
 std::string RDMA::Recv() {
-  PostRecv();
-  auto wc = PollCQ();
-  if (wc->status == IBV_WC_SUCCESS) {
-    LOG(INFO) << "finish RECV request " << wc->wr_id;
-    return std::string(Buf());
+  int64_t len = Recv(buf_, 0, buf_->length);
+  if (len < 0) {
+    return "";
   }
-  LOG(ERROR) << "fail RECV  " << wc->wr_id;
-  LOG(ERROR) << "error :" << ibv_wc_status_str(wc->status);
+  return std::string(Buf(), len);
+}
 
-  return "";
+bool RDMA::Read(const MemoryRegion *mr, size_t offset, uint32_t length, uint64_t remote_offset) {
+  Completion comp;
+  return WaitOp("READ", PostSend(RDMA_READ, mr, offset, length, remote_offset, true), &comp);
+}
+
+bool RDMA::Write(const MemoryRegion *mr, size_t offset, uint32_t length, uint64_t remote_offset) {
+  Completion comp;
+  return WaitOp("WRITE", PostSend(RDMA_WRITE, mr, offset, length, remote_offset, true), &comp);
+}
+
+bool RDMA::Send(const MemoryRegion *mr, size_t offset, uint32_t length) {
+  Completion comp;
+  return WaitOp("SEND", PostSend(RDMA_SEND, mr, offset, length, 0, true), &comp);
+}
+
+int64_t RDMA::Recv(const MemoryRegion *mr, size_t offset, uint32_t length) {
+  Completion comp;
+  if (WaitOp("RECV", PostRecv(mr, offset, length), &comp)) {
+    return comp.byte_len;
+  }
+  return -1;
+}
+
+bool RDMA::FetchAdd(const MemoryRegion *mr, size_t offset, uint64_t remote_offset, uint64_t add,
+                    uint64_t *old, const RemoteRegion *remote) {
+  WorkRequest req = {.op = RDMA_FETCH_ADD,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = ATOMIC_SIZE,
+                     .remote_offset = remote_offset,
+                     .signaled = true,
+                     .remote = remote,
+                     .compare_add = add};
+  uint64_t token;
+  Completion comp;
+  if (!WaitOp("FETCH_ADD", PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN, &comp)) {
+    return false;
+  }
+  if (old != nullptr) {
+    memcpy(old, mr->addr + offset, ATOMIC_SIZE);
+  }
+  return true;
+}
+
+bool RDMA::CompareSwap(const MemoryRegion *mr, size_t offset, uint64_t remote_offset,
+                       uint64_t compare, uint64_t swap, uint64_t *old,
+                       const RemoteRegion *remote) {
+  WorkRequest req = {.op = RDMA_CMP_SWAP,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = ATOMIC_SIZE,
+                     .remote_offset = remote_offset,
+                     .signaled = true,
+                     .remote = remote,
+                     .compare_add = compare,
+                     .swap = swap};
+  uint64_t token;
+  Completion comp;
+  if (!WaitOp("CMP_SWAP", PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN, &comp)) {
+    return false;
+  }
+  if (old != nullptr) {
+    memcpy(old, mr->addr + offset, ATOMIC_SIZE);
+  }
+  return true;
+}
+
+bool RDMA::WriteWithImm(const MemoryRegion *mr, size_t offset, uint32_t length,
+                        uint64_t remote_offset, uint32_t imm_data) {
+  WorkRequest req = {.op = RDMA_WRITE_IMM,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = length,
+                     .remote_offset = remote_offset,
+                     .signaled = true,
+                     .imm_data = imm_data};
+  uint64_t token;
+  Completion comp;
+  return WaitOp("WRITE_IMM", PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN, &comp);
+}
+
+bool RDMA::SendWithImm(const MemoryRegion *mr, size_t offset, uint32_t length,
+                       uint32_t imm_data) {
+  WorkRequest req = {.op = RDMA_SEND_IMM,
+                     .mr = mr,
+                     .offset = offset,
+                     .length = length,
+                     .signaled = true,
+                     .imm_data = imm_data};
+  uint64_t token;
+  Completion comp;
+  return WaitOp("SEND_IMM", PostSend(&req, 1, &token) == 1 ? token : INVALID_TOKEN, &comp);
+}
+
+bool RDMA::RecvImm(uint32_t *imm_data) {
+  Completion comp;
+  if (!WaitOp("RECV_IMM", PostRecv(buf_, 0, 0), &comp)) {
+    return false;
+  }
+  if (!comp.has_imm) {
+    LOG(ERROR) << "receive " << comp.token << " carries no immediate";
+    return false;
+  }
+  *imm_data = comp.imm_data;
+  return true;
 }
\ No newline at end of file
@@ -1,18 +1,40 @@
+#pragma once
 #include <glog/logging.h>
 #include <infiniband/verbs.h>
 #include <memory>
 #include <string>
+#include <vector>
+#include "completion_queue.h"
+#include "device.h"
+#include "shm_transport.h"
+#include "transport.h"
 
 #define BUF_SIZE 1024
-#define BUF_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE)
-#define CQE_NUM 1
+#define ATOMIC_SIZE 8
+#define SEND_QUEUE_DEPTH 128
+#define RECV_QUEUE_DEPTH 128
+#define RECV_TOKEN_BIT (1ULL << 63)
+#define SRQ_TOKEN_BIT (1ULL << 62)
+#define INVALID_TOKEN UINT64_MAX
+#define CQ_EVENT_ACK_BATCH 64
+#define INLINE_THRESHOLD 64
+#define MAX_SGE 4
+#define CACHE_LINE_SIZE 64
 
 enum Opcode {
   RDMA_SEND,
   RDMA_WRITE,
   RDMA_READ,
+  RDMA_FETCH_ADD,
+  RDMA_CMP_SWAP,
+  RDMA_WRITE_IMM,
+  RDMA_SEND_IMM,
 };
 
+class SharedReceiveQueue;
+class Stats;
+class TCPConnector;
+
 enum QPState {
   RESET = -1,
   INIT,
@@ -20,60 +42,242 @@ enum QPState {
   RTS,
 };
 
+struct RDMAConfig {
+  /* tunables of a connection, 0 means derived from the other fields */
+  size_t buf_size = BUF_SIZE;                  /* size of the default buffer */
+  uint32_t max_send_wr = SEND_QUEUE_DEPTH;     /* send queue depth */
+  uint32_t max_recv_wr = RECV_QUEUE_DEPTH;     /* receive queue depth, or messages of srq held */
+  uint32_t cqe_num = 0;                        /* CQ size, max_send_wr + max_recv_wr by default */
+  uint32_t signal_interval = 1;                /* generate a CQE for every n-th send */
+  uint32_t poll_batch = 16;                    /* max CQEs reaped by one poll */
+  bool use_event = false;                      /* block on a completion channel when idle */
+  uint32_t busy_poll_us = 50;                  /* spin before blocking in event mode */
+  uint32_t max_inline_data = INLINE_THRESHOLD; /* SEND/WRITE up to this size go inline */
+  uint32_t max_send_sge = MAX_SGE;             /* SGEs per send, clamped to the device */
+  uint32_t max_recv_sge = MAX_SGE;             /* SGEs per receive, clamped to the device */
+  uint32_t max_rd_atomic = 0;                  /* READ/atomic depth, 0 : device limit */
+  CompletionQueue *cq = nullptr;               /* poll with other QPs on a shared CQ */
+  SharedReceiveQueue *srq = nullptr;           /* take receives from a shared queue */
+  bool stats = false;                          /* count ops, errors and latency, see Stats */
+  uint32_t path_mtu = 0;                       /* ibv_mtu override, 0 : min of both active MTUs */
+  std::string dev_name;                        /* device of Init(), SOFT_DEVICE runs in process */
+  bool shm = false;                            /* shared memory data path to a peer on the host */
+};
+
+struct SGE {
+  /* one entry of a scatter-gather list */
+  const MemoryRegion *mr;
+  size_t offset;
+  uint32_t length;
+};
+
+struct WorkRequest {
+  /* one operation of a batch, op, remote_offset and signaled are ignored by receives */
+  Opcode op;
+  const MemoryRegion *mr;
+  size_t offset;
+  uint32_t length;
+  uint64_t remote_offset;
+  bool signaled;              /* always generate a CQE regardless of signal_interval */
+  const SGE *sg_list;         /* gather/scatter list used instead of mr, offset and length */
+  int num_sge;                /* entries of sg_list, 0 to use mr, offset and length */
+  const RemoteRegion *remote; /* target of one-sided ops, the exchanged buffer when null */
+  uint64_t compare_add;       /* add value of FETCH_ADD, compare value of CMP_SWAP */
+  uint64_t swap;              /* swap value of CMP_SWAP */
+  uint32_t imm_data;          /* immediate of WRITE_IMM and SEND_IMM in host order */
+};
+
+struct Completion {
+  /* result of a posted work request, looked up by its token */
+  uint64_t token;
+  ibv_wc_status status;
+  uint32_t byte_len;
+  bool done;
+  bool has_imm;      /* receive carries an immediate from WRITE_IMM or SEND_IMM */
+  uint32_t imm_data; /* immediate in host order */
+  int op;            /* Opcode or STATS_RECV */
+  uint64_t post_ns;  /* time of posting, only with stats */
+};
+
+struct Message {
+  /* a message received by a channel, valid until it is released */
+  char *data;
+  uint32_t length;
+  uint32_t slot;
+};
+
 struct Connection {
   /* structure to exchange data which is needed to connect the QPs */
-  uint64_t addr;   /* Buffer address */
-  uint32_t rkey;   /* Remote key */
-  uint32_t qp_num; /* QP number */
-  uint16_t lid;    /* LID of the IB port */
-  uint8_t gid[16]; /* gid */
+  uint64_t addr;       /* Buffer address */
+  uint64_t length;     /* Buffer length */
+  uint32_t rkey;       /* Remote key */
+  uint32_t qp_num;     /* QP number */
+  uint16_t lid;        /* LID of the IB port */
+  uint8_t gid[16];     /* gid */
+  uint8_t mtu;         /* active MTU of the IB port */
+  uint8_t rd_atomic;   /* READ/atomic requests accepted as responder */
+  uint8_t host_id[16]; /* boot id of the host, zero when unknown */
+  uint32_t pid;        /* process owning the QP */
   Connection &operator=(const Connection &conn) {
     this->addr = conn.addr;
+    this->length = conn.length;
     this->rkey = conn.rkey;
     this->qp_num = conn.qp_num;
     this->lid = conn.lid;
     memcpy(this->gid, conn.gid, 16);
+    this->mtu = conn.mtu;
+    this->rd_atomic = conn.rd_atomic;
+    memcpy(this->host_id, conn.host_id, 16);
+    this->pid = conn.pid;
     return *this;
   }
 };
 
 class RDMA {
-  using WC = std::shared_ptr<ibv_wc>;
-
  public:
   RDMA() = default;
-  RDMA(uint32_t ib_port, uint32_t gid_idx) : ib_port_(ib_port), gid_idx_(gid_idx){};
+  RDMA(uint32_t ib_port, uint32_t gid_idx, const RDMAConfig &config = RDMAConfig())
+      : ib_port_(ib_port), gid_idx_(gid_idx), config_(config){};
   virtual ~RDMA();
 
   RDMA(const RDMA &) = delete;
   RDMA &operator=(const RDMA &) = delete;
 
+  // open the device, or share it with the instances which already did, RDMAConfig::dev_name
+  // is used when dev_name is empty
   bool Init(std::string dev_name = "");
+  // create the QP in a device shared with other instances, memory registered with the device
+  // or any of them can be used by this QP
+  bool Init(std::shared_ptr<Device> device);
   bool ModifyQP(QPState state);
+  // after RTS, move the data path to shared memory when RDMAConfig::shm is set on both sides,
+  // the peer runs on this host and its memory can be reached, see shm_transport.h. Both
+  // sides call it before anything is posted and agree over tcp, return false only when the
+  // exchange fails
+  bool ConnectSharedMemory(TCPConnector *tcp);
+  bool UsesSharedMemory() const { return shm_; }
+
+  // regions registered through an instance are deregistered with it, use the device for
+  // regions which outlive a single connection
+  // register a caller-owned buffer, the buffer must outlive the returned region
+  MemoryRegion *RegisterMemory(void *addr, size_t length, int access = BUF_ACCESS);
+  // allocate and register a buffer, huge page backed buffers fall back to normal pages
+  MemoryRegion *AllocMemory(size_t length, bool huge_page = false, int access = BUF_ACCESS);
+  bool DeregisterMemory(MemoryRegion *mr);
 
+  // string helpers copy through Buf(), Write/Read keep the NUL terminated layout of Buf()
   std::string Read();
-  bool Write(std::string msg);
-  bool Send(std::string msg);
+  bool Write(const std::string &msg);
+  bool Send(const std::string &msg);
   std::string Recv();
 
+  // zero-copy operations which post directly from and into registered memory
+  bool Read(const MemoryRegion *mr, size_t offset, uint32_t length, uint64_t remote_offset = 0);
+  bool Write(const MemoryRegion *mr, size_t offset, uint32_t length, uint64_t remote_offset = 0);
+  bool Send(const MemoryRegion *mr, size_t offset, uint32_t length);
+  // return the received length, or -1 on failure
+  int64_t Recv(const MemoryRegion *mr, size_t offset, uint32_t length);
+
+  // one-sided WRITE which also consumes a receive of the peer to notify it with imm_data
+  bool WriteWithImm(const MemoryRegion *mr, size_t offset, uint32_t length,
+                    uint64_t remote_offset, uint32_t imm_data);
+  bool SendWithImm(const MemoryRegion *mr, size_t offset, uint32_t length, uint32_t imm_data);
+  // wait for a WRITE_IMM notification with a zero length receive
+  bool RecvImm(uint32_t *imm_data);
+
+  // 8 byte atomics on an 8 byte aligned remote_offset, the original remote value lands in
+  // [offset, offset + 8) of mr and is also returned through old
+  bool FetchAdd(const MemoryRegion *mr, size_t offset, uint64_t remote_offset, uint64_t add,
+                uint64_t *old = nullptr, const RemoteRegion *remote = nullptr);
+  bool CompareSwap(const MemoryRegion *mr, size_t offset, uint64_t remote_offset,
+                   uint64_t compare, uint64_t swap, uint64_t *old = nullptr,
+                   const RemoteRegion *remote = nullptr);
+
   void SetRemoteInfo(const Connection &remote_info);
   Connection LocalInfo() const { return local_info_; };
+  RemoteRegion RemoteBuf() const {
+    return {.addr = remote_info_.addr, .length = remote_info_.length, .rkey = remote_info_.rkey};
+  }
   uint32_t IBPort() const { return ib_port_; }
   ibv_gid GID() const { return gid_; }
   uint32_t LocalKey() const { return lkey_; }
   uint32_t RemoteKey() const { return rkey_; }
   uint32_t Lid() const { return lid_; }
-  char *Buf() { return buf_; }
-  void PostRecv();
-  void PostSend(Opcode op);
+  // path MTU used by the QP, valid after SetRemoteInfo
+  ibv_mtu PathMTU() const { return path_mtu_; }
+  // outstanding READ/atomic requests as initiator and responder, valid after SetRemoteInfo
+  uint8_t MaxRdAtomic() const { return max_rd_atomic_; }
+  uint8_t MaxDestRdAtomic() const { return max_dest_rd_atomic_; }
+  char *Buf() { return buf_->addr; }
+  MemoryRegion *BufMR() { return buf_; }
+  const RDMAConfig &Config() const { return config_; }
+  const std::shared_ptr<Device> &SharedDevice() const { return device_; }
+  // counters of this connection, nullptr unless RDMAConfig::stats
+  const Stats *GetStats() const { return stats_; }
+
+  // messages received from the shared receive queue, hand them back with
+  // SharedReceiveQueue::Release. The CQ and the queue of arrived messages are sized for
+  // max_recv_wr, so the peer must not have more messages in flight to this QP
+  bool TryRecvShared(Message *msg);
+  bool RecvShared(Message *msg);
+
+  // post without waiting, return a token for IsDone/Wait or INVALID_TOKEN if the queue is full
+  uint64_t PostRecv();
+  uint64_t PostSend(Opcode op);
+  // post to [offset, offset + length) of a registered region, one-sided ops target
+  // remote_offset of the remote buffer
+  uint64_t PostRecv(const MemoryRegion *mr, size_t offset, uint32_t length);
+  uint64_t PostSend(Opcode op, const MemoryRegion *mr, size_t offset, uint32_t length,
+                    uint64_t remote_offset = 0, bool signaled = false);
+  // post one work request spanning several registered regions, up to max_send_sge or
+  // max_recv_sge entries
+  uint64_t PostRecv(const SGE *sges, int num_sge);
+  uint64_t PostSend(Opcode op, const SGE *sges, int num_sge, uint64_t remote_offset = 0,
+                    bool signaled = false);
+  // post a batch as one chained work request list, return the number posted and fill
+  // tokens when it is not null
+  int PostRecv(const WorkRequest *reqs, int num, uint64_t *tokens = nullptr);
+  int PostSend(const WorkRequest *reqs, int num, uint64_t *tokens = nullptr);
+  // pre-post num receives of slot_size bytes laid out back to back from offset
+  int PostRecvRing(const MemoryRegion *mr, size_t offset, uint32_t slot_size, int num,
+                   uint64_t *tokens = nullptr);
+  // reap up to poll_batch completions without blocking, return the number reaped
+  int PollCQ();
+  // reap up to num completions into wcs and dispatch them to their tokens
+  int PollCQ(ibv_wc *wcs, int num);
+  bool IsDone(uint64_t token) const;
+  // block until the token completes, return whether it succeeded, false as well when its
+  // slot was already reused by a newer token, comp then gets IBV_WC_GENERAL_ERR
+  bool Wait(uint64_t token, Completion *comp = nullptr);
+  // busy poll for busy_poll_us, then block on the completion channel in event mode, return
+  // the number of completions reaped or 0 on timeout
+  int WaitCQ(int timeout_ms = -1);
+  // fd of the completion channel for epoll, -1 unless use_event
+  int CompletionFD() const { return channel_ != nullptr ? channel_->fd : -1; }
+  // consume a channel event when CompletionFD is readable, rearm and drain the CQ
+  int HandleCQEvent();
+  uint32_t SendQueueFree() const { return config_.max_send_wr - (send_seq_ - send_done_); }
+  uint32_t RecvQueueFree() const { return config_.max_recv_wr - (recv_seq_ - recv_done_); }
 
  private:
-  WC PollCQ();
+  friend class CompletionQueue;
+  const Completion *Slot(uint64_t token) const;
+  void HandleWC(const ibv_wc &wc);
+  void HandleSRQWC(const ibv_wc &wc);
+  // async events of the QP, dispatched by Device::HandleAsyncEvents
+  static bool OnAsyncEvent(void *arg, const ibv_async_event &event);
+  bool WaitOp(const char *op, uint64_t token, Completion *comp);
+  bool PostSignal();
+  std::shared_ptr<Device> device_;
   ibv_context *dev_ctx_ = nullptr;
   ibv_pd *pd_ = nullptr;
-  ibv_mr *mr_ = nullptr;
+  // every post and poll goes through the transport, qp_ and cq_ are only set on a device
+  std::unique_ptr<Transport> transport_;
   ibv_qp *qp_ = nullptr;
   ibv_cq *cq_ = nullptr;
+  ibv_comp_channel *channel_ = nullptr;
+  bool shm_ = false;
+  uint32_t unacked_events_ = 0;
 
   uint32_t ib_port_ = 1;
   uint32_t gid_idx_ = 0;
@@ -81,9 +285,36 @@ class RDMA {
   uint32_t rkey_;
   uint16_t lid_;
   ibv_gid gid_;
-  char buf_[BUF_SIZE];
+  ibv_mtu active_mtu_ = IBV_MTU_256;
+  ibv_mtu path_mtu_ = IBV_MTU_256;
+  uint8_t max_init_rd_atomic_ = 1;
+  uint8_t max_rd_atomic_ = 1;
+  uint8_t max_dest_rd_atomic_ = 1;
+  RDMAConfig config_;
+  Stats *stats_ = nullptr;
+  MemoryRegion *buf_ = nullptr;
+  std::vector<MemoryRegion *> mrs_;
   Connection local_info_;
   Connection remote_info_;
 
-  uint64_t request_id_ = 0;
+  // tokens are sequence numbers per queue, a queue completes in order so the slot of an
+  // outstanding token is never reused before it completes. A CQE of a signaled send
+  // also completes the unsignaled sends before it.
+  uint64_t send_seq_ = 0;
+  uint64_t send_signaled_ = 0;
+  uint64_t send_done_ = 0;
+  uint64_t recv_seq_ = 0;
+  uint64_t recv_done_ = 0;
+  std::vector<Completion> send_slots_;
+  std::vector<Completion> recv_slots_;
+  // preallocated work requests so that posting does not allocate
+  std::vector<ibv_send_wr> send_wrs_;
+  std::vector<ibv_sge> send_sges_;
+  std::vector<ibv_recv_wr> recv_wrs_;
+  std::vector<ibv_sge> recv_sges_;
+  std::vector<WorkRequest> recv_ring_reqs_;
+  std::vector<ibv_wc> wcs_;
+  std::vector<Message> srq_ready_;
+  uint64_t srq_ready_head_ = 0;
+  uint64_t srq_ready_tail_ = 0;
 };
\ No newline at end of file
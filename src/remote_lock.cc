@@ -0,0 +1,87 @@
+#include "remote_lock.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cassert>
+#include <thread>
+
+#define LOCK_BACKOFF_MAX_SPIN 1024
+
+static inline void CPURelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  std::this_thread::yield();
+#endif
+}
+
+RemoteLock::RemoteLock(RDMA *rdma, const MemoryRegion *scratch, size_t scratch_offset,
+                       uint64_t remote_offset, uint64_t owner_id, const RemoteRegion *remote)
+    : rdma_(rdma),
+      scratch_(scratch),
+      scratch_offset_(scratch_offset),
+      remote_offset_(remote_offset),
+      owner_id_(owner_id),
+      remote_(remote) {
+  assert(owner_id != 0);
+}
+
+bool RemoteLock::TryLock() {
+  uint64_t old;
+  if (!rdma_->CompareSwap(scratch_, scratch_offset_, remote_offset_, 0, owner_id_, &old,
+                          remote_)) {
+    failed_ = true;
+    return false;
+  }
+  if (old != 0) {
+    retries_++;
+    return false;
+  }
+  return true;
+}
+
+bool RemoteLock::Lock() {
+  int spin = 1;
+  failed_ = false;
+  while (!TryLock()) {
+    if (failed_) {
+      LOG(ERROR) << "fail to lock remote word " << remote_offset_;
+      return false;
+    }
+    // back off so contending clients do not saturate the responder with atomics
+    for (int i = 0; i < spin; i++) {
+      CPURelax();
+    }
+    spin = std::min(spin * 2, LOCK_BACKOFF_MAX_SPIN);
+  }
+  return true;
+}
+
+bool RemoteLock::Unlock() {
+  // release with an atomic rather than a WRITE, as WRITEs are not atomic against atomics
+  uint64_t old;
+  if (!rdma_->CompareSwap(scratch_, scratch_offset_, remote_offset_, owner_id_, 0, &old,
+                          remote_)) {
+    return false;
+  }
+  if (old != owner_id_) {
+    LOG(ERROR) << "unlock remote word " << remote_offset_ << " owned by " << old;
+    return false;
+  }
+  return true;
+}
+
+RemoteCounter::RemoteCounter(RDMA *rdma, const MemoryRegion *scratch, size_t scratch_offset,
+                             uint64_t remote_offset, const RemoteRegion *remote)
+    : rdma_(rdma),
+      scratch_(scratch),
+      scratch_offset_(scratch_offset),
+      remote_offset_(remote_offset),
+      remote_(remote) {}
+
+bool RemoteCounter::Next(uint64_t *ticket, uint64_t n) {
+  return rdma_->FetchAdd(scratch_, scratch_offset_, remote_offset_, n, ticket, remote_);
+}
+
+bool RemoteCounter::Load(uint64_t *value) {
+  return rdma_->FetchAdd(scratch_, scratch_offset_, remote_offset_, 0, value, remote_);
+}
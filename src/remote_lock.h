@@ -0,0 +1,53 @@
+#pragma once
+#include "rdma.h"
+
+// spin lock on an 8 byte word of remote memory, built on RDMA compare-and-swap so the
+// remote CPU is not involved. The word holds 0 when unlocked and the owner id otherwise.
+class RemoteLock {
+ public:
+  // scratch is an 8 byte aligned slot of a local registered region which receives the
+  // results of the atomics, remote is null for the exchanged buffer of rdma
+  RemoteLock(RDMA *rdma, const MemoryRegion *scratch, size_t scratch_offset,
+             uint64_t remote_offset, uint64_t owner_id, const RemoteRegion *remote = nullptr);
+
+  RemoteLock(const RemoteLock &) = delete;
+  RemoteLock &operator=(const RemoteLock &) = delete;
+
+  bool TryLock();
+  // spin with exponential backoff until the lock is taken, false on RDMA failure
+  bool Lock();
+  bool Unlock();
+  // failed compare-and-swap attempts since construction
+  uint64_t Retries() const { return retries_; }
+
+ private:
+  RDMA *rdma_;
+  const MemoryRegion *scratch_;
+  size_t scratch_offset_;
+  uint64_t remote_offset_;
+  uint64_t owner_id_;
+  const RemoteRegion *remote_;
+  bool failed_ = false;
+  uint64_t retries_ = 0;
+};
+
+// shared sequence counter on an 8 byte word of remote memory, built on RDMA fetch-and-add
+class RemoteCounter {
+ public:
+  RemoteCounter(RDMA *rdma, const MemoryRegion *scratch, size_t scratch_offset,
+                uint64_t remote_offset, const RemoteRegion *remote = nullptr);
+
+  RemoteCounter(const RemoteCounter &) = delete;
+  RemoteCounter &operator=(const RemoteCounter &) = delete;
+
+  // take n tickets and return the first one, false on RDMA failure
+  bool Next(uint64_t *ticket, uint64_t n = 1);
+  bool Load(uint64_t *value);
+
+ private:
+  RDMA *rdma_;
+  const MemoryRegion *scratch_;
+  size_t scratch_offset_;
+  uint64_t remote_offset_;
+  const RemoteRegion *remote_;
+};
@@ -0,0 +1,139 @@
+#include "ring_channel.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+
+RingChannel::RingChannel(RDMA *rdma, uint32_t slots, uint32_t slot_size)
+    : rdma_(rdma), slots_(slots), slot_size_(slot_size) {
+  assert(slots > 0);
+  assert(slot_size > sizeof(RingTrailer) && slot_size % sizeof(uint64_t) == 0);
+  publish_interval_ = std::max(slots / 4, 1u);
+}
+
+RingChannel::~RingChannel() {
+  if (mr_ != nullptr) {
+    rdma_->DeregisterMemory(mr_);
+    mr_ = nullptr;
+  }
+}
+
+bool RingChannel::Init() {
+  head_offset_ = (size_t)slots_ * slot_size_;
+  trailer_offset_ = head_offset_ + sizeof(uint64_t);
+  publish_offset_ = trailer_offset_ + slots_ * sizeof(RingTrailer);
+  mr_ = rdma_->AllocMemory(publish_offset_ + slots_ * sizeof(uint64_t));
+  return mr_ != nullptr;
+}
+
+RingDescriptor RingChannel::LocalDescriptor() const {
+  return {.ring_addr = (uint64_t)mr_->addr,
+          .ring_rkey = mr_->rkey,
+          .slots = slots_,
+          .slot_size = slot_size_,
+          .head_rkey = mr_->rkey,
+          .head_addr = (uint64_t)mr_->addr + head_offset_};
+}
+
+void RingChannel::SetRemoteDescriptor(const RingDescriptor &desc) {
+  assert(desc.slots <= slots_);
+  remote_slots_ = desc.slots;
+  remote_slot_size_ = desc.slot_size;
+  remote_ring_ = {.addr = desc.ring_addr,
+                  .length = (uint64_t)desc.slots * desc.slot_size,
+                  .rkey = desc.ring_rkey};
+  remote_head_ = {.addr = desc.head_addr, .length = sizeof(uint64_t), .rkey = desc.head_rkey};
+  LOG(INFO) << "REMOTE ring : " << desc.slots << " x " << desc.slot_size;
+}
+
+bool RingChannel::Send(const MemoryRegion *mr, size_t offset, uint32_t length) {
+  assert(length <= remote_slot_size_ - sizeof(RingTrailer));
+  // the peer writes its consumed count into our head word
+  volatile uint64_t *remote_head = (volatile uint64_t *)(mr_->addr + head_offset_);
+  while (tail_ - *remote_head >= remote_slots_ || rdma_->SendQueueFree() == 0) {
+    rdma_->PollCQ();
+  }
+
+  // a trailer is reused slots_ messages later, by then the peer has consumed the message
+  // which used it as the peer ring is not larger than ours
+  uint32_t slot = tail_ % remote_slots_;
+  size_t trailer_offset = trailer_offset_ + (tail_ % slots_) * sizeof(RingTrailer);
+  RingTrailer *trailer = (RingTrailer *)(mr_->addr + trailer_offset);
+  trailer->length = length;
+  trailer->seq = (uint32_t)(tail_ + 1);
+
+  // place the payload right before the trailer so one WRITE fills both
+  SGE sges[2] = {
+      {.mr = mr, .offset = offset, .length = length},
+      {.mr = mr_, .offset = trailer_offset, .length = sizeof(RingTrailer)},
+  };
+  uint64_t slot_end = (uint64_t)(slot + 1) * remote_slot_size_;
+  WorkRequest req = {.op = RDMA_WRITE,
+                     .remote_offset = slot_end - sizeof(RingTrailer) - length,
+                     .sg_list = sges,
+                     .num_sge = length > 0 ? 2 : 1,
+                     .remote = &remote_ring_};
+  if (length == 0) {
+    sges[0] = sges[1];
+  }
+  if (rdma_->PostSend(&req, 1) != 1) {
+    LOG(ERROR) << "fail to write ring slot " << slot;
+    return false;
+  }
+  tail_++;
+  return true;
+}
+
+bool RingChannel::TryRecv(Message *msg) {
+  uint32_t slot = received_ % slots_;
+  char *slot_end = mr_->addr + (size_t)(slot + 1) * slot_size_;
+  volatile RingTrailer *trailer = (volatile RingTrailer *)(slot_end - sizeof(RingTrailer));
+  if (trailer->seq != (uint32_t)(received_ + 1)) {
+    return false;
+  }
+  // the trailer is written last, do not read the payload ahead of it
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint32_t length = trailer->length;
+  msg->data = slot_end - sizeof(RingTrailer) - length;
+  msg->length = length;
+  msg->slot = slot;
+  received_++;
+  return true;
+}
+
+bool RingChannel::Recv(Message *msg) {
+  while (!TryRecv(msg)) {
+  }
+  return true;
+}
+
+bool RingChannel::Release(const Message &msg) {
+  assert(msg.slot == head_ % slots_ && head_ < received_);
+  head_++;
+  if (head_ - published_ >= publish_interval_) {
+    return PublishHead();
+  }
+  return true;
+}
+
+bool RingChannel::PublishHead() {
+  while (rdma_->SendQueueFree() == 0) {
+    rdma_->PollCQ();
+  }
+  // each publication has its own source word, so an in-flight WRITE is never modified
+  size_t offset = publish_offset_ + (head_ % slots_) * sizeof(uint64_t);
+  memcpy(mr_->addr + offset, &head_, sizeof(head_));
+  WorkRequest req = {.op = RDMA_WRITE,
+                     .mr = mr_,
+                     .offset = offset,
+                     .length = sizeof(uint64_t),
+                     .remote_offset = 0,
+                     .remote = &remote_head_};
+  if (rdma_->PostSend(&req, 1) != 1) {
+    LOG(ERROR) << "fail to publish ring head " << head_;
+    return false;
+  }
+  published_ = head_;
+  return true;
+}
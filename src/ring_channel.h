@@ -0,0 +1,70 @@
+#pragma once
+#include <vector>
+#include "rdma.h"
+
+struct RingDescriptor {
+  /* structure to exchange data which is needed to write into the ring of the peer */
+  uint64_t ring_addr; /* receive ring */
+  uint32_t ring_rkey;
+  uint32_t slots;     /* number of slots in the ring */
+  uint32_t slot_size; /* bytes per slot, including the trailer */
+  uint32_t head_rkey;
+  uint64_t head_addr; /* word which receives the consumed count of the peer */
+};
+
+struct RingTrailer {
+  /* last 8 bytes of a slot, the payload ends right before it */
+  uint32_t length;
+  uint32_t seq; /* 1 + index of the message, so a stale slot never matches */
+};
+
+// Message queue on one-sided RDMA WRITE. A sender writes payload and trailer into the next
+// slot of the ring in the receiver's memory with one WRITE, and the receiver polls the
+// trailer in memory instead of a CQ. The receiver writes how many messages it has consumed
+// back into the sender's head word, which keeps the sender from overwriting unread slots.
+// Each side owns one receive ring, so the channel works in both directions.
+class RingChannel {
+ public:
+  RingChannel(RDMA *rdma, uint32_t slots, uint32_t slot_size);
+  ~RingChannel();
+
+  RingChannel(const RingChannel &) = delete;
+  RingChannel &operator=(const RingChannel &) = delete;
+
+  bool Init();
+  RingDescriptor LocalDescriptor() const;
+  void SetRemoteDescriptor(const RingDescriptor &desc);
+
+  uint32_t MaxMessageSize() const { return slot_size_ - sizeof(RingTrailer); }
+  // gather the payload from registered memory with the trailer, no copy is made. Block while
+  // the ring of the peer is full, the payload must stay untouched until the peer reads it.
+  bool Send(const MemoryRegion *mr, size_t offset, uint32_t length);
+  // poll memory for the next message
+  bool TryRecv(Message *msg);
+  bool Recv(Message *msg);
+  // consume the oldest received message, messages are released in order
+  bool Release(const Message &msg);
+
+ private:
+  bool PublishHead();
+
+  RDMA *rdma_;
+  uint32_t slots_;
+  uint32_t slot_size_;
+  uint32_t publish_interval_;
+  // [ring][head word][trailers to send][head values to publish]
+  MemoryRegion *mr_ = nullptr;
+  size_t head_offset_;
+  size_t trailer_offset_;
+  size_t publish_offset_;
+
+  RemoteRegion remote_ring_;
+  RemoteRegion remote_head_;
+  uint32_t remote_slots_ = 0;
+  uint32_t remote_slot_size_ = 0;
+
+  uint64_t tail_ = 0;       // messages sent
+  uint64_t head_ = 0;       // messages released
+  uint64_t received_ = 0;   // messages handed out by Recv
+  uint64_t published_ = 0;  // last head written to the peer
+};
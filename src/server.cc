@@ -2,27 +2,38 @@
 #include <glog/logging.h>
 #include <cassert>
 
-Server::Server(std::string ip_port, uint32_t ib_port, uint32_t gid_idx) : RDMA(ib_port, gid_idx) {
+Server::Server(std::string ip_port, uint32_t ib_port, uint32_t gid_idx, const RDMAConfig &config)
+    : RDMA(ib_port, gid_idx, config) {
   conn_ = new TCPConnector(ip_port);
 }
 
 bool Server::Connect() {
-  bool rt = conn_->Connect();
-  assert(rt);
-  rt = Init();
-  assert(rt);
+  if (!conn_->Connect()) {
+    LOG(ERROR) << "server : fail to connect TCP";
+    return false;
+  }
+  if (!Init()) {
+    return false;
+  }
   Connection linfo = LocalInfo();
   Connection rinfo;
   int recv = conn_->ExchangeData((char *)&linfo, sizeof(linfo), (char *)&rinfo, sizeof(rinfo));
+  if (recv != sizeof(rinfo)) {
+    LOG(ERROR) << "server : fail to exchange connection info";
+    return false;
+  }
   SetRemoteInfo(rinfo);
-  rt = ModifyQP(INIT);
-  assert(rt);
+  if (!ModifyQP(INIT)) {
+    return false;
+  }
   LOG(INFO) << "server : modify to INIT ";
-  rt = ModifyQP(RTR);
-  assert(rt);
+  if (!ModifyQP(RTR)) {
+    return false;
+  }
   LOG(INFO) << "server : modify to RTR ";
-  rt = ModifyQP(RTS);
-  assert(rt);
+  if (!ModifyQP(RTS)) {
+    return false;
+  }
   LOG(INFO) << "server : modify to RTS ";
-  return rt;
-}
+  return ConnectSharedMemory(conn_);
+}
\ No newline at end of file
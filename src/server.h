@@ -1,13 +1,18 @@
+#pragma once
 #include "rdma.h"
 #include "tcp_connection.h"
 
 class Server : public RDMA {
  public:
-  Server(std::string ip_port, uint32_t ib_port, uint32_t gid_idx);
+  Server(std::string ip_port, uint32_t ib_port, uint32_t gid_idx,
+         const RDMAConfig &config = RDMAConfig());
 
   bool Connect();
 
   bool Sync() { return conn_->Sync(); }
+  int ExchangeData(const char *send_buf, int send_size, char *recv_buf, int recv_size) {
+    return conn_->ExchangeData(send_buf, send_size, recv_buf, recv_size);
+  }
 
  private:
   TCPConnector *conn_;
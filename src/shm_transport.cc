@@ -0,0 +1,692 @@
+#include "shm_transport.h"
+#include <glog/logging.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+static uint64_t AlignRecord(uint64_t length) {
+  return (length + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+// copy length bytes at offset of the data described by a gather list into dst
+static void CopyFromSGE(const std::vector<ibv_sge> &sges, uint32_t offset, char *dst,
+                        uint32_t length) {
+  for (const ibv_sge &sge : sges) {
+    if (length == 0) {
+      break;
+    }
+    if (offset >= sge.length) {
+      offset -= sge.length;
+      continue;
+    }
+    uint32_t bytes = std::min(sge.length - offset, length);
+    memcpy(dst, (char *)sge.addr + offset, bytes);
+    dst += bytes;
+    length -= bytes;
+    offset = 0;
+  }
+}
+
+// copy length bytes of src to offset of the data described by a scatter list
+static void CopyToSGE(const std::vector<ibv_sge> &sges, uint32_t offset, const char *src,
+                      uint32_t length) {
+  for (const ibv_sge &sge : sges) {
+    if (length == 0) {
+      break;
+    }
+    if (offset >= sge.length) {
+      offset -= sge.length;
+      continue;
+    }
+    uint32_t bytes = std::min(sge.length - offset, length);
+    memcpy((char *)sge.addr + offset, src, bytes);
+    src += bytes;
+    length -= bytes;
+    offset = 0;
+  }
+}
+
+// open the file fd of process pid, which must let this process open it
+static int OpenPeerFD(uint32_t pid, int fd) {
+  std::string path = "/proc/" + std::to_string(pid) + "/fd/" + std::to_string(fd);
+  int local_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (local_fd < 0) {
+    LOG(WARNING) << "fail to open " << path << " : " << strerror(errno);
+  }
+  return local_fd;
+}
+
+bool HostID(uint8_t id[16]) {
+  memset(id, 0, 16);
+  FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (file == nullptr) {
+    return false;
+  }
+  char text[64];
+  bool ok = fgets(text, sizeof(text), file) != nullptr;
+  fclose(file);
+  int digits = 0;
+  for (const char *c = text; ok && *c != '\0' && digits < 32; c++) {
+    if (!isxdigit(*c)) {
+      continue;
+    }
+    int value = isdigit(*c) ? *c - '0' : tolower(*c) - 'a' + 10;
+    id[digits / 2] |= value << (digits % 2 == 0 ? 4 : 0);
+    digits++;
+  }
+  return ok && digits == 32;
+}
+
+ShmRing::~ShmRing() {
+  if (header_ != nullptr) {
+    munmap(header_, sizeof(Header) + capacity_);
+    header_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+std::unique_ptr<ShmRing> ShmRing::Create(uint64_t capacity) {
+  assert(capacity % CACHE_LINE_SIZE == 0 && (capacity & (capacity - 1)) == 0);
+  int fd = memfd_create("rdma_shm_ring", MFD_CLOEXEC);
+  if (fd < 0) {
+    LOG(ERROR) << "fail to create memfd : " << strerror(errno);
+    return nullptr;
+  }
+  std::unique_ptr<ShmRing> ring(new ShmRing());
+  ring->fd_ = fd;
+  if (ftruncate(fd, sizeof(Header) + capacity) != 0) {
+    LOG(ERROR) << "fail to size memfd to " << capacity << " bytes : " << strerror(errno);
+    return nullptr;
+  }
+  ring->capacity_ = capacity;
+  if (!ring->Map(fd)) {
+    return nullptr;
+  }
+  // the key tells the producer that it mapped this ring and not a reused fd number
+  std::random_device random;
+  ring->header_->key = (uint64_t)random() << 32 | random();
+  ring->header_->capacity = capacity;
+  ring->header_->magic = SHM_RING_MAGIC;
+  return ring;
+}
+
+std::unique_ptr<ShmRing> ShmRing::Open(uint32_t pid, int fd, uint64_t key) {
+  int local_fd = OpenPeerFD(pid, fd);
+  if (local_fd < 0) {
+    return nullptr;
+  }
+  std::unique_ptr<ShmRing> ring(new ShmRing());
+  ring->fd_ = local_fd;
+  struct stat st;
+  if (fstat(local_fd, &st) != 0 || (uint64_t)st.st_size <= sizeof(Header)) {
+    LOG(WARNING) << "fd " << fd << " of process " << pid << " is not a shared memory ring";
+    return nullptr;
+  }
+  ring->capacity_ = st.st_size - sizeof(Header);
+  if (!ring->Map(local_fd)) {
+    return nullptr;
+  }
+  const Header *header = ring->header_;
+  if (header->magic != SHM_RING_MAGIC || header->key != key ||
+      header->capacity != ring->capacity_) {
+    LOG(WARNING) << "fd " << fd << " of process " << pid << " is not the ring of the peer";
+    return nullptr;
+  }
+  return ring;
+}
+
+bool ShmRing::Map(int fd) {
+  void *addr =
+      mmap(nullptr, sizeof(Header) + capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "fail to map shared memory ring : " << strerror(errno);
+    return false;
+  }
+  header_ = (Header *)addr;
+  data_ = (char *)addr + sizeof(Header);
+  return true;
+}
+
+ShmRecord *ShmRing::Reserve(uint32_t length) {
+  uint64_t size = AlignRecord(sizeof(ShmRecord) + length);
+  uint64_t offset = pos_ & (capacity_ - 1);
+  // a record which does not fit before the end starts over at the beginning
+  uint64_t pad = size > capacity_ - offset ? capacity_ - offset : 0;
+  if (pos_ + pad + size - cached_ > capacity_) {
+    cached_ = header_->tail.load(std::memory_order_acquire);
+    if (pos_ + pad + size - cached_ > capacity_) {
+      return nullptr;
+    }
+  }
+  if (pad > 0) {
+    ShmRecord *record = (ShmRecord *)(data_ + offset);
+    record->length = 0;
+    record->type = SHM_PAD;
+    pos_ += pad;
+  }
+  reserved_ = pos_ + size;
+  ShmRecord *record = (ShmRecord *)(data_ + (pos_ & (capacity_ - 1)));
+  record->length = length;
+  return record;
+}
+
+void ShmRing::Commit() {
+  pos_ = reserved_;
+  header_->head.store(pos_, std::memory_order_release);
+}
+
+const ShmRecord *ShmRing::Front() {
+  for (;;) {
+    if (pos_ == cached_) {
+      cached_ = header_->head.load(std::memory_order_acquire);
+      if (pos_ == cached_) {
+        return nullptr;
+      }
+    }
+    uint64_t offset = pos_ & (capacity_ - 1);
+    const ShmRecord *record = (const ShmRecord *)(data_ + offset);
+    if (record->type != SHM_PAD) {
+      return record;
+    }
+    pos_ += capacity_ - offset;
+    header_->tail.store(pos_, std::memory_order_release);
+  }
+}
+
+void ShmRing::Pop() {
+  const ShmRecord *record = (const ShmRecord *)(data_ + (pos_ & (capacity_ - 1)));
+  pos_ += AlignRecord(sizeof(ShmRecord) + record->length);
+  header_->tail.store(pos_, std::memory_order_release);
+}
+
+void ShmRing::PopFailed() {
+  const ShmRecord *record = (const ShmRecord *)(data_ + (pos_ & (capacity_ - 1)));
+  // published before the tail, so a producer which sees the message released sees it failed
+  header_->fail_pos.store(pos_ + AlignRecord(sizeof(ShmRecord) + record->length),
+                          std::memory_order_release);
+  Pop();
+}
+
+ShmKeyTable::~ShmKeyTable() {
+  if (header_ != nullptr) {
+    munmap(header_, sizeof(Header) + num_slots_ * sizeof(Slot));
+    header_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+std::unique_ptr<ShmKeyTable> ShmKeyTable::Create() {
+  int fd = memfd_create("rdma_shm_keys", MFD_CLOEXEC);
+  if (fd < 0) {
+    LOG(ERROR) << "fail to create memfd : " << strerror(errno);
+    return nullptr;
+  }
+  std::unique_ptr<ShmKeyTable> table(new ShmKeyTable());
+  table->fd_ = fd;
+  // the memfd starts out zeroed, which leaves every slot empty
+  if (ftruncate(fd, sizeof(Header) + SHM_KEY_SLOTS * sizeof(Slot)) != 0) {
+    LOG(ERROR) << "fail to size memfd of the key table : " << strerror(errno);
+    return nullptr;
+  }
+  if (!table->Map(fd, SHM_KEY_SLOTS)) {
+    return nullptr;
+  }
+  std::random_device random;
+  table->header_->key = (uint64_t)random() << 32 | random();
+  table->header_->slots = SHM_KEY_SLOTS;
+  table->header_->magic = SHM_KEYS_MAGIC;
+  return table;
+}
+
+std::unique_ptr<ShmKeyTable> ShmKeyTable::Open(uint32_t pid, int fd, uint64_t key) {
+  int local_fd = OpenPeerFD(pid, fd);
+  if (local_fd < 0) {
+    return nullptr;
+  }
+  std::unique_ptr<ShmKeyTable> table(new ShmKeyTable());
+  table->fd_ = local_fd;
+  struct stat st;
+  if (fstat(local_fd, &st) != 0 || (uint64_t)st.st_size <= sizeof(Header) ||
+      (st.st_size - sizeof(Header)) % sizeof(Slot) != 0) {
+    LOG(WARNING) << "fd " << fd << " of process " << pid << " is not a key table";
+    return nullptr;
+  }
+  uint64_t slots = (st.st_size - sizeof(Header)) / sizeof(Slot);
+  if (!table->Map(local_fd, slots)) {
+    return nullptr;
+  }
+  const Header *header = table->header_;
+  if (header->magic != SHM_KEYS_MAGIC || header->key != key || header->slots != slots) {
+    LOG(WARNING) << "fd " << fd << " of process " << pid << " is not the key table of the peer";
+    return nullptr;
+  }
+  return table;
+}
+
+bool ShmKeyTable::Map(int fd, uint64_t slots) {
+  size_t size = sizeof(Header) + slots * sizeof(Slot);
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "fail to map key table : " << strerror(errno);
+    return false;
+  }
+  header_ = (Header *)addr;
+  slots_ = (Slot *)((char *)addr + sizeof(Header));
+  num_slots_ = slots;
+  return true;
+}
+
+void ShmKeyTable::Write(Slot *slot, const Entry &entry) {
+  uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->state.store(entry.state, std::memory_order_relaxed);
+  slot->rkey.store(entry.rkey, std::memory_order_relaxed);
+  slot->access.store(entry.access, std::memory_order_relaxed);
+  slot->addr.store(entry.addr, std::memory_order_relaxed);
+  slot->length.store(entry.length, std::memory_order_relaxed);
+  slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+ShmKeyTable::Entry ShmKeyTable::Read(const Slot &slot) const {
+  Entry entry;
+  uint32_t seq;
+  do {
+    seq = slot.seq.load(std::memory_order_acquire);
+    entry.state = slot.state.load(std::memory_order_relaxed);
+    entry.rkey = slot.rkey.load(std::memory_order_relaxed);
+    entry.access = slot.access.load(std::memory_order_relaxed);
+    entry.addr = slot.addr.load(std::memory_order_relaxed);
+    entry.length = slot.length.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) != 0 || slot.seq.load(std::memory_order_relaxed) != seq);
+  return entry;
+}
+
+bool ShmKeyTable::Add(uint32_t rkey, uint64_t addr, uint64_t length, int access) {
+  for (uint64_t i = 0; i < num_slots_; i++) {
+    Slot *slot = &slots_[(rkey + i) % num_slots_];
+    // only this process writes, so it reads its slots without the sequence
+    if (slot->state.load(std::memory_order_relaxed) != SLOT_USED) {
+      Write(slot, {.state = SLOT_USED, .rkey = rkey, .access = access, .addr = addr,
+                   .length = length});
+      return true;
+    }
+  }
+  return false;
+}
+
+void ShmKeyTable::Remove(uint32_t rkey) {
+  for (uint64_t i = 0; i < num_slots_; i++) {
+    Slot *slot = &slots_[(rkey + i) % num_slots_];
+    uint32_t state = slot->state.load(std::memory_order_relaxed);
+    if (state == SLOT_EMPTY) {
+      return;
+    }
+    if (state == SLOT_USED && slot->rkey.load(std::memory_order_relaxed) == rkey) {
+      // later keys of the probe sequence are still found past the removed slot
+      Write(slot, {.state = SLOT_REMOVED});
+      return;
+    }
+  }
+}
+
+bool ShmKeyTable::Check(uint32_t rkey, uint64_t addr, uint64_t length, int access) const {
+  for (uint64_t i = 0; i < num_slots_; i++) {
+    Entry entry = Read(slots_[(rkey + i) % num_slots_]);
+    if (entry.state == SLOT_EMPTY) {
+      return false;
+    }
+    if (entry.state == SLOT_USED && entry.rkey == rkey) {
+      return addr >= entry.addr && addr + length <= entry.addr + entry.length &&
+             (entry.access & access) == access;
+    }
+  }
+  return false;
+}
+
+ShmTransport::ShmTransport(std::unique_ptr<Transport> nic, std::unique_ptr<ShmRing> recv_ring,
+                           std::unique_ptr<ShmRing> send_ring,
+                           std::unique_ptr<ShmKeyTable> peer_keys, uint32_t peer_pid,
+                           const ibv_qp_cap &cap)
+    : nic_(std::move(nic)),
+      recv_ring_(std::move(recv_ring)),
+      send_ring_(std::move(send_ring)),
+      peer_keys_(std::move(peer_keys)),
+      peer_pid_(peer_pid),
+      cap_(cap),
+      sq_(cap.max_send_wr),
+      rq_(cap.max_recv_wr) {}
+
+bool ShmTransport::CanAccess(uint32_t pid, uint64_t addr) {
+  char byte;
+  iovec local = {.iov_base = &byte, .iov_len = 1};
+  iovec remote = {.iov_base = (void *)addr, .iov_len = 1};
+  return process_vm_readv(pid, &local, 1, &remote, 1, 0) == 1;
+}
+
+int ShmTransport::PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) {
+  int rc = 0;
+  for (; wr != nullptr; wr = wr->next) {
+    if (wr->num_sge < 0 || (uint32_t)wr->num_sge > cap_.max_send_sge) {
+      rc = EINVAL;
+    } else if (sq_tail_ - sq_head_ >= sq_.size()) {
+      rc = ENOMEM;
+    }
+    if (rc != 0) {
+      *bad_wr = wr;
+      break;
+    }
+    SendWR &send = sq_[sq_tail_ % sq_.size()];
+    send.wr = *wr;
+    send.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    send.length = 0;
+    for (const ibv_sge &sge : send.sges) {
+      send.length += sge.length;
+    }
+    if (wr->send_flags & IBV_SEND_INLINE) {
+      // the buffer of an inline request may be reused as soon as it is posted
+      send.inline_data.resize(send.length);
+      CopyFromSGE(send.sges, 0, send.inline_data.data(), send.length);
+    }
+    send.sent = 0;
+    send.end = 0;
+    send.written = false;
+    send.done = false;
+    send.status = IBV_WC_SUCCESS;
+    sq_tail_++;
+  }
+  Progress();
+  return rc;
+}
+
+int ShmTransport::PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) {
+  int rc = 0;
+  for (; wr != nullptr; wr = wr->next) {
+    if (wr->num_sge < 0 || (uint32_t)wr->num_sge > cap_.max_recv_sge) {
+      rc = EINVAL;
+    } else if (rq_tail_ - rq_head_ >= rq_.size()) {
+      rc = ENOMEM;
+    }
+    if (rc != 0) {
+      *bad_wr = wr;
+      break;
+    }
+    RecvWR &recv = rq_[rq_tail_ % rq_.size()];
+    recv.wr_id = wr->wr_id;
+    recv.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    recv.capacity = 0;
+    for (const ibv_sge &sge : recv.sges) {
+      recv.capacity += sge.length;
+    }
+    recv.received = 0;
+    recv.status = IBV_WC_SUCCESS;
+    rq_tail_++;
+  }
+  return rc;
+}
+
+int ShmTransport::PollCQ(int num, ibv_wc *wcs) {
+  if (nic_outstanding_ > 0) {
+    int rc = nic_->PollCQ(SHM_NIC_BATCH, nic_wcs_);
+    if (rc < 0) {
+      return rc;
+    }
+    for (int i = 0; i < rc; i++) {
+      SendWR &send = sq_[nic_wcs_[i].wr_id % sq_.size()];
+      send.done = true;
+      send.status = nic_wcs_[i].status;
+      if (send.status != IBV_WC_SUCCESS) {
+        Fail();
+      }
+      nic_outstanding_--;
+    }
+  }
+  if (!error_ && recv_ring_->PeerFailed()) {
+    Fail();
+  }
+  Progress();
+
+  int polled = 0;
+  while (polled < num && sq_head_ < sq_exec_) {
+    SendWR &send = sq_[sq_head_ % sq_.size()];
+    if (!send.done && !Acked(send)) {
+      break;
+    }
+    if (send.status != IBV_WC_SUCCESS || (send.wr.send_flags & IBV_SEND_SIGNALED)) {
+      ibv_wc &wc = wcs[polled++];
+      memset(&wc, 0, sizeof(wc));
+      wc.wr_id = send.wr.wr_id;
+      wc.status = send.status;
+      wc.opcode = WCOpcode(send.wr.opcode);
+      wc.byte_len = send.length;
+      wc.qp_num = QPNum();
+    }
+    sq_head_++;
+  }
+  return polled + Drain(num - polled, wcs + polled);
+}
+
+void ShmTransport::Progress() {
+  while (sq_exec_ < sq_tail_) {
+    SendWR &send = sq_[sq_exec_ % sq_.size()];
+    bool atomic = send.wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+                  send.wr.opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+    if (error_) {
+      send.done = true;
+      send.status = IBV_WC_WR_FLUSH_ERR;
+    } else if (atomic) {
+      // always signaled so that the requests behind it learn when it is done
+      ibv_send_wr wr = send.wr;
+      wr.wr_id = sq_exec_;
+      wr.next = nullptr;
+      wr.sg_list = send.sges.data();
+      wr.send_flags |= IBV_SEND_SIGNALED;
+      ibv_send_wr *bad_wr = nullptr;
+      if (nic_->PostSend(&wr, &bad_wr) != 0) {
+        send.done = true;
+        send.status = IBV_WC_LOC_QP_OP_ERR;
+        Fail();
+      } else {
+        nic_outstanding_++;
+      }
+    } else if (nic_outstanding_ > 0 || !Execute(send)) {
+      return;
+    }
+    sq_exec_++;
+  }
+}
+
+bool ShmTransport::Execute(SendWR &send) {
+  switch (send.wr.opcode) {
+    case IBV_WR_SEND:
+    case IBV_WR_SEND_WITH_IMM:
+      // done once the peer took it, see Acked
+      return ExecuteSend(send);
+    case IBV_WR_RDMA_WRITE:
+      send.status = CopyRemote(send, true);
+      break;
+    case IBV_WR_RDMA_WRITE_WITH_IMM: {
+      if (!send.written) {
+        send.status = CopyRemote(send, true);
+        send.written = true;
+        if (send.status != IBV_WC_SUCCESS) {
+          break;
+        }
+      }
+      // the data is in place before the peer sees the notification
+      ShmRecord *record = send_ring_->Reserve(0);
+      if (record == nullptr) {
+        return false;
+      }
+      record->type = SHM_WRITE_IMM;
+      record->flags = SHM_FIRST | SHM_LAST | SHM_IMM;
+      record->imm_data = send.wr.imm_data;
+      record->total = send.length;
+      send_ring_->Commit();
+      break;
+    }
+    case IBV_WR_RDMA_READ:
+      send.status = CopyRemote(send, false);
+      break;
+    default:
+      send.status = IBV_WC_LOC_QP_OP_ERR;
+      break;
+  }
+  send.done = true;
+  if (send.status != IBV_WC_SUCCESS) {
+    Fail();
+  }
+  return true;
+}
+
+bool ShmTransport::ExecuteSend(SendWR &send) {
+  bool has_inline = (send.wr.send_flags & IBV_SEND_INLINE) != 0;
+  do {
+    uint32_t length = std::min(send.length - send.sent, send_ring_->MaxRecord());
+    ShmRecord *record = send_ring_->Reserve(length);
+    if (record == nullptr) {
+      return false;
+    }
+    uint16_t flags = send.sent == 0 ? SHM_FIRST : 0;
+    if (send.sent + length == send.length) {
+      flags |= SHM_LAST;
+    }
+    if (send.wr.opcode == IBV_WR_SEND_WITH_IMM) {
+      flags |= SHM_IMM;
+    }
+    record->type = SHM_SEND;
+    record->flags = flags;
+    record->imm_data = send.wr.imm_data;
+    record->total = send.length;
+    char *payload = (char *)(record + 1);
+    if (has_inline) {
+      memcpy(payload, send.inline_data.data() + send.sent, length);
+    } else {
+      CopyFromSGE(send.sges, send.sent, payload, length);
+    }
+    send_ring_->Commit();
+    send.sent += length;
+  } while (send.sent < send.length);
+  send.end = send_ring_->Position();
+  return true;
+}
+
+bool ShmTransport::Acked(SendWR &send) {
+  if (send.end == 0) {
+    return false;
+  }
+  uint64_t consumed = send_ring_->Consumed();
+  if (send_ring_->FailPos() == send.end) {
+    send.status = IBV_WC_REM_INV_REQ_ERR;
+  } else if (consumed < send.end) {
+    if (!error_) {
+      return false;
+    }
+    send.status = IBV_WC_WR_FLUSH_ERR;
+  }
+  send.done = true;
+  if (send.status != IBV_WC_SUCCESS && !error_) {
+    Fail();
+  }
+  return true;
+}
+
+void ShmTransport::Fail() {
+  error_ = true;
+  send_ring_->SetFailed();
+}
+
+ibv_wc_status ShmTransport::CopyRemote(const SendWR &send, bool write) {
+  if (send.length == 0) {
+    return IBV_WC_SUCCESS;
+  }
+  if (!peer_keys_->Check(send.wr.wr.rdma.rkey, send.wr.wr.rdma.remote_addr, send.length,
+                         write ? IBV_ACCESS_REMOTE_WRITE : IBV_ACCESS_REMOTE_READ)) {
+    return IBV_WC_REM_ACCESS_ERR;
+  }
+  local_iov_.clear();
+  if (write && (send.wr.send_flags & IBV_SEND_INLINE)) {
+    local_iov_.push_back({.iov_base = (void *)send.inline_data.data(), .iov_len = send.length});
+  } else {
+    for (const ibv_sge &sge : send.sges) {
+      local_iov_.push_back({.iov_base = (void *)sge.addr, .iov_len = sge.length});
+    }
+  }
+  iovec remote = {.iov_base = (void *)send.wr.wr.rdma.remote_addr, .iov_len = send.length};
+  ssize_t rc = write ? process_vm_writev(peer_pid_, local_iov_.data(), local_iov_.size(),
+                                         &remote, 1, 0)
+                     : process_vm_readv(peer_pid_, local_iov_.data(), local_iov_.size(),
+                                        &remote, 1, 0);
+  return rc == (ssize_t)send.length ? IBV_WC_SUCCESS : IBV_WC_REM_ACCESS_ERR;
+}
+
+int ShmTransport::Drain(int num, ibv_wc *wcs) {
+  int polled = 0;
+  const ShmRecord *record;
+  // a message waits in the ring until a receive is posted, like an RNR retry
+  while (!error_ && polled < num && rq_head_ < rq_tail_ &&
+         (record = recv_ring_->Front()) != nullptr) {
+    RecvWR &recv = rq_[rq_head_ % rq_.size()];
+    if (record->type == SHM_SEND) {
+      if (recv.received + record->length > recv.capacity) {
+        recv.status = IBV_WC_LOC_LEN_ERR;
+      } else if (recv.status == IBV_WC_SUCCESS) {
+        CopyToSGE(recv.sges, recv.received, (const char *)(record + 1), record->length);
+      }
+      recv.received += record->length;
+    }
+    if (record->flags & SHM_LAST) {
+      ibv_wc &wc = wcs[polled++];
+      memset(&wc, 0, sizeof(wc));
+      wc.wr_id = recv.wr_id;
+      wc.status = recv.status;
+      if (record->type == SHM_WRITE_IMM) {
+        wc.opcode = IBV_WC_RECV_RDMA_WITH_IMM;
+        wc.byte_len = record->total;
+      } else {
+        wc.opcode = IBV_WC_RECV;
+        wc.byte_len = recv.status == IBV_WC_SUCCESS ? recv.received : 0;
+      }
+      if (record->flags & SHM_IMM) {
+        wc.wc_flags = IBV_WC_WITH_IMM;
+        wc.imm_data = record->imm_data;
+      }
+      wc.qp_num = QPNum();
+      rq_head_++;
+      if (wc.status != IBV_WC_SUCCESS) {
+        // the sender fails the SEND which ends here
+        recv_ring_->PopFailed();
+        Fail();
+        break;
+      }
+    }
+    recv_ring_->Pop();
+  }
+  // the error state flushes the posted receives, messages left in the ring are dropped
+  while (error_ && polled < num && rq_head_ < rq_tail_) {
+    ibv_wc &wc = wcs[polled++];
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id = rq_[rq_head_ % rq_.size()].wr_id;
+    wc.status = IBV_WC_WR_FLUSH_ERR;
+    wc.opcode = IBV_WC_RECV;
+    wc.qp_num = QPNum();
+    rq_head_++;
+  }
+  return polled;
+}
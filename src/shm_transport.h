@@ -0,0 +1,256 @@
+#pragma once
+#include <sys/uio.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "transport.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define SHM_RING_SIZE (4 * 1024 * 1024)
+#define SHM_RING_MAGIC 0x52444d4153484d31ULL
+#define SHM_NIC_BATCH 16
+#define SHM_KEYS_MAGIC 0x52444d414b455931ULL
+#define SHM_KEY_SLOTS 16384
+
+// identify the host for the peer, all processes of a boot share it
+bool HostID(uint8_t id[16]);
+
+enum ShmRecordType : uint16_t {
+  SHM_SEND,
+  SHM_WRITE_IMM,
+  SHM_PAD,
+};
+
+#define SHM_FIRST 1
+#define SHM_LAST 2
+#define SHM_IMM 4
+
+struct ShmRecord {
+  /* header of a record in the ring, the payload follows it */
+  uint32_t length;   /* payload bytes of this record */
+  uint16_t type;     /* ShmRecordType */
+  uint16_t flags;    /* SHM_FIRST, SHM_LAST, SHM_IMM */
+  uint32_t imm_data; /* immediate in network order */
+  uint32_t total;    /* bytes of the whole message, written bytes of a WRITE_IMM */
+};
+
+// A single producer single consumer ring of records in a memfd, created by the consumer and
+// mapped by the producer of the other process through /proc/<pid>/fd. Records are aligned
+// to cache lines and never wrap, a pad record skips the end of the ring instead. Each side
+// keeps the position of the other one cached and only reads the shared one when the cache
+// says the ring is full or empty. The header also carries the failures which the QPs of
+// both sides have to learn about.
+class ShmRing {
+ public:
+  ~ShmRing();
+
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+
+  // create a ring of capacity bytes, a power of two, to be consumed by this process
+  static std::unique_ptr<ShmRing> Create(uint64_t capacity = SHM_RING_SIZE);
+  // map the ring created as fd by process pid, nullptr unless it carries key
+  static std::unique_ptr<ShmRing> Open(uint32_t pid, int fd, uint64_t key);
+
+  int FD() const { return fd_; }
+  uint64_t Key() const { return header_->key; }
+  // larger messages are split, so that a record always fits once the consumer catches up
+  uint32_t MaxRecord() const { return capacity_ / 4; }
+
+  // producer : a record with room for length bytes of payload, nullptr when the ring is
+  // full, it becomes visible to the consumer with Commit
+  ShmRecord *Reserve(uint32_t length);
+  void Commit();
+  // producer : bytes the consumer has released, and the end of the message it failed on
+  // or 0, read in this order
+  uint64_t Consumed() const { return header_->tail.load(std::memory_order_acquire); }
+  uint64_t FailPos() const { return header_->fail_pos.load(std::memory_order_acquire); }
+  // producer : tell the consumer that the QP of this side is in the error state
+  void SetFailed() { header_->failed.store(1, std::memory_order_release); }
+
+  // consumer : the oldest record or nullptr when the ring is empty, it stays valid until Pop
+  const ShmRecord *Front();
+  void Pop();
+  // consumer : pop the last record of a message this side failed on
+  void PopFailed();
+  bool PeerFailed() const { return header_->failed.load(std::memory_order_acquire) != 0; }
+
+  // past the last record committed or popped by this side
+  uint64_t Position() const { return pos_; }
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint64_t key;
+    uint64_t capacity;
+    std::atomic<uint64_t> failed;   /* the QP of the producer is in the error state */
+    std::atomic<uint64_t> fail_pos; /* end of the message the consumer failed on, 0 : none */
+    char pad0[CACHE_LINE_SIZE - 5 * sizeof(uint64_t)];
+    std::atomic<uint64_t> head; /* bytes published by the producer */
+    char pad1[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    std::atomic<uint64_t> tail; /* bytes released by the consumer */
+    char pad2[CACHE_LINE_SIZE - sizeof(uint64_t)];
+  };
+
+  ShmRing() = default;
+  bool Map(int fd);
+
+  int fd_ = -1;
+  Header *header_ = nullptr;
+  char *data_ = nullptr;
+  uint64_t capacity_ = 0;
+  // position of this side and cached position of the other one
+  uint64_t pos_ = 0;
+  uint64_t reserved_ = 0;
+  uint64_t cached_ = 0;
+};
+
+// The remote keys of a device published to its peers on the same host, in a memfd which they
+// map like a ring. The device adds a region when it is registered and removes it before it
+// is deregistered, and a peer looks up the key of every WRITE and READ before it copies, so
+// a bad key or access fails like on the NIC. Slots are found by linear probing from the key
+// and each one is guarded by a sequence number which is odd while the owner rewrites it.
+class ShmKeyTable {
+ public:
+  ~ShmKeyTable();
+
+  ShmKeyTable(const ShmKeyTable &) = delete;
+  ShmKeyTable &operator=(const ShmKeyTable &) = delete;
+
+  static std::unique_ptr<ShmKeyTable> Create();
+  // map the table created as fd by process pid, nullptr unless it carries key
+  static std::unique_ptr<ShmKeyTable> Open(uint32_t pid, int fd, uint64_t key);
+
+  int FD() const { return fd_; }
+  uint64_t Key() const { return header_->key; }
+
+  // owner, calls must not overlap : return false when the table is full
+  bool Add(uint32_t rkey, uint64_t addr, uint64_t length, int access);
+  void Remove(uint32_t rkey);
+  // peer : whether [addr, addr + length) lies in the region of rkey and it grants access
+  bool Check(uint32_t rkey, uint64_t addr, uint64_t length, int access) const;
+
+ private:
+  enum SlotState : uint32_t {
+    SLOT_EMPTY,
+    SLOT_USED,
+    SLOT_REMOVED,
+  };
+  struct Header {
+    uint64_t magic;
+    uint64_t key;
+    uint64_t slots;
+  };
+  struct Slot {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> state; /* SlotState */
+    std::atomic<uint32_t> rkey;
+    std::atomic<int32_t> access;
+    std::atomic<uint64_t> addr;
+    std::atomic<uint64_t> length;
+  };
+  struct Entry {
+    uint32_t state;
+    uint32_t rkey;
+    int32_t access;
+    uint64_t addr;
+    uint64_t length;
+  };
+
+  ShmKeyTable() = default;
+  bool Map(int fd, uint64_t slots);
+  void Write(Slot *slot, const Entry &entry);
+  Entry Read(const Slot &slot) const;
+
+  int fd_ = -1;
+  Header *header_ = nullptr;
+  Slot *slots_ = nullptr;
+  uint64_t num_slots_ = 0;
+};
+
+// The data path of a QP whose peer runs on the same host. SEND and the notification of
+// WRITE_IMM go through a ShmRing in each direction, WRITE and READ copy straight from and
+// into the memory of the peer with process_vm_writev/readv, so none of them touches the
+// NIC and no request waits for the peer to poll. Atomics stay on the NIC QP below, which
+// keeps them atomic against the other requesters of the peer memory, and requests after an
+// atomic wait for it like after a fence. Requests execute when they are posted, a SEND
+// that does not fit in the ring and everything after it are retried by PollCQ.
+// Remote keys are checked against the ShmKeyTable of the peer device, a request outside the
+// region of its key or without its access fails with IBV_WC_REM_ACCESS_ERR. A SEND completes
+// once the peer took it from the ring, as a SEND on the NIC once it is acked, so that an
+// overlong SEND fails with IBV_WC_REM_INV_REQ_ERR while the receive fails with
+// IBV_WC_LOC_LEN_ERR. An error on either side moves both QPs to the error state, which
+// flushes their outstanding requests. Like a QP, it must be used by one thread at a time.
+class ShmTransport : public Transport {
+ public:
+  ShmTransport(std::unique_ptr<Transport> nic, std::unique_ptr<ShmRing> recv_ring,
+               std::unique_ptr<ShmRing> send_ring, std::unique_ptr<ShmKeyTable> peer_keys,
+               uint32_t peer_pid, const ibv_qp_cap &cap);
+
+  // whether this process may copy from and into the memory of pid at addr
+  static bool CanAccess(uint32_t pid, uint64_t addr);
+
+  uint32_t QPNum() const override { return nic_->QPNum(); }
+  int ModifyQP(ibv_qp_attr *attr, int mask) override { return nic_->ModifyQP(attr, mask); }
+  int PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) override;
+  int PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) override;
+  int PollCQ(int num, ibv_wc *wcs) override;
+
+ private:
+  struct SendWR {
+    ibv_send_wr wr;                /* copy of the request, next and sg_list are not used */
+    std::vector<ibv_sge> sges;     /* copy of the gather list */
+    std::vector<char> inline_data; /* payload copied at post time for IBV_SEND_INLINE */
+    uint32_t length;               /* bytes of the request */
+    uint32_t sent;                 /* bytes of a SEND already in the ring */
+    uint64_t end;                  /* ring position past a SEND once it is all in the ring */
+    bool written;                  /* the data of a WRITE_IMM is in the peer memory */
+    bool done;
+    ibv_wc_status status;
+  };
+  struct RecvWR {
+    uint64_t wr_id;
+    std::vector<ibv_sge> sges;
+    uint32_t capacity; /* bytes of the scatter list */
+    uint32_t received; /* bytes of the message received so far */
+    ibv_wc_status status;
+  };
+
+  // execute the send queue until a request must wait for the ring or an atomic
+  void Progress();
+  // return false when the request must be retried
+  bool Execute(SendWR &send);
+  bool ExecuteSend(SendWR &send);
+  // copy between the gather list of a request and the peer memory
+  ibv_wc_status CopyRemote(const SendWR &send, bool write);
+  // complete a SEND in the ring once the peer took it or failed, return false while it waits
+  bool Acked(SendWR &send);
+  // receive the records of the ring into the posted receives
+  int Drain(int num, ibv_wc *wcs);
+  // move to the error state, and the peer with it
+  void Fail();
+
+  std::unique_ptr<Transport> nic_;
+  std::unique_ptr<ShmRing> recv_ring_;
+  std::unique_ptr<ShmRing> send_ring_;
+  std::unique_ptr<ShmKeyTable> peer_keys_;
+  uint32_t peer_pid_;
+  ibv_qp_cap cap_;
+  bool error_ = false;
+
+  // requests are completed in order from sq_head_, executed up to sq_exec_ and posted up to
+  // sq_tail_, the slots and their vectors are reused so posting does not allocate
+  std::vector<SendWR> sq_;
+  uint64_t sq_head_ = 0;
+  uint64_t sq_exec_ = 0;
+  uint64_t sq_tail_ = 0;
+  uint32_t nic_outstanding_ = 0;
+  std::vector<RecvWR> rq_;
+  uint64_t rq_head_ = 0;
+  uint64_t rq_tail_ = 0;
+  std::vector<iovec> local_iov_;
+  ibv_wc nic_wcs_[SHM_NIC_BATCH];
+};
@@ -0,0 +1,515 @@
+#include "soft_transport.h"
+#include <glog/logging.h>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+
+struct SoftRegion {
+  char *addr;
+  size_t length;
+  int access;
+};
+
+struct SoftDelivery {
+  /* data on the wire, placed into the memory of a QP once it arrives */
+  uint32_t src_qp;            /* QP which sent the data */
+  uint32_t dst_qp;            /* QP whose memory the data lands in */
+  std::vector<ibv_sge> sges;  /* scatter list of the target memory */
+  std::vector<char> data;
+};
+
+// QPs and memory keys of the process, every software object is guarded by its mutex
+struct SoftFabric {
+  std::mutex mutex;
+  std::map<uint32_t, SoftRegion> regions;
+  std::map<uint32_t, SoftTransport *> qps;
+  uint32_t next_key = 1;
+  uint32_t next_qp_num = 1;
+
+  // data in flight by arrival time, the arrivals of one QP are in the order it sent them
+  std::multimap<uint64_t, SoftDelivery> deliveries;
+  // places the data which nobody polls for, such as writes into a ring read by the CPU
+  std::thread deliverer;
+  std::condition_variable delivered;
+  bool stop = false;
+
+  ~SoftFabric() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    delivered.notify_all();
+    if (deliverer.joinable()) {
+      deliverer.join();
+    }
+  }
+};
+
+static SoftFabric &Fabric() {
+  static SoftFabric fabric;
+  return fabric;
+}
+
+static uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// whether [addr, addr + length) lies in the region of key and the region grants access
+static bool CheckKey(uint32_t key, uint64_t addr, uint64_t length, int access) {
+  const SoftFabric &fabric = Fabric();
+  auto it = fabric.regions.find(key);
+  if (it == fabric.regions.end()) {
+    return false;
+  }
+  const SoftRegion &region = it->second;
+  uint64_t start = (uint64_t)region.addr;
+  return addr >= start && addr + length <= start + region.length &&
+         (region.access & access) == access;
+}
+
+static uint32_t SGELength(const std::vector<ibv_sge> &sges) {
+  uint32_t length = 0;
+  for (const ibv_sge &sge : sges) {
+    length += sge.length;
+  }
+  return length;
+}
+
+// copy length bytes of data over a scatter list, which must be large enough
+static void Scatter(const std::vector<ibv_sge> &sges, const char *data, uint32_t length) {
+  for (const ibv_sge &sge : sges) {
+    if (length == 0) {
+      break;
+    }
+    uint32_t bytes = std::min(sge.length, length);
+    memcpy((char *)sge.addr, data, bytes);
+    data += bytes;
+    length -= bytes;
+  }
+}
+
+// place the data which has arrived by now, with the fabric locked
+static void Deliver(uint64_t now) {
+  SoftFabric &fabric = Fabric();
+  while (!fabric.deliveries.empty() && fabric.deliveries.begin()->first <= now) {
+    const SoftDelivery &delivery = fabric.deliveries.begin()->second;
+    Scatter(delivery.sges, delivery.data.data(), delivery.data.size());
+    fabric.deliveries.erase(fabric.deliveries.begin());
+  }
+}
+
+static void RunDeliverer() {
+  SoftFabric &fabric = Fabric();
+  std::unique_lock<std::mutex> lock(fabric.mutex);
+  while (!fabric.stop) {
+    if (fabric.deliveries.empty()) {
+      fabric.delivered.wait(lock);
+      continue;
+    }
+    uint64_t ready_ns = fabric.deliveries.begin()->first;
+    uint64_t now = NowNs();
+    if (ready_ns > now) {
+      fabric.delivered.wait_for(lock, std::chrono::nanoseconds(ready_ns - now));
+      continue;
+    }
+    Deliver(now);
+  }
+}
+
+// place data into sges at ready_ns, or right away when it is already there, with the fabric
+// locked. Data which arrives later is copied now, as the source may be reused once the
+// request completes.
+static void Place(uint32_t src_qp, uint32_t dst_qp, const std::vector<ibv_sge> &sges,
+                  const char *data, uint32_t length, uint64_t ready_ns, uint64_t now) {
+  if (ready_ns <= now) {
+    Scatter(sges, data, length);
+    return;
+  }
+  SoftFabric &fabric = Fabric();
+  SoftDelivery &delivery = fabric.deliveries.emplace(ready_ns, SoftDelivery())->second;
+  delivery.src_qp = src_qp;
+  delivery.dst_qp = dst_qp;
+  delivery.sges = sges;
+  delivery.data.assign(data, data + length);
+  if (!fabric.deliverer.joinable()) {
+    fabric.deliverer = std::thread(RunDeliverer);
+  }
+  fabric.delivered.notify_one();
+}
+
+uint32_t SoftRegister(void *addr, size_t length, int access) {
+  SoftFabric &fabric = Fabric();
+  std::lock_guard<std::mutex> lock(fabric.mutex);
+  uint32_t key = fabric.next_key++;
+  fabric.regions[key] = {.addr = (char *)addr, .length = length, .access = access};
+  return key;
+}
+
+void SoftDeregister(uint32_t key) {
+  SoftFabric &fabric = Fabric();
+  std::lock_guard<std::mutex> lock(fabric.mutex);
+  fabric.regions.erase(key);
+}
+
+int SoftCQ::Poll(int num, ibv_wc *wcs) {
+  std::lock_guard<std::mutex> lock(Fabric().mutex);
+  if (entries_.empty()) {
+    return 0;
+  }
+  uint64_t now = NowNs();
+  // data is in place before the completions which arrive with or after it
+  Deliver(now);
+  int polled = 0;
+  while (polled < num && !entries_.empty() && entries_.front().ready_ns <= now) {
+    wcs[polled++] = entries_.front().wc;
+    entries_.pop_front();
+  }
+  return polled;
+}
+
+void SoftCQ::Push(const ibv_wc &wc, uint64_t ready_ns) {
+  if (entries_.size() == cqe_num_) {
+    // a device would raise IBV_EVENT_CQ_ERR, keep the completion so the caller can go on
+    LOG(ERROR) << "software CQ overrun with " << cqe_num_ << " entries";
+  }
+  entries_.push_back({.wc = wc, .ready_ns = ready_ns});
+}
+
+SoftTransport::SoftTransport(SoftCQ *cq, uint32_t cqe_num, const ibv_qp_cap &cap,
+                             SoftLink *link)
+    : cq_(cq), cap_(cap), link_(link) {
+  if (cq_ == nullptr) {
+    own_cq_.reset(new SoftCQ(cqe_num));
+    cq_ = own_cq_.get();
+  }
+  SoftFabric &fabric = Fabric();
+  std::lock_guard<std::mutex> lock(fabric.mutex);
+  qp_num_ = fabric.next_qp_num++;
+  fabric.qps[qp_num_] = this;
+}
+
+SoftTransport::~SoftTransport() {
+  SoftFabric &fabric = Fabric();
+  std::lock_guard<std::mutex> lock(fabric.mutex);
+  fabric.qps.erase(qp_num_);
+  // data still in flight from or to the QP is lost with it
+  for (auto it = fabric.deliveries.begin(); it != fabric.deliveries.end();) {
+    if (it->second.src_qp == qp_num_ || it->second.dst_qp == qp_num_) {
+      it = fabric.deliveries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+int SoftTransport::ModifyQP(ibv_qp_attr *attr, int mask) {
+  std::lock_guard<std::mutex> lock(Fabric().mutex);
+  if (mask & IBV_QP_DEST_QPN) {
+    dest_qp_num_ = attr->dest_qp_num;
+  }
+  if (mask & IBV_QP_STATE) {
+    if (attr->qp_state == IBV_QPS_ERR) {
+      Fail();
+      Progress();
+    } else {
+      state_ = attr->qp_state;
+    }
+  }
+  if (state_ == IBV_QPS_RTR) {
+    // requests of the peer may be waiting for this QP to be ready
+    SoftTransport *peer = Peer();
+    if (peer != nullptr) {
+      peer->Progress();
+    }
+  }
+  return 0;
+}
+
+int SoftTransport::PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) {
+  std::lock_guard<std::mutex> lock(Fabric().mutex);
+  int rc = 0;
+  for (; wr != nullptr; wr = wr->next) {
+    if (state_ != IBV_QPS_RTS && state_ != IBV_QPS_ERR) {
+      rc = EINVAL;
+    } else if (wr->num_sge < 0 || (uint32_t)wr->num_sge > cap_.max_send_sge) {
+      rc = EINVAL;
+    } else if (sq_.size() >= cap_.max_send_wr) {
+      rc = ENOMEM;
+    }
+    if (rc != 0) {
+      *bad_wr = wr;
+      break;
+    }
+    sq_.emplace_back();
+    SendWR &send = sq_.back();
+    send.wr = *wr;
+    send.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    if (wr->send_flags & IBV_SEND_INLINE) {
+      // the buffer of an inline request may be reused as soon as it is posted
+      send.inline_data.resize(SGELength(send.sges));
+      char *data = send.inline_data.data();
+      for (const ibv_sge &sge : send.sges) {
+        memcpy(data, (char *)sge.addr, sge.length);
+        data += sge.length;
+      }
+    }
+  }
+  Progress();
+  return rc;
+}
+
+int SoftTransport::PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) {
+  std::lock_guard<std::mutex> lock(Fabric().mutex);
+  int rc = 0;
+  for (; wr != nullptr; wr = wr->next) {
+    if (state_ == IBV_QPS_RESET) {
+      rc = EINVAL;
+    } else if (wr->num_sge < 0 || (uint32_t)wr->num_sge > cap_.max_recv_sge) {
+      rc = EINVAL;
+    } else if (rq_.size() >= cap_.max_recv_wr) {
+      rc = ENOMEM;
+    }
+    if (rc != 0) {
+      *bad_wr = wr;
+      break;
+    }
+    RecvWR recv = {.wr_id = wr->wr_id};
+    recv.sges.assign(wr->sg_list, wr->sg_list + wr->num_sge);
+    if (state_ == IBV_QPS_ERR) {
+      CompleteRecv(recv, IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV, 0, nullptr, NowNs());
+    } else {
+      rq_.push_back(std::move(recv));
+    }
+  }
+  // a request of the peer may be waiting for the receive
+  SoftTransport *peer = Peer();
+  if (peer != nullptr) {
+    peer->Progress();
+  }
+  return rc;
+}
+
+SoftTransport *SoftTransport::Peer() const {
+  const SoftFabric &fabric = Fabric();
+  auto it = fabric.qps.find(dest_qp_num_);
+  return it != fabric.qps.end() ? it->second : nullptr;
+}
+
+void SoftTransport::Progress() {
+  uint64_t now = 0;
+  while (!sq_.empty()) {
+    if (now == 0) {
+      now = NowNs();
+      Deliver(now);
+    }
+    const SendWR &send = sq_.front();
+    if (state_ == IBV_QPS_ERR) {
+      CompleteSend(send, IBV_WC_WR_FLUSH_ERR, 0, now);
+    } else if (!Execute(send, now)) {
+      return;
+    }
+    sq_.pop_front();
+  }
+}
+
+bool SoftTransport::Execute(const SendWR &send, uint64_t now) {
+  const ibv_send_wr &wr = send.wr;
+  uint32_t length = SGELength(send.sges);
+  bool has_inline = (wr.send_flags & IBV_SEND_INLINE) != 0;
+  for (const ibv_sge &sge : send.sges) {
+    // inline payloads were copied without their keys
+    if (!has_inline && !CheckKey(sge.lkey, sge.addr, sge.length, 0)) {
+      CompleteSend(send, IBV_WC_LOC_PROT_ERR, 0, now);
+      return true;
+    }
+  }
+  SoftTransport *peer = Peer();
+  if (peer == nullptr || peer->state_ == IBV_QPS_ERR) {
+    // nobody answers, the requester gives up after its retries
+    CompleteSend(send, IBV_WC_RETRY_EXC_ERR, 0, now);
+    return true;
+  }
+  if (peer->state_ != IBV_QPS_RTR && peer->state_ != IBV_QPS_RTS) {
+    // retried until the peer is ready to receive
+    return false;
+  }
+
+  switch (wr.opcode) {
+    case IBV_WR_SEND:
+    case IBV_WR_SEND_WITH_IMM: {
+      if (peer->rq_.empty()) {
+        return false;
+      }
+      const RecvWR &recv = peer->rq_.front();
+      uint64_t arrive = Transmit(length, now);
+      if (length > SGELength(recv.sges)) {
+        peer->CompleteRecv(recv, IBV_WC_LOC_LEN_ERR, IBV_WC_RECV, 0, nullptr, arrive);
+        peer->rq_.pop_front();
+        peer->Fail();
+        CompleteSend(send, IBV_WC_REM_INV_REQ_ERR, 0, arrive + link_->latency_ns);
+        return true;
+      }
+      Place(qp_num_, peer->qp_num_, recv.sges, Gather(send, length), length, arrive, now);
+      peer->CompleteRecv(recv, IBV_WC_SUCCESS, IBV_WC_RECV, length, &wr, arrive);
+      peer->rq_.pop_front();
+      CompleteSend(send, IBV_WC_SUCCESS, length, arrive + link_->latency_ns);
+      return true;
+    }
+    case IBV_WR_RDMA_WRITE:
+    case IBV_WR_RDMA_WRITE_WITH_IMM: {
+      if (!CheckKey(wr.wr.rdma.rkey, wr.wr.rdma.remote_addr, length, IBV_ACCESS_REMOTE_WRITE)) {
+        // the responder fails as well as the requester
+        peer->Fail();
+        CompleteSend(send, IBV_WC_REM_ACCESS_ERR, 0, now);
+        return true;
+      }
+      // the data of a WRITE_IMM is only placed once the receive it consumes is there
+      if (wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM && peer->rq_.empty()) {
+        return false;
+      }
+      uint64_t arrive = Transmit(length, now);
+      std::vector<ibv_sge> target = {
+          {.addr = wr.wr.rdma.remote_addr, .length = length, .lkey = wr.wr.rdma.rkey}};
+      Place(qp_num_, peer->qp_num_, target, Gather(send, length), length, arrive, now);
+      if (wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+        const RecvWR &recv = peer->rq_.front();
+        peer->CompleteRecv(recv, IBV_WC_SUCCESS, IBV_WC_RECV_RDMA_WITH_IMM, length, &wr, arrive);
+        peer->rq_.pop_front();
+      }
+      CompleteSend(send, IBV_WC_SUCCESS, length, arrive + link_->latency_ns);
+      return true;
+    }
+    case IBV_WR_RDMA_READ: {
+      if (!CheckKey(wr.wr.rdma.rkey, wr.wr.rdma.remote_addr, length, IBV_ACCESS_REMOTE_READ)) {
+        peer->Fail();
+        CompleteSend(send, IBV_WC_REM_ACCESS_ERR, 0, now);
+        return true;
+      }
+      // the request goes out and the data comes back over the same link
+      uint64_t arrive = Transmit(length, now + link_->latency_ns);
+      // the remote memory is read now, after the data of the requests before it was placed
+      DeliverSent();
+      Place(peer->qp_num_, qp_num_, send.sges, (const char *)wr.wr.rdma.remote_addr, length,
+            arrive, now);
+      CompleteSend(send, IBV_WC_SUCCESS, length, arrive);
+      return true;
+    }
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+    case IBV_WR_ATOMIC_CMP_AND_SWP: {
+      uint64_t remote_addr = wr.wr.atomic.remote_addr;
+      if (length != sizeof(uint64_t) || remote_addr % sizeof(uint64_t) != 0) {
+        peer->Fail();
+        CompleteSend(send, IBV_WC_REM_INV_REQ_ERR, 0, now);
+        return true;
+      }
+      if (!CheckKey(wr.wr.atomic.rkey, remote_addr, length, IBV_ACCESS_REMOTE_ATOMIC)) {
+        peer->Fail();
+        CompleteSend(send, IBV_WC_REM_ACCESS_ERR, 0, now);
+        return true;
+      }
+      DeliverSent();
+      // atomic against the CPUs of the peer as well as other software QPs
+      uint64_t *target = (uint64_t *)remote_addr;
+      uint64_t old;
+      if (wr.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        old = __atomic_fetch_add(target, wr.wr.atomic.compare_add, __ATOMIC_SEQ_CST);
+      } else {
+        old = wr.wr.atomic.compare_add;
+        __atomic_compare_exchange_n(target, &old, wr.wr.atomic.swap, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+      }
+      uint64_t arrive = Transmit(length, now);
+      Place(peer->qp_num_, qp_num_, send.sges, (const char *)&old, length,
+            arrive + link_->latency_ns, now);
+      CompleteSend(send, IBV_WC_SUCCESS, length, arrive + link_->latency_ns);
+      return true;
+    }
+    default:
+      CompleteSend(send, IBV_WC_LOC_QP_OP_ERR, 0, now);
+      return true;
+  }
+}
+
+void SoftTransport::CompleteSend(const SendWR &send, ibv_wc_status status, uint32_t byte_len,
+                                 uint64_t ready_ns) {
+  if (status == IBV_WC_SUCCESS && !(send.wr.send_flags & IBV_SEND_SIGNALED)) {
+    return;
+  }
+  ibv_wc wc;
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = send.wr.wr_id;
+  wc.status = status;
+  wc.opcode = WCOpcode(send.wr.opcode);
+  wc.byte_len = byte_len;
+  wc.qp_num = qp_num_;
+  cq_->Push(wc, ready_ns);
+  if (status != IBV_WC_SUCCESS && status != IBV_WC_WR_FLUSH_ERR) {
+    Fail();
+  }
+}
+
+void SoftTransport::CompleteRecv(const RecvWR &recv, ibv_wc_status status, ibv_wc_opcode opcode,
+                                 uint32_t byte_len, const ibv_send_wr *wr, uint64_t ready_ns) {
+  ibv_wc wc;
+  memset(&wc, 0, sizeof(wc));
+  wc.wr_id = recv.wr_id;
+  wc.status = status;
+  wc.opcode = opcode;
+  wc.byte_len = byte_len;
+  wc.qp_num = qp_num_;
+  wc.src_qp = dest_qp_num_;
+  if (wr != nullptr &&
+      (wr->opcode == IBV_WR_SEND_WITH_IMM || wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)) {
+    wc.wc_flags = IBV_WC_WITH_IMM;
+    wc.imm_data = wr->imm_data;
+  }
+  cq_->Push(wc, ready_ns);
+}
+
+void SoftTransport::Fail() {
+  state_ = IBV_QPS_ERR;
+  uint64_t now = NowNs();
+  for (const RecvWR &recv : rq_) {
+    CompleteRecv(recv, IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV, 0, nullptr, now);
+  }
+  rq_.clear();
+}
+
+void SoftTransport::DeliverSent() {
+  SoftFabric &fabric = Fabric();
+  for (auto it = fabric.deliveries.begin(); it != fabric.deliveries.end();) {
+    if (it->second.src_qp == qp_num_) {
+      Scatter(it->second.sges, it->second.data.data(), it->second.data.size());
+      it = fabric.deliveries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+uint64_t SoftTransport::Transmit(uint64_t length, uint64_t now) {
+  uint64_t start = std::max(now, link_->free_ns);
+  uint64_t wire_ns = link_->gbps > 0 ? (uint64_t)(length * 8 / link_->gbps) : 0;
+  link_->free_ns = start + wire_ns;
+  return link_->free_ns + link_->latency_ns;
+}
+
+const char *SoftTransport::Gather(const SendWR &send, uint32_t length) {
+  if (send.wr.send_flags & IBV_SEND_INLINE) {
+    return send.inline_data.data();
+  }
+  scratch_.resize(length);
+  char *data = scratch_.data();
+  for (const ibv_sge &sge : send.sges) {
+    memcpy(data, (char *)sge.addr, sge.length);
+    data += sge.length;
+  }
+  return scratch_.data();
+}
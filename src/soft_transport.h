@@ -0,0 +1,114 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <vector>
+#include "device.h"
+#include "transport.h"
+
+#define SOFT_DEVICE "soft"
+#define SOFT_MAX_WR 16384
+#define SOFT_MAX_SGE 16
+#define SOFT_MAX_RD_ATOMIC 16
+#define SOFT_MAX_CQE (1 << 20)
+
+// The software backend behind Device::Open(SOFT_DEVICE). QPs, CQs and memory keys live in
+// the process and RC semantics are kept : requests of a QP execute in order, a SEND or
+// WRITE_IMM waits for a receive of the peer like an RNR retry, unsignaled sends complete
+// silently, an error moves the QP to the error state and flushes everything posted after
+// it, and remote keys are checked against the access flags of their region. Both peers must
+// be in the same process, connected through the QP numbers of their Connection records.
+// Requests execute when they are posted or, when they wait for a receive, when the peer
+// posts it. With a SoftLink latency or bandwidth, their data is placed and their
+// completions are reaped only once the modelled wire time has passed, so a peer which polls
+// memory sees the data as late as one which polls its CQ. Data which arrives later is
+// placed by a fabric thread, or earlier by a poll or post which finds it due; a READ or
+// atomic first places everything its QP sent before it, as it must observe that data.
+// Everything is guarded by one process wide lock, which also orders the data of a request
+// before its completion.
+
+// memory keys of the software device, the lkey and the rkey of a region are the same key
+uint32_t SoftRegister(void *addr, size_t length, int access);
+void SoftDeregister(uint32_t key);
+
+// completions of software QPs, shared by the QPs created on it like a verbs CQ
+class SoftCQ {
+ public:
+  explicit SoftCQ(uint32_t cqe_num) : cqe_num_(cqe_num) {}
+
+  SoftCQ(const SoftCQ &) = delete;
+  SoftCQ &operator=(const SoftCQ &) = delete;
+
+  // reap up to num completions in the order they were generated, a completion stays in the
+  // queue and holds back the ones after it until its wire time has passed
+  int Poll(int num, ibv_wc *wcs);
+
+ private:
+  friend class SoftTransport;
+  struct Entry {
+    ibv_wc wc;
+    uint64_t ready_ns;
+  };
+  void Push(const ibv_wc &wc, uint64_t ready_ns);
+
+  uint32_t cqe_num_;
+  std::deque<Entry> entries_;
+};
+
+class SoftTransport : public Transport {
+ public:
+  // create the QP on cq, or on a CQ of cqe_num entries of its own when cq is null, the link
+  // models the wire and must outlive the QP
+  SoftTransport(SoftCQ *cq, uint32_t cqe_num, const ibv_qp_cap &cap, SoftLink *link);
+  ~SoftTransport() override;
+
+  SoftTransport(const SoftTransport &) = delete;
+  SoftTransport &operator=(const SoftTransport &) = delete;
+
+  uint32_t QPNum() const override { return qp_num_; }
+  int ModifyQP(ibv_qp_attr *attr, int mask) override;
+  int PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) override;
+  int PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) override;
+  int PollCQ(int num, ibv_wc *wcs) override { return cq_->Poll(num, wcs); }
+
+ private:
+  struct SendWR {
+    ibv_send_wr wr;                /* copy of the request, next and sg_list are not used */
+    std::vector<ibv_sge> sges;     /* copy of the gather list */
+    std::vector<char> inline_data; /* payload copied at post time for IBV_SEND_INLINE */
+  };
+  struct RecvWR {
+    uint64_t wr_id;
+    std::vector<ibv_sge> sges;
+  };
+
+  // the QP this one is connected to, nullptr before RTR or once the peer is destroyed
+  SoftTransport *Peer() const;
+  // execute the send queue from its head until a request waits for a receive of the peer
+  void Progress();
+  // return false when the request waits for a receive of the peer
+  bool Execute(const SendWR &send, uint64_t now);
+  // complete a request of the send queue, successful unsignaled requests generate no CQE
+  void CompleteSend(const SendWR &send, ibv_wc_status status, uint32_t byte_len,
+                    uint64_t ready_ns);
+  void CompleteRecv(const RecvWR &recv, ibv_wc_status status, ibv_wc_opcode opcode,
+                    uint32_t byte_len, const ibv_send_wr *wr, uint64_t ready_ns);
+  // move to the error state and flush the posted receives
+  void Fail();
+  // place the data this QP has in flight right away
+  void DeliverSent();
+  // reserve the link for length bytes, return when they reach the peer
+  uint64_t Transmit(uint64_t length, uint64_t now);
+  // the payload of a request, copied into scratch_ unless it was inlined
+  const char *Gather(const SendWR &send, uint32_t length);
+
+  std::unique_ptr<SoftCQ> own_cq_;
+  SoftCQ *cq_;
+  uint32_t qp_num_;
+  ibv_qp_cap cap_;
+  SoftLink *link_;
+  ibv_qp_state state_ = IBV_QPS_RESET;
+  uint32_t dest_qp_num_ = 0;
+  std::deque<SendWR> sq_;
+  std::deque<RecvWR> rq_;
+  std::vector<char> scratch_;
+};
@@ -0,0 +1,147 @@
+#include "srq.h"
+#include <glog/logging.h>
+#include <cassert>
+
+SharedReceiveQueue::SharedReceiveQueue(std::shared_ptr<Device> device, const SRQConfig &config)
+    : device_(device), config_(config) {
+  assert(config_.chunk > 0 && config_.buf_size > 0);
+  config_.max_buffers = std::max(config_.max_buffers, config_.chunk);
+}
+
+SharedReceiveQueue::~SharedReceiveQueue() {
+  // attached QPs must be destroyed before the queue
+  if (srq_ != nullptr) {
+    device_->RemoveAsyncHandler(srq_);
+    int rc = ibv_destroy_srq(srq_);
+    assert(rc == 0);
+    srq_ = nullptr;
+  }
+  for (MemoryRegion *chunk : chunks_) {
+    if (chunk != nullptr) {
+      device_->DeregisterMemory(chunk);
+    }
+  }
+  chunks_.clear();
+}
+
+bool SharedReceiveQueue::Init() {
+  const ibv_device_attr &dev_attr = device_->Attr();
+  if (dev_attr.max_srq == 0) {
+    LOG(ERROR) << "device has no shared receive queue support";
+    return false;
+  }
+  config_.max_buffers = std::min<uint32_t>(config_.max_buffers, dev_attr.max_srq_wr);
+  config_.chunk = std::min(config_.chunk, config_.max_buffers);
+  config_.limit = std::min(config_.limit, config_.chunk);
+  LOG(INFO) << "srq buffers : " << config_.max_buffers << " x " << config_.buf_size;
+  chunks_.assign(config_.max_buffers / config_.chunk, nullptr);
+
+  ibv_srq_init_attr srq_init_attr = {
+      .srq_context = this,
+      .attr =
+          {
+              .max_wr = config_.max_buffers,
+              .max_sge = 1,
+              .srq_limit = 0,
+          },
+  };
+  srq_ = ibv_create_srq(device_->PD(), &srq_init_attr);
+  if (srq_ == nullptr) {
+    LOG(ERROR) << "fail to create shared receive queue";
+    return false;
+  }
+  device_->AddAsyncHandler(srq_, &SharedReceiveQueue::OnAsyncEvent, this);
+  if (!Grow()) {
+    return false;
+  }
+  return AtCap() || ArmLimit();
+}
+
+const MemoryRegion *SharedReceiveQueue::Chunk(uint32_t slot) const {
+  // pairs with the release in Grow, so the chunk of a slot that was handed out is visible
+  uint32_t buffers = buffers_.load(std::memory_order_acquire);
+  assert(slot < buffers);
+  (void)buffers;
+  return chunks_[slot / config_.chunk];
+}
+
+char *SharedReceiveQueue::Buffer(uint32_t slot) const {
+  return Chunk(slot)->addr + (size_t)(slot % config_.chunk) * config_.buf_size;
+}
+
+bool SharedReceiveQueue::Release(const Message &msg) { return Release(msg.slot); }
+
+bool SharedReceiveQueue::Release(uint32_t slot) {
+  const MemoryRegion *chunk = Chunk(slot);
+  ibv_sge sge = {
+      .addr = (uint64_t)(chunk->addr + (size_t)(slot % config_.chunk) * config_.buf_size),
+      .length = config_.buf_size,
+      .lkey = chunk->lkey,
+  };
+  ibv_recv_wr wr = {
+      .wr_id = SRQ_TOKEN_BIT | slot,
+      .next = nullptr,
+      .sg_list = &sge,
+      .num_sge = 1,
+  };
+  ibv_recv_wr *bad_wr = nullptr;
+  if (ibv_post_srq_recv(srq_, &wr, &bad_wr) != 0) {
+    LOG(ERROR) << "fail to post shared receive buffer " << slot;
+    return false;
+  }
+  posted_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool SharedReceiveQueue::Grow() {
+  assert(!AtCap());
+  // only this thread changes buffers_
+  uint32_t first = buffers_.load(std::memory_order_relaxed);
+  MemoryRegion *chunk = device_->AllocMemory((size_t)config_.chunk * config_.buf_size);
+  if (chunk == nullptr) {
+    return false;
+  }
+  chunks_[first / config_.chunk] = chunk;
+  buffers_.store(first + config_.chunk, std::memory_order_release);
+  for (uint32_t slot = first; slot < first + config_.chunk; slot++) {
+    if (!Release(slot)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SharedReceiveQueue::ArmLimit() {
+  // the limit event fires once, so it is armed again after every refill
+  ibv_srq_attr attr = {
+      .max_wr = 0,
+      .max_sge = 0,
+      .srq_limit = config_.limit,
+  };
+  if (ibv_modify_srq(srq_, &attr, IBV_SRQ_LIMIT) != 0) {
+    LOG(ERROR) << "fail to arm shared receive queue limit";
+    return false;
+  }
+  return true;
+}
+
+bool SharedReceiveQueue::AtCap() const {
+  return buffers_.load(std::memory_order_relaxed) + config_.chunk > config_.max_buffers;
+}
+
+bool SharedReceiveQueue::OnAsyncEvent(void *arg, const ibv_async_event &event) {
+  SharedReceiveQueue *srq = (SharedReceiveQueue *)arg;
+  if (event.event_type != IBV_EVENT_SRQ_LIMIT_REACHED) {
+    LOG(ERROR) << "shared receive queue : " << ibv_event_type_str(event.event_type);
+    return false;
+  }
+  if (!srq->Grow()) {
+    return false;
+  }
+  if (srq->AtCap()) {
+    // the limit stays disarmed, the pool cannot grow any further
+    LOG(WARNING) << "shared receive pool at its cap of " << srq->Buffers() << " buffers";
+    return true;
+  }
+  return srq->ArmLimit();
+}
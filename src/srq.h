@@ -0,0 +1,68 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include "rdma.h"
+
+#define SRQ_CHUNK 64
+#define SRQ_MAX_BUFFERS 4096
+#define SRQ_LIMIT 16
+
+struct SRQConfig {
+  uint32_t buf_size = BUF_SIZE;           /* bytes per receive buffer */
+  uint32_t chunk = SRQ_CHUNK;             /* buffers added to the pool at a time */
+  uint32_t max_buffers = SRQ_MAX_BUFFERS; /* pool cap, clamped to the device max_srq_wr */
+  uint32_t limit = SRQ_LIMIT;             /* grow the pool when fewer buffers are posted */
+};
+
+// A pool of receive buffers shared by every QP attached to it through RDMAConfig::srq. The
+// QPs must be created on the same device with RDMA::Init(device). The pool starts with one
+// chunk of buffers and grows by a chunk each time the number of posted buffers drops below
+// the limit, so receive memory follows the number of messages in flight instead of the
+// number of connections, until it reaches its cap. The limit is reported as an async event
+// of the device: watch AsyncFD and call HandleAsyncEvent when it is readable. Messages are
+// taken with RDMA::RecvShared on the QP they arrived on and handed back with Release, a QP
+// holds at most RDMAConfig::max_recv_wr of them. Release may be called from any thread, Grow
+// runs on the thread which handles the async events.
+class SharedReceiveQueue {
+ public:
+  SharedReceiveQueue(std::shared_ptr<Device> device, const SRQConfig &config = SRQConfig());
+  ~SharedReceiveQueue();
+
+  SharedReceiveQueue(const SharedReceiveQueue &) = delete;
+  SharedReceiveQueue &operator=(const SharedReceiveQueue &) = delete;
+
+  // create the queue in the PD of the device, post the first chunk and arm the limit
+  bool Init();
+  // repost the buffer of a message taken from any attached QP
+  bool Release(const Message &msg);
+  bool Release(uint32_t slot);
+  // drain the async events of the device without blocking, each goes to the QP or SRQ it
+  // belongs to, this queue grows the pool and rearms the limit if it was reached
+  bool HandleAsyncEvent() { return device_->HandleAsyncEvents(); }
+  int AsyncFD() const { return device_->AsyncFD(); }
+
+  ibv_srq *SRQ() const { return srq_; }
+  char *Buffer(uint32_t slot) const;
+  // called by the attached QPs when a posted buffer completes, they may be polled from
+  // different threads
+  void Consume() { posted_.fetch_sub(1, std::memory_order_relaxed); }
+  uint32_t MaxBuffers() const { return config_.max_buffers; }
+  uint32_t Buffers() const { return buffers_.load(std::memory_order_acquire); }
+  uint32_t Posted() const { return posted_.load(std::memory_order_relaxed); }
+
+ private:
+  static bool OnAsyncEvent(void *arg, const ibv_async_event &event);
+  bool AtCap() const;
+  bool Grow();
+  bool ArmLimit();
+  const MemoryRegion *Chunk(uint32_t slot) const;
+
+  std::shared_ptr<Device> device_;
+  SRQConfig config_;
+  ibv_srq *srq_ = nullptr;
+  // sized for the cap by Init and never reallocated, since pollers read it while Grow
+  // fills it, a chunk is published by the store of buffers_ which covers its slots
+  std::vector<MemoryRegion *> chunks_;
+  std::atomic<uint32_t> buffers_{0};
+  std::atomic<uint32_t> posted_{0};
+};
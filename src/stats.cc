@@ -0,0 +1,198 @@
+#include "stats.h"
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+// the number of a thread picks its shard in every Stats, numbers of exited threads are
+// handed out again before new ones
+struct ThreadIndexes {
+  std::mutex mutex;
+  std::vector<uint32_t> free;
+  uint32_t next = 0;
+};
+
+ThreadIndexes &Indexes() {
+  static ThreadIndexes indexes;
+  return indexes;
+}
+
+struct ThreadSlot {
+  uint32_t idx;
+
+  ThreadSlot() {
+    ThreadIndexes &indexes = Indexes();
+    std::lock_guard<std::mutex> lock(indexes.mutex);
+    if (indexes.free.empty()) {
+      idx = indexes.next++;
+    } else {
+      idx = indexes.free.back();
+      indexes.free.pop_back();
+    }
+  }
+  // the next owner of the index takes over the shards, the lock orders its updates after
+  // those of this thread
+  ~ThreadSlot() {
+    ThreadIndexes &indexes = Indexes();
+    std::lock_guard<std::mutex> lock(indexes.mutex);
+    indexes.free.push_back(idx);
+  }
+};
+}  // namespace
+
+static uint32_t ThreadIndex() {
+  thread_local ThreadSlot slot;
+  return slot.idx;
+}
+
+const char *StatsOpName(int op) {
+  static const char *names[STATS_OPS] = {"send",     "write",     "read",     "fetch_add",
+                                         "cmp_swap", "write_imm", "send_imm", "recv"};
+  return op >= 0 && op < STATS_OPS ? names[op] : "unknown";
+}
+
+Stats::Stats() {
+  for (int i = 0; i < STATS_MAX_THREADS; i++) {
+    shards_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  shared_ = NewShard(false);
+}
+
+Stats::~Stats() {
+  for (int i = 0; i < STATS_MAX_THREADS; i++) {
+    Shard *shard = shards_[i].load(std::memory_order_relaxed);
+    if (shard != nullptr) {
+      shard->~Shard();
+      free(shard);
+    }
+  }
+  shared_->~Shard();
+  free(shared_);
+}
+
+Stats::Shard *Stats::NewShard(bool exclusive) {
+  // own cache lines, so that shards of different threads never share one
+  void *mem = nullptr;
+  if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Shard)) != 0) {
+    abort();
+  }
+  Shard *shard = new (mem) Shard();
+  shard->exclusive = exclusive;
+  return shard;
+}
+
+Stats::Shard *Stats::Local() {
+  uint32_t idx = ThreadIndex();
+  if (idx >= STATS_MAX_THREADS) {
+    return shared_;
+  }
+  Shard *shard = shards_[idx].load(std::memory_order_acquire);
+  if (shard == nullptr) {
+    // only this thread installs its slot
+    shard = NewShard(true);
+    shards_[idx].store(shard, std::memory_order_release);
+  }
+  return shard;
+}
+
+void Stats::Snapshot(StatsSnapshot *snap) const {
+  memset(snap, 0, sizeof(*snap));
+  auto add = [snap](const Shard *shard) {
+    for (int op = 0; op < STATS_OPS; op++) {
+      snap->ops[op] += shard->ops[op].load(std::memory_order_relaxed);
+      snap->bytes[op] += shard->bytes[op].load(std::memory_order_relaxed);
+      snap->completions[op] += shard->completions[op].load(std::memory_order_relaxed);
+      for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        snap->latency[op][b] += shard->latency[op][b].load(std::memory_order_relaxed);
+      }
+    }
+    for (int s = 0; s < STATS_WC_STATUS; s++) {
+      snap->errors[s] += shard->errors[s].load(std::memory_order_relaxed);
+    }
+    snap->polls += shard->polls.load(std::memory_order_relaxed);
+    snap->empty_polls += shard->empty_polls.load(std::memory_order_relaxed);
+    snap->full_polls += shard->full_polls.load(std::memory_order_relaxed);
+  };
+  for (int i = 0; i < STATS_MAX_THREADS; i++) {
+    const Shard *shard = shards_[i].load(std::memory_order_acquire);
+    if (shard != nullptr) {
+      add(shard);
+    }
+  }
+  add(shared_);
+}
+
+uint64_t StatsSnapshot::SendOutstanding() const {
+  uint64_t outstanding = 0;
+  for (int op = 0; op < STATS_RECV; op++) {
+    outstanding += ops[op] - completions[op];
+  }
+  return outstanding;
+}
+
+double StatsSnapshot::Percentile(int op, double p) const {
+  uint64_t total = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    total += latency[op][b];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max<uint64_t>(1, p / 100 * total);
+  uint64_t seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += latency[op][b];
+    if (seen >= rank) {
+      // bucket b holds latencies below 2^b ns
+      return (double)(1ULL << b) / 1000;
+    }
+  }
+  return (double)(1ULL << (LATENCY_BUCKETS - 1)) / 1000;
+}
+
+std::string StatsSnapshot::ToJSON() const {
+  std::string json = "{";
+  auto field = [&json](const std::string &key, const std::string &value) {
+    json += (json.size() > 1 ? ", \"" : "\"") + key + "\": " + value;
+  };
+  auto per_op = [](const uint64_t *counters) {
+    std::string object = "{";
+    for (int op = 0; op < STATS_OPS; op++) {
+      object += std::string(op > 0 ? ", \"" : "\"") + StatsOpName(op) +
+                "\": " + std::to_string(counters[op]);
+    }
+    return object + "}";
+  };
+  field("ops", per_op(ops));
+  field("bytes", per_op(bytes));
+  field("completions", per_op(completions));
+
+  std::string errors_json = "{";
+  for (int s = 0; s < STATS_WC_STATUS; s++) {
+    if (errors[s] != 0) {
+      errors_json += std::string(errors_json.size() > 1 ? ", \"" : "\"") +
+                     ibv_wc_status_str((ibv_wc_status)s) + "\": " + std::to_string(errors[s]);
+    }
+  }
+  field("errors", errors_json + "}");
+  field("polls", std::to_string(polls));
+  field("empty_polls", std::to_string(empty_polls));
+  field("full_polls", std::to_string(full_polls));
+  field("send_outstanding", std::to_string(SendOutstanding()));
+  field("recv_outstanding", std::to_string(RecvOutstanding()));
+
+  std::string latency_json = "{";
+  char buf[128];
+  for (int op = 0; op < STATS_OPS; op++) {
+    if (completions[op] == 0) {
+      continue;
+    }
+    snprintf(buf, sizeof(buf), "\"%s\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}",
+             StatsOpName(op), Percentile(op, 50), Percentile(op, 99), Percentile(op, 99.9));
+    latency_json += std::string(latency_json.size() > 1 ? ", " : "") + buf;
+  }
+  field("latency_us", latency_json + "}");
+  return json + "}";
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "rdma.h"
+
+#define STATS_RECV (RDMA_SEND_IMM + 1)
+#define STATS_OPS (STATS_RECV + 1)
+#define STATS_WC_STATUS 32
+#define STATS_MAX_THREADS 64
+#define LATENCY_BUCKETS 32
+
+inline uint64_t StatsNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// name of a counter index, an Opcode or STATS_RECV
+const char *StatsOpName(int op);
+
+struct StatsSnapshot {
+  /* counters of a connection summed over all threads, indexed by Opcode or STATS_RECV */
+  uint64_t ops[STATS_OPS];                      /* posted requests */
+  uint64_t bytes[STATS_OPS];                    /* bytes of posted sends, received bytes */
+  uint64_t completions[STATS_OPS];              /* completed requests */
+  uint64_t errors[STATS_WC_STATUS];             /* failed completions by ibv_wc_status */
+  uint64_t polls;                               /* CQ polls */
+  uint64_t empty_polls;                         /* polls which found no completion */
+  uint64_t full_polls;                          /* polls which filled the whole batch */
+  uint64_t latency[STATS_OPS][LATENCY_BUCKETS]; /* post to completion, log2 ns buckets */
+
+  uint64_t SendOutstanding() const;
+  uint64_t RecvOutstanding() const { return ops[STATS_RECV] - completions[STATS_RECV]; }
+  // upper bound in us of the bucket holding the p-th percentile, p in [0, 100]
+  double Percentile(int op, double p) const;
+  std::string ToJSON() const;
+};
+
+// Counters of one connection, enabled with RDMAConfig::stats. Every thread which posts or
+// polls on the connection gets its own cache line aligned shard and bumps it with plain
+// relaxed stores, so the data path never contends on a counter and Snapshot can run at any
+// time from a monitoring thread. Threads beyond STATS_MAX_THREADS share one shard updated
+// with atomic adds. The shard of a thread which exits goes to the next thread started, so
+// short-lived threads do not use up the exclusive shards. Connections on a shared CQ count
+// every poll of that queue.
+class Stats {
+ public:
+  Stats();
+  ~Stats();
+
+  Stats(const Stats &) = delete;
+  Stats &operator=(const Stats &) = delete;
+
+  void AddPost(int op, uint64_t bytes) {
+    Shard *shard = Local();
+    Bump(shard, &shard->ops[op], 1);
+    Bump(shard, &shard->bytes[op], bytes);
+  }
+  void AddCompletion(int op, uint64_t latency_ns, uint64_t bytes) {
+    Shard *shard = Local();
+    Bump(shard, &shard->completions[op], 1);
+    Bump(shard, &shard->bytes[op], bytes);
+    Bump(shard, &shard->latency[op][Bucket(latency_ns)], 1);
+  }
+  // a receive from a shared queue, posted by the queue rather than the connection, so it
+  // is counted once it completes and has no latency
+  void AddSharedRecv(uint64_t bytes) {
+    Shard *shard = Local();
+    Bump(shard, &shard->ops[STATS_RECV], 1);
+    Bump(shard, &shard->completions[STATS_RECV], 1);
+    Bump(shard, &shard->bytes[STATS_RECV], bytes);
+  }
+  void AddError(int status) {
+    Shard *shard = Local();
+    Bump(shard, &shard->errors[std::min(status, STATS_WC_STATUS - 1)], 1);
+  }
+  void AddPoll(int polled, int batch) {
+    Shard *shard = Local();
+    Bump(shard, &shard->polls, 1);
+    Bump(shard, &shard->empty_polls, polled == 0);
+    Bump(shard, &shard->full_polls, polled == batch);
+  }
+
+  void Snapshot(StatsSnapshot *snap) const;
+
+ private:
+  struct Shard {
+    bool exclusive;
+    std::atomic<uint64_t> ops[STATS_OPS];
+    std::atomic<uint64_t> bytes[STATS_OPS];
+    std::atomic<uint64_t> completions[STATS_OPS];
+    std::atomic<uint64_t> errors[STATS_WC_STATUS];
+    std::atomic<uint64_t> polls;
+    std::atomic<uint64_t> empty_polls;
+    std::atomic<uint64_t> full_polls;
+    std::atomic<uint64_t> latency[STATS_OPS][LATENCY_BUCKETS];
+  };
+
+  static void Bump(Shard *shard, std::atomic<uint64_t> *counter, uint64_t n) {
+    if (shard->exclusive) {
+      counter->store(counter->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    } else {
+      counter->fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+  static int Bucket(uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return std::min(bucket, LATENCY_BUCKETS - 1);
+  }
+  static Shard *NewShard(bool exclusive);
+  Shard *Local();
+
+  std::atomic<Shard *> shards_[STATS_MAX_THREADS];
+  Shard *shared_;
+};
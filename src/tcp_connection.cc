@@ -1,9 +1,13 @@
 #include "tcp_connection.h"
 #include <glog/logging.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 
-TCPConnector::TCPConnector(std::string ip_port) : TCPConnector() {
+TCPConnector::TCPConnector(std::string ip_port, int backlog) : TCPConnector() {
   is_sever_ = true;
   addrinfo hint = {.ai_flags = AI_PASSIVE, .ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
   addrinfo *addrs;
@@ -23,9 +27,11 @@ TCPConnector::TCPConnector(std::string ip_port) : TCPConnector() {
     return;
   }
 
+  int reuse = 1;
+  setsockopt(sock_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
   rc = bind(sock_fd_, it->ai_addr, it->ai_addrlen);
   assert(rc == 0);
-  rc = listen(sock_fd_, 1);
+  rc = listen(sock_fd_, backlog);
   assert(rc == 0);
   free(addrs);
 }
@@ -35,6 +41,8 @@ TCPConnector::TCPConnector() {
   recv_buf_ = new char[TCP_BUF_SIZE];
 }
 
+TCPConnector::TCPConnector(int sock_fd) : TCPConnector() { sock_fd_ = sock_fd; }
+
 TCPConnector::~TCPConnector() {
   if (send_buf_ != nullptr) {
     delete[] send_buf_;
@@ -80,6 +88,16 @@ bool TCPConnector::Connect() {
   return sock_fd_ != -1;
 }
 
+std::unique_ptr<TCPConnector> TCPConnector::Accept() {
+  assert(is_sever_);
+  int sock_fd = accept(sock_fd_, nullptr, 0);
+  if (sock_fd == -1) {
+    LOG(ERROR) << "server : accept failed.";
+    return nullptr;
+  }
+  return std::unique_ptr<TCPConnector>(new TCPConnector(sock_fd));
+}
+
 bool TCPConnector::Sync() {
   memset(send_buf_, 0, TCP_BUF_SIZE);
   send_buf_[0] = sync_counter_++;
@@ -87,24 +105,45 @@ bool TCPConnector::Sync() {
   sync_counter_ = sync_counter_ % 256;
   sync_counter_ = sync_counter_ == 0 ? 1 : sync_counter_;
 
-  write(sock_fd_, send_buf_, 1);
-  int recv_num = read(sock_fd_, recv_buf_, 1);
-  assert(recv_num == 1);
+  if (send(sock_fd_, send_buf_, 1, MSG_NOSIGNAL) != 1 || read(sock_fd_, recv_buf_, 1) != 1) {
+    LOG(ERROR) << "fail to sync with the peer";
+    return false;
+  }
 
   return recv_buf_[0] == send_buf_[0];
 }
 
 int TCPConnector::ExchangeData(const char *send_buf, int send_size, char *recv_buf, int recv_size) {
-  int rc = write(sock_fd_, send_buf, send_size);
-  assert(rc == send_size);
-  rc = 0;
+  // move both directions at once, so that a large exchange does not block both peers on a
+  // full socket buffer
+  int sent = 0;
   int recv = 0;
-  while (rc == 0 && recv < recv_size) {
-    int read_bytes = read(sock_fd_, recv_buf, recv_size);
-    if (read_bytes > 0) {
+  while (sent < send_size || recv < recv_size) {
+    pollfd pfd = {.fd = sock_fd_, .events = 0, .revents = 0};
+    pfd.events |= sent < send_size ? POLLOUT : 0;
+    pfd.events |= recv < recv_size ? POLLIN : 0;
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (pfd.revents & POLLOUT) {
+      // a peer which drops during a bulk connect must fail the exchange, not raise SIGPIPE
+      int send_bytes =
+          send(sock_fd_, send_buf + sent, send_size - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (send_bytes < 0 && errno != EAGAIN && errno != EINTR) {
+        LOG(ERROR) << "fail to send " << send_size - sent << " bytes";
+        return -1;
+      }
+      sent += std::max(send_bytes, 0);
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      int read_bytes = read(sock_fd_, recv_buf + recv, recv_size - recv);
+      if (read_bytes <= 0) {
+        break;
+      }
       recv += read_bytes;
-    } else {
-      rc = read_bytes;
     }
   }
   return recv;
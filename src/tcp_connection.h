@@ -1,12 +1,15 @@
+#pragma once
 #include <netdb.h>
 #include <sys/socket.h>
+#include <memory>
 #include <string>
 #define TCP_BUF_SIZE 1
+#define TCP_BACKLOG 128
 
 class TCPConnector {
  public:
   // Sever
-  TCPConnector(std::string ip_port);
+  TCPConnector(std::string ip_port, int backlog = TCP_BACKLOG);
   // Client
   TCPConnector();
 
@@ -18,6 +21,9 @@ class TCPConnector {
   bool Connect(std::string ip_addr, std::string ip_port);
   // only for sever
   bool Connect();
+  // only for sever, accept one peer into a new connector and keep listening, safe to call
+  // from several threads at once
+  std::unique_ptr<TCPConnector> Accept();
 
   bool Sync();
   int ExchangeData(const char *send_buf, int send_size, char *recv_buf, int recv_size);
@@ -25,6 +31,8 @@ class TCPConnector {
   char *Buf() { return send_buf_; }
 
  private:
+  explicit TCPConnector(int sock_fd);
+
   int sync_counter_ = 1;
   bool is_sever_ = false;
   int sock_fd_ = -1;
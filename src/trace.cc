@@ -0,0 +1,201 @@
+#include "trace.h"
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include "stats.h"
+
+struct TraceRing {
+  std::atomic<uint32_t> tid;
+  // cleared when the owner exits, the next thread which records takes the ring over
+  std::atomic<bool> owned;
+  // only the owner thread writes, writing is bumped before a record is overwritten and head
+  // after it is complete, so a dump which copied a record rereads writing to tell whether
+  // the copy is intact
+  std::atomic<uint64_t> writing;
+  std::atomic<uint64_t> head;
+  // head when the current owner took the ring, older records belong to an exited thread
+  std::atomic<uint64_t> start;
+  TraceRecord records[TRACE_RING_SIZE];
+  TraceRing *next;
+};
+
+// rings are never freed, a dump still shows the history of an exited thread until another
+// thread takes over its ring
+static std::atomic<TraceRing *> g_rings(nullptr);
+
+static TraceRing *ClaimRing() {
+  for (TraceRing *ring = g_rings.load(std::memory_order_acquire); ring != nullptr;
+       ring = ring->next) {
+    bool owned = false;
+    if (!ring->owned.load(std::memory_order_relaxed) &&
+        ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+      ring->start.store(ring->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      ring->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+      return ring;
+    }
+  }
+  TraceRing *ring = new TraceRing();
+  ring->tid.store(syscall(SYS_gettid), std::memory_order_relaxed);
+  ring->owned.store(true, std::memory_order_relaxed);
+  ring->writing.store(0, std::memory_order_relaxed);
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->start.store(0, std::memory_order_relaxed);
+  ring->next = g_rings.load(std::memory_order_relaxed);
+  while (!g_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+  }
+  return ring;
+}
+
+// hands the ring back when its thread exits
+struct RingOwner {
+  TraceRing *ring = nullptr;
+  ~RingOwner() {
+    if (ring != nullptr) {
+      ring->owned.store(false, std::memory_order_release);
+    }
+  }
+};
+static thread_local RingOwner t_owner;
+
+static TraceRing *LocalRing() {
+  if (t_owner.ring == nullptr) {
+    t_owner.ring = ClaimRing();
+  }
+  return t_owner.ring;
+}
+
+// fields of records are accessed atomically, as a dump may copy one while its owner writes
+template <typename T>
+static inline void StoreRelaxed(T *field, T value) {
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+static inline T LoadRelaxed(const T *field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+void TraceRecordEvent(uint8_t event, uint8_t op, uint32_t qp_num, uint64_t wr_id, uint32_t size,
+                      uint16_t status) {
+  TraceRing *ring = LocalRing();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  ring->writing.store(head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  TraceRecord *record = &ring->records[head % TRACE_RING_SIZE];
+  StoreRelaxed<uint64_t>(&record->ts_ns,
+                         std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count());
+  StoreRelaxed(&record->wr_id, wr_id);
+  StoreRelaxed(&record->size, size);
+  StoreRelaxed(&record->qp_num, qp_num);
+  StoreRelaxed(&record->event, event);
+  StoreRelaxed(&record->op, op);
+  StoreRelaxed(&record->status, status);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+// formatting helpers which neither allocate nor lock, so dumps work in a signal handler
+class LineWriter {
+ public:
+  explicit LineWriter(int fd) : fd_(fd) {}
+  LineWriter &Str(const char *str) {
+    while (*str != '\0' && len_ < sizeof(buf_)) {
+      buf_[len_++] = *str++;
+    }
+    return *this;
+  }
+  LineWriter &Num(uint64_t num) {
+    char digits[20];
+    int n = 0;
+    do {
+      digits[n++] = '0' + num % 10;
+      num /= 10;
+    } while (num != 0);
+    while (n > 0 && len_ < sizeof(buf_)) {
+      buf_[len_++] = digits[--n];
+    }
+    return *this;
+  }
+  void End() {
+    Str("\n");
+    ssize_t rc = write(fd_, buf_, len_);
+    (void)rc;
+    len_ = 0;
+  }
+
+ private:
+  int fd_;
+  char buf_[256];
+  size_t len_ = 0;
+};
+
+static const char *EventName(uint8_t event) {
+  switch (event) {
+    case TRACE_POST_SEND:
+      return "post_send";
+    case TRACE_POST_RECV:
+      return "post_recv";
+    case TRACE_COMPLETE:
+      return "complete";
+    case TRACE_FAIL:
+      return "fail";
+    default:
+      return "unknown";
+  }
+}
+
+void TraceDump(int fd) {
+  LineWriter out(fd);
+  for (TraceRing *ring = g_rings.load(std::memory_order_acquire); ring != nullptr;
+       ring = ring->next) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    first = std::max(first, ring->start.load(std::memory_order_relaxed));
+    out.Str("trace of thread ").Num(ring->tid.load(std::memory_order_relaxed)).Str(" : ");
+    out.Num(head - first).Str(" events").End();
+    for (uint64_t i = first; i < head; i++) {
+      const TraceRecord *slot = &ring->records[i % TRACE_RING_SIZE];
+      TraceRecord record;
+      record.ts_ns = LoadRelaxed(&slot->ts_ns);
+      record.wr_id = LoadRelaxed(&slot->wr_id);
+      record.size = LoadRelaxed(&slot->size);
+      record.qp_num = LoadRelaxed(&slot->qp_num);
+      record.event = LoadRelaxed(&slot->event);
+      record.op = LoadRelaxed(&slot->op);
+      record.status = LoadRelaxed(&slot->status);
+      // the owner may have started to overwrite the record while it was copied
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t writing = ring->writing.load(std::memory_order_relaxed);
+      if (writing > TRACE_RING_SIZE && i < writing - TRACE_RING_SIZE) {
+        continue;
+      }
+      out.Str("  ").Num(record.ts_ns).Str(" ").Str(EventName(record.event));
+      out.Str(" op=").Str(StatsOpName(record.op)).Str(" qp=").Num(record.qp_num);
+      out.Str(" wr_id=").Num(record.wr_id).Str(" size=").Num(record.size);
+      out.Str(" status=").Num(record.status).End();
+    }
+  }
+}
+
+static void CrashHandler(int sig) {
+  LineWriter(STDERR_FILENO).Str("caught signal ").Num(sig).Str(", dump RDMA trace").End();
+  TraceDump(STDERR_FILENO);
+  // the handler was reset, so the signal now takes its default action
+  raise(sig);
+}
+
+void TraceInstallCrashHandler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = CrashHandler;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+    sigaction(sig, &action, nullptr);
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_OP 2
+
+// set by the build, TRACE_OP records every post and completion, TRACE_ERROR only failures
+#ifndef RDMA_TRACE_LEVEL
+#define RDMA_TRACE_LEVEL TRACE_ERROR
+#endif
+
+#define TRACE_RING_SIZE 4096
+
+enum TraceEvent : uint8_t {
+  TRACE_POST_SEND,
+  TRACE_POST_RECV,
+  TRACE_COMPLETE,
+  TRACE_FAIL,
+};
+
+struct TraceRecord {
+  /* one event in the binary ring of a thread, formatted only when dumped */
+  uint64_t ts_ns;  /* steady clock */
+  uint64_t wr_id;  /* token of the request */
+  uint32_t size;   /* bytes posted or received */
+  uint32_t qp_num; /* QP of the request */
+  uint8_t event;   /* TraceEvent */
+  uint8_t op;      /* Opcode or STATS_RECV */
+  uint16_t status; /* ibv_wc_status of completions */
+};
+
+// append to the ring of the calling thread, lock free and without formatting
+void TraceRecordEvent(uint8_t event, uint8_t op, uint32_t qp_num, uint64_t wr_id, uint32_t size,
+                      uint16_t status);
+// write the records of every thread as text, oldest first, async signal safe
+void TraceDump(int fd);
+// dump to stderr when the process dies of SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT
+void TraceInstallCrashHandler();
+
+// compiled out when level is above RDMA_TRACE_LEVEL
+#define RDMA_TRACE(level, ...)       \
+  do {                               \
+    if (level <= RDMA_TRACE_LEVEL) { \
+      TraceRecordEvent(__VA_ARGS__); \
+    }                                \
+  } while (0)
@@ -0,0 +1,58 @@
+#pragma once
+#include <infiniband/verbs.h>
+#include <cstdint>
+
+// opcode of the completion of a send queue request
+inline ibv_wc_opcode WCOpcode(ibv_wr_opcode opcode) {
+  switch (opcode) {
+    case IBV_WR_RDMA_WRITE:
+    case IBV_WR_RDMA_WRITE_WITH_IMM:
+      return IBV_WC_RDMA_WRITE;
+    case IBV_WR_RDMA_READ:
+      return IBV_WC_RDMA_READ;
+    case IBV_WR_ATOMIC_FETCH_AND_ADD:
+      return IBV_WC_FETCH_ADD;
+    case IBV_WR_ATOMIC_CMP_AND_SWP:
+      return IBV_WC_COMP_SWAP;
+    default:
+      return IBV_WC_SEND;
+  }
+}
+
+// The QP and CQ under an RDMA instance. Work requests and completions keep the verbs layout
+// for every backend, so RDMA builds and dispatches them the same way whether they go to a
+// device or to the software backend of soft_transport.h. Every call follows the contract of
+// the verbs call of the same name.
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  // number identifying the QP to the peer and in its completions
+  virtual uint32_t QPNum() const = 0;
+  // return 0 or an errno
+  virtual int ModifyQP(ibv_qp_attr *attr, int mask) = 0;
+  virtual int PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) = 0;
+  virtual int PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) = 0;
+  // return the number of completions reaped, or a negative value on error
+  virtual int PollCQ(int num, ibv_wc *wcs) = 0;
+};
+
+// a QP and CQ of a device, created and destroyed by their RDMA instance
+class VerbsTransport : public Transport {
+ public:
+  VerbsTransport(ibv_qp *qp, ibv_cq *cq) : qp_(qp), cq_(cq) {}
+
+  uint32_t QPNum() const override { return qp_->qp_num; }
+  int ModifyQP(ibv_qp_attr *attr, int mask) override { return ibv_modify_qp(qp_, attr, mask); }
+  int PostSend(ibv_send_wr *wr, ibv_send_wr **bad_wr) override {
+    return ibv_post_send(qp_, wr, bad_wr);
+  }
+  int PostRecv(ibv_recv_wr *wr, ibv_recv_wr **bad_wr) override {
+    return ibv_post_recv(qp_, wr, bad_wr);
+  }
+  int PollCQ(int num, ibv_wc *wcs) override { return ibv_poll_cq(cq_, num, wcs); }
+
+ private:
+  ibv_qp *qp_;
+  ibv_cq *cq_;
+};
@@ -10,7 +10,9 @@ int main(int argc, char **argv) {
 
   EXPECT_TRUE(client.Sync());
 
-  EXPECT_TRUE(client.Write("Hahhhh"));
+  // notify the server with the immediate instead of another TCP sync
+  strcpy(client.Buf(), "Hahhhh");
+  EXPECT_TRUE(client.WriteWithImm(client.BufMR(), 0, strlen("Hahhhh") + 1, 0, 6));
   EXPECT_EQ(client.Read(), std::string("Hahhhh"));
   return 0;
 }
@@ -0,0 +1,151 @@
+#include "connection_group.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "soft_transport.h"
+#include "stats.h"
+
+#define GROUP_WORKERS 2
+#define GROUP_CONNS 4
+#define GROUP_QUEUE_DEPTH 8
+#define GROUP_OPS 500
+#define GROUP_SLOTS (BUF_SIZE / sizeof(uint64_t))
+
+static RDMAConfig SoftConfig() {
+  RDMAConfig config;
+  config.dev_name = SOFT_DEVICE;
+  config.shm = false;
+  config.max_send_wr = GROUP_QUEUE_DEPTH;
+  config.max_recv_wr = GROUP_QUEUE_DEPTH;
+  config.stats = true;
+  return config;
+}
+
+static bool Connect(RDMA *a, RDMA *b) {
+  a->SetRemoteInfo(b->LocalInfo());
+  b->SetRemoteInfo(a->LocalInfo());
+  return a->ModifyQP(INIT) && a->ModifyQP(RTR) && a->ModifyQP(RTS) && b->ModifyQP(INIT) &&
+         b->ModifyQP(RTR) && b->ModifyQP(RTS);
+}
+
+static void CountDone(void *arg, const Completion &comp) {
+  if (comp.status == IBV_WC_SUCCESS) {
+    static_cast<std::atomic<int> *>(arg)->fetch_add(1);
+  }
+}
+
+// far more operations than the QPs and the submission queues hold, so the workers keep
+// operations waiting on full QPs and Submit pushes back on full queues
+TEST(ConnectionGroupTest, SubmitBeyondQueueDepth) {
+  std::shared_ptr<Device> device = Device::Open(SOFT_DEVICE);
+  ASSERT_NE(device, nullptr);
+  ConnectionGroup group(device, GROUP_WORKERS, GROUP_CQE_NUM, GROUP_QUEUE_DEPTH * 2);
+  ASSERT_TRUE(group.Init());
+
+  std::vector<std::unique_ptr<RDMA>> peers;
+  uint32_t ids[GROUP_CONNS];
+  // the worker reads the source of an op when it posts it, so every op has its own
+  MemoryRegion *srcs[GROUP_CONNS];
+  for (int i = 0; i < GROUP_CONNS; i++) {
+    std::unique_ptr<RDMA> rdma(new RDMA(1, 0, group.WorkerConfig(i % GROUP_WORKERS,
+                                                                 SoftConfig())));
+    std::unique_ptr<RDMA> peer(new RDMA(1, 0, SoftConfig()));
+    ASSERT_TRUE(rdma->Init(device));
+    ASSERT_TRUE(peer->Init(device));
+    ASSERT_TRUE(Connect(rdma.get(), peer.get()));
+    srcs[i] = rdma->AllocMemory(GROUP_OPS * sizeof(uint64_t));
+    ASSERT_NE(srcs[i], nullptr);
+    ASSERT_TRUE(group.Add(i % GROUP_WORKERS, std::move(rdma), &ids[i]));
+    peers.push_back(std::move(peer));
+  }
+  ASSERT_TRUE(group.Start(false));
+
+  std::atomic<int> done{0};
+  for (int n = 0; n < GROUP_OPS; n++) {
+    for (int i = 0; i < GROUP_CONNS; i++) {
+      uint64_t value = n;
+      memcpy(srcs[i]->addr + n * sizeof(value), &value, sizeof(value));
+      Operation op = {.conn = ids[i], .recv = false,
+                      .req = {.op = RDMA_WRITE, .mr = srcs[i], .offset = n * sizeof(value),
+                              .length = sizeof(value),
+                              .remote_offset = n % GROUP_SLOTS * sizeof(value)},
+                      .done = CountDone, .arg = &done};
+      while (!group.Submit(op)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (done.load() < GROUP_OPS * GROUP_CONNS && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  group.Stop();
+  ASSERT_EQ(done.load(), GROUP_OPS * GROUP_CONNS);
+
+  // WRITEs of a connection execute in order, so each slot holds the last value written to it
+  for (int i = 0; i < GROUP_CONNS; i++) {
+    // completions and polls of the worker CQ are counted by the connection
+    StatsSnapshot snap;
+    group.Conn(ids[i])->GetStats()->Snapshot(&snap);
+    EXPECT_EQ(snap.completions[RDMA_WRITE], (uint64_t)GROUP_OPS);
+    EXPECT_GT(snap.polls, 0u);
+  }
+  for (const std::unique_ptr<RDMA> &peer : peers) {
+    for (uint64_t n = GROUP_OPS - GROUP_SLOTS; n < GROUP_OPS; n++) {
+      uint64_t value;
+      memcpy(&value, peer->Buf() + n % GROUP_SLOTS * sizeof(value), sizeof(value));
+      ASSERT_EQ(value, n);
+    }
+  }
+}
+
+// receives on a connection whose peer never sends fill its QP and its waiting ring, the
+// WRITEs of another connection of the same worker still go through
+TEST(ConnectionGroupTest, FullConnectionDoesNotBlockWorker) {
+  std::shared_ptr<Device> device = Device::Open(SOFT_DEVICE);
+  ASSERT_NE(device, nullptr);
+  ConnectionGroup group(device, 1, GROUP_CQE_NUM, GROUP_QUEUE_DEPTH * 2);
+  ASSERT_TRUE(group.Init());
+
+  std::vector<std::unique_ptr<RDMA>> peers;
+  uint32_t ids[2];
+  for (int i = 0; i < 2; i++) {
+    std::unique_ptr<RDMA> rdma(new RDMA(1, 0, group.WorkerConfig(0, SoftConfig())));
+    std::unique_ptr<RDMA> peer(new RDMA(1, 0, SoftConfig()));
+    ASSERT_TRUE(rdma->Init(device));
+    ASSERT_TRUE(peer->Init(device));
+    ASSERT_TRUE(Connect(rdma.get(), peer.get()));
+    ASSERT_TRUE(group.Add(0, std::move(rdma), &ids[i]));
+    peers.push_back(std::move(peer));
+  }
+  ASSERT_TRUE(group.Start(false));
+
+  std::atomic<int> received{0};
+  for (int n = 0; n < GROUP_QUEUE_DEPTH * 2 + GROUP_QUEUE_DEPTH / 2; n++) {
+    Operation op = {.conn = ids[0], .recv = true,
+                    .req = {.mr = group.Conn(ids[0])->BufMR(), .offset = 0, .length = 8},
+                    .done = CountDone, .arg = &received};
+    while (!group.Submit(op)) {
+      std::this_thread::yield();
+    }
+  }
+  std::atomic<int> written{0};
+  for (int n = 0; n < GROUP_OPS; n++) {
+    Operation op = {.conn = ids[1], .recv = false,
+                    .req = {.op = RDMA_WRITE, .mr = group.Conn(ids[1])->BufMR(), .offset = 0,
+                            .length = 8},
+                    .done = CountDone, .arg = &written};
+    while (!group.Submit(op)) {
+      std::this_thread::yield();
+    }
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (written.load() < GROUP_OPS && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  group.Stop();
+  EXPECT_EQ(written.load(), GROUP_OPS);
+  EXPECT_EQ(received.load(), 0);
+}
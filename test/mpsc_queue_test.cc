@@ -0,0 +1,72 @@
+#include "mpsc_queue.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+TEST(MPSCQueueTest, Simple) {
+  MPSCQueue<int> queue(3);
+  EXPECT_EQ(queue.Capacity(), 4u);
+  int item;
+  EXPECT_FALSE(queue.Pop(&item));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.Push(i));
+  }
+  EXPECT_FALSE(queue.Push(4));
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(queue.Pop(&item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(queue.Pop(&item));
+  EXPECT_TRUE(queue.Push(5));
+  ASSERT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(item, 5);
+}
+
+TEST(MPSCQueueTest, Front) {
+  MPSCQueue<int> queue(2);
+  EXPECT_EQ(queue.Front(), nullptr);
+  EXPECT_TRUE(queue.Push(1));
+  EXPECT_TRUE(queue.Push(2));
+  ASSERT_NE(queue.Front(), nullptr);
+  EXPECT_EQ(*queue.Front(), 1);
+  int item;
+  ASSERT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(item, 1);
+  EXPECT_EQ(*queue.Front(), 2);
+  ASSERT_TRUE(queue.Pop(&item));
+  EXPECT_EQ(queue.Front(), nullptr);
+}
+
+TEST(MPSCQueueTest, ManyProducers) {
+  const int producers = 4;
+  const int items = 20000;
+  MPSCQueue<uint64_t> queue(256);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < items; i++) {
+        while (!queue.Push((uint64_t)p << 32 | i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  // items of one producer arrive in the order it pushed them
+  std::vector<int> next(producers, 0);
+  for (int n = 0; n < producers * items;) {
+    uint64_t item;
+    if (!queue.Pop(&item)) {
+      continue;
+    }
+    int p = item >> 32;
+    EXPECT_EQ((int)(item & UINT32_MAX), next[p]);
+    next[p]++;
+    n++;
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  for (int p = 0; p < producers; p++) {
+    EXPECT_EQ(next[p], items);
+  }
+}
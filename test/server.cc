@@ -10,6 +10,9 @@ int main(int argc, char **argv) {
   
   EXPECT_TRUE(sever.Sync());
 
+  uint32_t imm_data;
+  EXPECT_TRUE(sever.RecvImm(&imm_data));
+  EXPECT_EQ(imm_data, 6u);
   EXPECT_STREQ(sever.Buf(), "Hahhhh");
   return 0;
 }
@@ -0,0 +1,277 @@
+#include "shm_transport.h"
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstring>
+#include <thread>
+#include "client.h"
+#include "server.h"
+#include "soft_transport.h"
+
+// both ends run in this process on the software device, which is on the same host
+static RDMAConfig ShmConfig() {
+  RDMAConfig config;
+  config.dev_name = SOFT_DEVICE;
+  config.shm = true;
+  return config;
+}
+
+static bool ConnectPair(Server *server, Client *client, const char *port) {
+  bool server_ok = false;
+  std::thread server_thread([&]() { server_ok = server->Connect(); });
+  bool ok = client->Connect("127.0.0.1", port);
+  server_thread.join();
+  return ok && server_ok;
+}
+
+// some sandboxes forbid process_vm_readv even on the own process
+#define SKIP_WITHOUT_ACCESS()                                  \
+  do {                                                         \
+    char byte = 0;                                             \
+    if (!ShmTransport::CanAccess(getpid(), (uint64_t)&byte)) { \
+      GTEST_SKIP() << "process_vm_readv is not allowed";       \
+    }                                                          \
+  } while (0)
+
+TEST(ShmRingTest, WrapAround) {
+  std::unique_ptr<ShmRing> consumer = ShmRing::Create(4096);
+  ASSERT_NE(consumer, nullptr);
+  std::unique_ptr<ShmRing> producer = ShmRing::Open(getpid(), consumer->FD(), consumer->Key());
+  ASSERT_NE(producer, nullptr);
+  EXPECT_EQ(ShmRing::Open(getpid(), consumer->FD(), consumer->Key() + 1), nullptr);
+
+  // 3 records of 1200 bytes fit at once, the rounds move them across the end of the ring
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < 3; i++) {
+      ShmRecord *record = producer->Reserve(1200);
+      ASSERT_NE(record, nullptr);
+      record->type = SHM_SEND;
+      memset(record + 1, 'a' + round * 3 + i, 1200);
+      producer->Commit();
+    }
+    EXPECT_EQ(producer->Reserve(1200), nullptr);
+    for (int i = 0; i < 3; i++) {
+      const ShmRecord *record = consumer->Front();
+      ASSERT_NE(record, nullptr);
+      EXPECT_EQ(record->length, 1200u);
+      EXPECT_EQ(((const char *)(record + 1))[1199], (char)('a' + round * 3 + i));
+      consumer->Pop();
+    }
+    EXPECT_EQ(consumer->Front(), nullptr);
+  }
+}
+
+TEST(ShmKeyTableTest, AddRemove) {
+  std::unique_ptr<ShmKeyTable> owner = ShmKeyTable::Create();
+  ASSERT_NE(owner, nullptr);
+  std::unique_ptr<ShmKeyTable> peer = ShmKeyTable::Open(getpid(), owner->FD(), owner->Key());
+  ASSERT_NE(peer, nullptr);
+  EXPECT_EQ(ShmKeyTable::Open(getpid(), owner->FD(), owner->Key() + 1), nullptr);
+
+  EXPECT_TRUE(owner->Add(7, 4096, 1024, IBV_ACCESS_REMOTE_READ));
+  // a key which probes into the slot of key 7
+  EXPECT_TRUE(owner->Add(7 + SHM_KEY_SLOTS, 8192, 64, BUF_ACCESS));
+  EXPECT_TRUE(peer->Check(7, 4096, 1024, IBV_ACCESS_REMOTE_READ));
+  EXPECT_FALSE(peer->Check(7, 4096, 1025, IBV_ACCESS_REMOTE_READ));
+  EXPECT_FALSE(peer->Check(7, 4000, 8, IBV_ACCESS_REMOTE_READ));
+  EXPECT_FALSE(peer->Check(7, 4096, 8, IBV_ACCESS_REMOTE_WRITE));
+  EXPECT_FALSE(peer->Check(8, 4096, 8, IBV_ACCESS_REMOTE_READ));
+  EXPECT_TRUE(peer->Check(7 + SHM_KEY_SLOTS, 8192, 64, IBV_ACCESS_REMOTE_WRITE));
+
+  owner->Remove(7);
+  EXPECT_FALSE(peer->Check(7, 4096, 8, IBV_ACCESS_REMOTE_READ));
+  EXPECT_TRUE(peer->Check(7 + SHM_KEY_SLOTS, 8192, 64, IBV_ACCESS_REMOTE_WRITE));
+}
+
+TEST(ShmTransportTest, SendRecv) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23390", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23390"));
+  EXPECT_TRUE(server.UsesSharedMemory());
+  EXPECT_TRUE(client.UsesSharedMemory());
+  std::thread server_thread([&]() {
+    EXPECT_EQ(server.Recv(), "hello shm");
+    EXPECT_TRUE(server.Send("hello client"));
+  });
+  EXPECT_TRUE(client.Send("hello shm"));
+  EXPECT_EQ(client.Recv(), "hello client");
+  server_thread.join();
+}
+
+TEST(ShmTransportTest, LargeSend) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23391", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23391"));
+  // larger than the ring, the sender waits for the receiver to make room
+  const uint32_t length = 2 * SHM_RING_SIZE;
+  MemoryRegion *send_mr = client.AllocMemory(length);
+  MemoryRegion *recv_mr = server.AllocMemory(length);
+  ASSERT_NE(send_mr, nullptr);
+  ASSERT_NE(recv_mr, nullptr);
+  for (uint32_t i = 0; i < length; i++) {
+    send_mr->addr[i] = (char)(i * 7);
+  }
+  int64_t received = -1;
+  std::thread server_thread([&]() { received = server.Recv(recv_mr, 0, length); });
+  EXPECT_TRUE(client.Send(send_mr, 0, length));
+  server_thread.join();
+  EXPECT_EQ(received, length);
+  EXPECT_EQ(memcmp(send_mr->addr, recv_mr->addr, length), 0);
+}
+
+TEST(ShmTransportTest, WriteReadAtomic) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23392", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23392"));
+  EXPECT_TRUE(client.Write("one-sided"));
+  EXPECT_STREQ(server.Buf(), "one-sided");
+
+  strcpy(server.Buf(), "from server");
+  EXPECT_EQ(client.Read(), "from server");
+
+  // atomics go through the NIC, the WRITE behind them waits until they are done
+  memset(server.Buf(), 0, 2 * ATOMIC_SIZE);
+  WorkRequest req = {.op = RDMA_FETCH_ADD, .mr = client.BufMR(), .offset = 0,
+                     .length = ATOMIC_SIZE, .compare_add = 1};
+  ASSERT_EQ(client.PostSend(&req, 1), 1);
+  uint64_t old;
+  EXPECT_TRUE(client.FetchAdd(client.BufMR(), 0, 0, 5, &old));
+  EXPECT_EQ(old, 1u);
+  EXPECT_TRUE(client.CompareSwap(client.BufMR(), 0, 0, 6, 42, &old));
+  EXPECT_EQ(old, 6u);
+  uint64_t value = 7;
+  memcpy(client.Buf() + ATOMIC_SIZE, &value, sizeof(value));
+  EXPECT_TRUE(client.Write(client.BufMR(), ATOMIC_SIZE, ATOMIC_SIZE, ATOMIC_SIZE));
+  memcpy(&value, server.Buf(), sizeof(value));
+  EXPECT_EQ(value, 42u);
+  memcpy(&value, server.Buf() + ATOMIC_SIZE, sizeof(value));
+  EXPECT_EQ(value, 7u);
+}
+
+TEST(ShmTransportTest, WriteWithImm) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23393", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23393"));
+  strcpy(client.Buf(), "imm");
+  EXPECT_TRUE(client.WriteWithImm(client.BufMR(), 0, 4, 0, 0xbeef));
+  uint32_t imm;
+  EXPECT_TRUE(server.RecvImm(&imm));
+  EXPECT_EQ(imm, 0xbeefu);
+  // the data lands before the notification
+  EXPECT_STREQ(server.Buf(), "imm");
+}
+
+TEST(ShmTransportTest, RemoteAccessError) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23394", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23394"));
+  // an address which is not mapped in the peer
+  RemoteRegion remote = {.addr = 8, .length = 64, .rkey = 0};
+  WorkRequest req = {.op = RDMA_WRITE, .mr = client.BufMR(), .offset = 0, .length = 8,
+                     .signaled = true, .remote = &remote};
+  uint64_t tokens[2];
+  ASSERT_EQ(client.PostSend(&req, 1, tokens), 1);
+  req.op = RDMA_READ;
+  ASSERT_EQ(client.PostSend(&req, 1, tokens + 1), 1);
+  Completion comp;
+  EXPECT_FALSE(client.Wait(tokens[0], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_REM_ACCESS_ERR);
+  EXPECT_FALSE(client.Wait(tokens[1], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_WR_FLUSH_ERR);
+}
+
+TEST(ShmTransportTest, RemoteKeyCheck) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23396", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23396"));
+  // regions registered after the connection is set up are published too
+  MemoryRegion *mr = server.AllocMemory(64, false, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+  ASSERT_NE(mr, nullptr);
+  strcpy(mr->addr, "read only");
+  RemoteRegion remote = mr->Remote();
+  WorkRequest req = {.op = RDMA_READ, .mr = client.BufMR(), .offset = 0, .length = 10,
+                     .signaled = true, .remote = &remote};
+  uint64_t token;
+  ASSERT_EQ(client.PostSend(&req, 1, &token), 1);
+  EXPECT_TRUE(client.Wait(token));
+  EXPECT_STREQ(client.Buf(), "read only");
+
+  // mapped memory of the peer, but the region does not grant the access
+  req.op = RDMA_WRITE;
+  ASSERT_EQ(client.PostSend(&req, 1, &token), 1);
+  Completion comp;
+  EXPECT_FALSE(client.Wait(token, &comp));
+  EXPECT_EQ(comp.status, IBV_WC_REM_ACCESS_ERR);
+  EXPECT_STREQ(mr->addr, "read only");
+}
+
+TEST(ShmTransportTest, WrongRemoteKey) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23397", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23397"));
+  // the exchanged buffer with a key the peer never registered
+  RemoteRegion remote = client.RemoteBuf();
+  remote.rkey += 1000;
+  WorkRequest req = {.op = RDMA_WRITE, .mr = client.BufMR(), .offset = 0, .length = 8,
+                     .signaled = true, .remote = &remote};
+  uint64_t token;
+  ASSERT_EQ(client.PostSend(&req, 1, &token), 1);
+  Completion comp;
+  EXPECT_FALSE(client.Wait(token, &comp));
+  EXPECT_EQ(comp.status, IBV_WC_REM_ACCESS_ERR);
+}
+
+TEST(ShmTransportTest, OverlongSend) {
+  SKIP_WITHOUT_ACCESS();
+  Server server("23398", 1, 0, ShmConfig());
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23398"));
+  uint64_t recv_tokens[2];
+  recv_tokens[0] = server.PostRecv(server.BufMR(), 0, 4);
+  recv_tokens[1] = server.PostRecv(server.BufMR(), 0, 64);
+  ASSERT_NE(recv_tokens[0], INVALID_TOKEN);
+  ASSERT_NE(recv_tokens[1], INVALID_TOKEN);
+  Completion server_comps[2];
+  std::thread server_thread([&]() {
+    EXPECT_FALSE(server.Wait(recv_tokens[0], &server_comps[0]));
+    EXPECT_FALSE(server.Wait(recv_tokens[1], &server_comps[1]));
+  });
+  uint64_t send_tokens[2];
+  send_tokens[0] = client.PostSend(RDMA_SEND, client.BufMR(), 0, 16, 0, true);
+  send_tokens[1] = client.PostSend(RDMA_SEND, client.BufMR(), 0, 4, 0, true);
+  ASSERT_NE(send_tokens[0], INVALID_TOKEN);
+  ASSERT_NE(send_tokens[1], INVALID_TOKEN);
+  Completion comp;
+  // both sides fail the message and move to the error state, which flushes the rest
+  EXPECT_FALSE(client.Wait(send_tokens[0], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_REM_INV_REQ_ERR);
+  EXPECT_FALSE(client.Wait(send_tokens[1], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_WR_FLUSH_ERR);
+  server_thread.join();
+  EXPECT_EQ(server_comps[0].status, IBV_WC_LOC_LEN_ERR);
+  EXPECT_EQ(server_comps[1].status, IBV_WC_WR_FLUSH_ERR);
+
+  uint64_t token = client.PostRecv();
+  ASSERT_NE(token, INVALID_TOKEN);
+  EXPECT_FALSE(client.Wait(token, &comp));
+  EXPECT_EQ(comp.status, IBV_WC_WR_FLUSH_ERR);
+}
+
+TEST(ShmTransportTest, Disabled) {
+  RDMAConfig config = ShmConfig();
+  config.shm = false;
+  // one side without shared memory keeps both on the NIC
+  Server server("23395", 1, 0, config);
+  Client client(1, 0, ShmConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23395"));
+  EXPECT_FALSE(server.UsesSharedMemory());
+  EXPECT_FALSE(client.UsesSharedMemory());
+  EXPECT_TRUE(client.Write("over the NIC"));
+  EXPECT_STREQ(server.Buf(), "over the NIC");
+}
@@ -0,0 +1,175 @@
+#include "soft_transport.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "client.h"
+#include "server.h"
+
+static RDMAConfig SoftConfig() {
+  RDMAConfig config;
+  config.dev_name = SOFT_DEVICE;
+  // both ends run in this process, keep them off the shared memory path
+  config.shm = false;
+  return config;
+}
+
+// connect a server and a client of the software device over loopback
+static bool ConnectPair(Server *server, Client *client, const char *port) {
+  bool server_ok = false;
+  std::thread server_thread([&]() { server_ok = server->Connect(); });
+  bool ok = client->Connect("127.0.0.1", port);
+  server_thread.join();
+  return ok && server_ok;
+}
+
+TEST(SoftTransportTest, SendRecv) {
+  Server server("23380", 1, 0, SoftConfig());
+  Client client(1, 0, SoftConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23380"));
+  std::thread server_thread([&]() {
+    EXPECT_EQ(server.Recv(), "hello soft");
+    EXPECT_TRUE(server.Send("hello client"));
+  });
+  EXPECT_TRUE(client.Send("hello soft"));
+  EXPECT_EQ(client.Recv(), "hello client");
+  server_thread.join();
+}
+
+TEST(SoftTransportTest, WriteReadAtomic) {
+  Server server("23381", 1, 0, SoftConfig());
+  Client client(1, 0, SoftConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23381"));
+  EXPECT_TRUE(client.Write("one-sided"));
+  EXPECT_STREQ(server.Buf(), "one-sided");
+
+  strcpy(server.Buf(), "from server");
+  EXPECT_EQ(client.Read(), "from server");
+
+  memset(server.Buf(), 0, ATOMIC_SIZE);
+  uint64_t old;
+  EXPECT_TRUE(client.FetchAdd(client.BufMR(), 0, 0, 5, &old));
+  EXPECT_EQ(old, 0u);
+  EXPECT_TRUE(client.CompareSwap(client.BufMR(), 0, 0, 5, 42, &old));
+  EXPECT_EQ(old, 5u);
+  EXPECT_TRUE(client.CompareSwap(client.BufMR(), 0, 0, 5, 7, &old));
+  EXPECT_EQ(old, 42u);
+  uint64_t value;
+  memcpy(&value, server.Buf(), sizeof(value));
+  EXPECT_EQ(value, 42u);
+}
+
+TEST(SoftTransportTest, WriteWithImm) {
+  Server server("23382", 1, 0, SoftConfig());
+  Client client(1, 0, SoftConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23382"));
+  strcpy(client.Buf(), "imm");
+  // the WRITE waits for the receive it consumes
+  uint64_t token = client.PostSend(RDMA_WRITE_IMM, client.BufMR(), 0, 4, 0, true);
+  ASSERT_NE(token, INVALID_TOKEN);
+  client.PollCQ();
+  EXPECT_FALSE(client.IsDone(token));
+  EXPECT_STRNE(server.Buf(), "imm");
+
+  WorkRequest req = {.op = RDMA_WRITE_IMM, .mr = client.BufMR(), .offset = 0, .length = 4,
+                     .signaled = true, .imm_data = 0xbeef};
+  client.PostSend(&req, 1);
+  uint32_t imm;
+  EXPECT_TRUE(server.RecvImm(&imm));
+  EXPECT_EQ(imm, 0u);
+  EXPECT_TRUE(server.RecvImm(&imm));
+  EXPECT_EQ(imm, 0xbeefu);
+  EXPECT_STREQ(server.Buf(), "imm");
+  EXPECT_TRUE(client.Wait(token));
+}
+
+TEST(SoftTransportTest, WaitReusedSlot) {
+  RDMAConfig config = SoftConfig();
+  config.max_send_wr = 2;
+  Server server("23386", 1, 0, config);
+  Client client(1, 0, config);
+  ASSERT_TRUE(ConnectPair(&server, &client, "23386"));
+  uint64_t first = client.PostSend(RDMA_WRITE, client.BufMR(), 0, 8, 0, true);
+  ASSERT_NE(first, INVALID_TOKEN);
+  EXPECT_TRUE(client.Wait(first));
+  // two more requests wrap around the queue and take the slot of the first
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(client.Wait(client.PostSend(RDMA_WRITE, client.BufMR(), 0, 8, 0, true)));
+  }
+  Completion comp;
+  EXPECT_FALSE(client.Wait(first, &comp));
+  EXPECT_EQ(comp.status, IBV_WC_GENERAL_ERR);
+}
+
+TEST(SoftTransportTest, RemoteAccessError) {
+  Server server("23383", 1, 0, SoftConfig());
+  Client client(1, 0, SoftConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23383"));
+  // a READ only region cannot be written
+  MemoryRegion *mr = server.AllocMemory(64, false, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+  ASSERT_NE(mr, nullptr);
+  RemoteRegion remote = mr->Remote();
+  WorkRequest req = {.op = RDMA_WRITE, .mr = client.BufMR(), .offset = 0, .length = 8,
+                     .signaled = true, .remote = &remote};
+  uint64_t tokens[2];
+  ASSERT_EQ(client.PostSend(&req, 1, tokens), 1);
+  req.op = RDMA_READ;
+  ASSERT_EQ(client.PostSend(&req, 1, tokens + 1), 1);
+  Completion comp;
+  EXPECT_FALSE(client.Wait(tokens[0], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_REM_ACCESS_ERR);
+  // the QP is in the error state, everything after the error is flushed
+  EXPECT_FALSE(client.Wait(tokens[1], &comp));
+  EXPECT_EQ(comp.status, IBV_WC_WR_FLUSH_ERR);
+  // so is the responder, which flushes its receives
+  uint64_t token = server.PostRecv();
+  ASSERT_NE(token, INVALID_TOKEN);
+  EXPECT_FALSE(server.Wait(token, &comp));
+  EXPECT_EQ(comp.status, IBV_WC_WR_FLUSH_ERR);
+}
+
+TEST(SoftTransportTest, LinkLatency) {
+  std::shared_ptr<Device> device = Device::Open(SOFT_DEVICE);
+  ASSERT_NE(device, nullptr);
+  // 1 Gb/s moves 8 KiB in 65536 ns
+  device->SetSoftLink(100000, 1);
+  RDMAConfig config = SoftConfig();
+  config.buf_size = 8192;
+  Server server("23384", 1, 0, config);
+  Client client(1, 0, config);
+  ASSERT_TRUE(ConnectPair(&server, &client, "23384"));
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(client.Write(client.BufMR(), 0, 8192));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  // the data goes out, then the ack comes back
+  EXPECT_GE(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+            2 * 100000 + 65536);
+  device->SetSoftLink(0, 0);
+}
+
+TEST(SoftTransportTest, LinkDelaysData) {
+  std::shared_ptr<Device> device = Device::Open(SOFT_DEVICE);
+  ASSERT_NE(device, nullptr);
+  const int64_t latency_ns = 20000000;
+  device->SetSoftLink(latency_ns, 0);
+  Server server("23385", 1, 0, SoftConfig());
+  Client client(1, 0, SoftConfig());
+  ASSERT_TRUE(ConnectPair(&server, &client, "23385"));
+  strcpy(client.Buf(), "delayed");
+  memset(server.Buf(), 0, 8);
+  auto start = std::chrono::steady_clock::now();
+  uint64_t token = client.PostSend(RDMA_WRITE, client.BufMR(), 0, 8, 0, true);
+  ASSERT_NE(token, INVALID_TOKEN);
+  // a peer which polls memory sees the data once it is off the wire, nobody polls a CQ
+  EXPECT_STRNE(server.Buf(), "delayed");
+  while (__atomic_load_n(&server.Buf()[6], __ATOMIC_ACQUIRE) != 'd') {
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  }
+  EXPECT_STREQ(server.Buf(), "delayed");
+  EXPECT_GE(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count(),
+            latency_ns);
+  EXPECT_TRUE(client.Wait(token));
+  device->SetSoftLink(0, 0);
+}
@@ -0,0 +1,56 @@
+#include "stats.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+TEST(StatsTest, Snapshot) {
+  Stats stats;
+  stats.AddPost(RDMA_WRITE, 100);
+  stats.AddPost(RDMA_WRITE, 28);
+  stats.AddPost(STATS_RECV, 0);
+  stats.AddCompletion(RDMA_WRITE, 1000, 0);
+  stats.AddCompletion(STATS_RECV, 3000, 64);
+  stats.AddSharedRecv(32);
+  stats.AddError(IBV_WC_REM_ACCESS_ERR);
+  stats.AddPoll(0, 16);
+  stats.AddPoll(16, 16);
+  stats.AddPoll(3, 16);
+
+  StatsSnapshot snap;
+  stats.Snapshot(&snap);
+  EXPECT_EQ(snap.ops[RDMA_WRITE], 2u);
+  EXPECT_EQ(snap.bytes[RDMA_WRITE], 128u);
+  EXPECT_EQ(snap.bytes[STATS_RECV], 96u);
+  EXPECT_EQ(snap.completions[STATS_RECV], 2u);
+  EXPECT_EQ(snap.errors[IBV_WC_REM_ACCESS_ERR], 1u);
+  EXPECT_EQ(snap.polls, 3u);
+  EXPECT_EQ(snap.empty_polls, 1u);
+  EXPECT_EQ(snap.full_polls, 1u);
+  EXPECT_EQ(snap.SendOutstanding(), 1u);
+  EXPECT_EQ(snap.RecvOutstanding(), 0u);
+  // 1000 ns falls in [512, 1024)
+  EXPECT_DOUBLE_EQ(snap.Percentile(RDMA_WRITE, 50), 1.024);
+  EXPECT_EQ(snap.Percentile(RDMA_READ, 50), 0);
+  EXPECT_NE(snap.ToJSON().find("\"write\": 2"), std::string::npos);
+}
+
+TEST(StatsTest, ManyThreads) {
+  const int threads = 8;
+  const int iters = 10000;
+  Stats stats;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (int i = 0; i < iters; i++) {
+        stats.AddPost(RDMA_SEND, 1);
+      }
+    });
+  }
+  for (std::thread &t : workers) {
+    t.join();
+  }
+  StatsSnapshot snap;
+  stats.Snapshot(&snap);
+  EXPECT_EQ(snap.ops[RDMA_SEND], (uint64_t)threads * iters);
+  EXPECT_EQ(snap.bytes[RDMA_SEND], (uint64_t)threads * iters);
+}
@@ -1,6 +1,7 @@
 #include "tcp_connection.h"
 #include <gtest/gtest.h>
 #include <thread>
+#include <vector>
 
 struct DummyData {
   int a;
@@ -47,3 +48,48 @@ TEST(TCPConnectorTest, Simple) {
   testExchange(&server, true);
   client_thread.join();
 }
+
+TEST(TCPConnectorTest, AcceptMany) {
+  const int num = 4;
+  TCPConnector server("23336");
+  std::vector<std::thread> clients;
+  for (int i = 0; i < num; i++) {
+    clients.emplace_back([]() {
+      TCPConnector client;
+      ASSERT_TRUE(client.Connect("127.0.0.1", "23336"));
+      testSync(&client, false);
+      testExchange(&client, false);
+    });
+  }
+  for (int i = 0; i < num; i++) {
+    std::unique_ptr<TCPConnector> conn = server.Accept();
+    ASSERT_NE(conn, nullptr);
+    testSync(conn.get(), true);
+    testExchange(conn.get(), true);
+  }
+  for (std::thread &t : clients) {
+    t.join();
+  }
+}
+
+TEST(TCPConnectorTest, ExchangeLarge) {
+  // larger than the socket buffers, so both peers must send and receive at once
+  const int size = 8 << 20;
+  TCPConnector server("23337");
+  auto client_thread = std::thread([&]() {
+    TCPConnector client;
+    ASSERT_TRUE(client.Connect("127.0.0.1", "23337"));
+    std::vector<char> send_buf(size, 'c');
+    std::vector<char> recv_buf(size);
+    EXPECT_EQ(client.ExchangeData(send_buf.data(), size, recv_buf.data(), size), size);
+    EXPECT_EQ(recv_buf.front(), 's');
+    EXPECT_EQ(recv_buf.back(), 's');
+  });
+  ASSERT_TRUE(server.Connect());
+  std::vector<char> send_buf(size, 's');
+  std::vector<char> recv_buf(size);
+  EXPECT_EQ(server.ExchangeData(send_buf.data(), size, recv_buf.data(), size), size);
+  EXPECT_EQ(recv_buf.front(), 'c');
+  EXPECT_EQ(recv_buf.back(), 'c');
+  client_thread.join();
+}
\ No newline at end of file
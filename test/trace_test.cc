@@ -0,0 +1,63 @@
+#include "trace.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include "rdma.h"
+
+static std::string Dump() {
+  FILE *file = tmpfile();
+  TraceDump(fileno(file));
+  std::string text;
+  rewind(file);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(file);
+  return text;
+}
+
+TEST(TraceTest, Dump) {
+  std::thread([]() {
+    TraceRecordEvent(TRACE_POST_SEND, RDMA_WRITE, 7, 42, 64, 0);
+    TraceRecordEvent(TRACE_FAIL, RDMA_WRITE, 7, 42, 0, IBV_WC_REM_ACCESS_ERR);
+  }).join();
+  std::string text = Dump();
+  EXPECT_NE(text.find(" : 2 events"), std::string::npos);
+  EXPECT_NE(text.find("post_send op=write qp=7 wr_id=42 size=64 status=0"), std::string::npos);
+  EXPECT_NE(text.find("fail op=write qp=7 wr_id=42 size=0 status=10"), std::string::npos);
+}
+
+TEST(TraceTest, ReuseRing) {
+  std::thread([]() { TraceRecordEvent(TRACE_POST_SEND, RDMA_SEND, 3, 1, 0, 0); }).join();
+  std::string before = Dump();
+  // the ring of the exited thread is taken over instead of allocating another one
+  std::thread([]() { TraceRecordEvent(TRACE_POST_SEND, RDMA_SEND, 4, 2, 0, 0); }).join();
+  std::string after = Dump();
+  auto rings = [](const std::string &text) {
+    size_t count = 0;
+    for (size_t pos = text.find("trace of thread"); pos != std::string::npos;
+         pos = text.find("trace of thread", pos + 1)) {
+      count++;
+    }
+    return count;
+  };
+  EXPECT_EQ(rings(after), rings(before));
+  EXPECT_NE(after.find("qp=4 wr_id=2"), std::string::npos);
+  EXPECT_EQ(after.find("qp=3 wr_id=1"), std::string::npos);
+}
+
+TEST(TraceTest, Wrap) {
+  std::thread([]() {
+    for (int i = 0; i < TRACE_RING_SIZE + 10; i++) {
+      TraceRecordEvent(TRACE_COMPLETE, RDMA_READ, 1, i, 8, 0);
+    }
+  }).join();
+  std::string text = Dump();
+  EXPECT_NE(text.find(" : 4096 events"), std::string::npos);
+  // the oldest records are overwritten
+  EXPECT_EQ(text.find("wr_id=9 "), std::string::npos);
+  EXPECT_NE(text.find("wr_id=10 "), std::string::npos);
+}